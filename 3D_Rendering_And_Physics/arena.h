@@ -0,0 +1,110 @@
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <xmmintrin.h>
+#include "parameters.h"
+
+using namespace std;
+
+//Allocation counter
+//Replaces global operator new/delete so the main loop can check that a steady-state frame does not touch the heap.
+//The whole program is one translation unit, so defining the replacements in a header is fine. They are kept out of
+//line: inlined, the compiler would see malloc and free paired with new and delete expressions and warn about it.
+#ifdef _MSC_VER
+#define ALLOC_NOINLINE __declspec(noinline)
+#else
+#define ALLOC_NOINLINE __attribute__((noinline))
+#endif
+atomic<long long> allocCount(0);
+
+ALLOC_NOINLINE void* operator new(size_t size) {
+    allocCount.fetch_add(1, memory_order_relaxed);
+    if (void* ptr = malloc(size ? size : 1)) return ptr;
+    throw bad_alloc();
+}
+ALLOC_NOINLINE void* operator new[](size_t size) {
+    return operator new(size);
+}
+ALLOC_NOINLINE void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+ALLOC_NOINLINE void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+ALLOC_NOINLINE void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+ALLOC_NOINLINE void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+//Frame arena
+//Bump allocator for data that lives for one frame only (transformed vertices, light lists, ...).
+//Everything is released at once by reset(). If a frame needs more than the capacity, the extra
+//blocks come from the heap and the arena grows on the next reset, so steady-state frames never allocate.
+//The memory is taken on first use, so threads that never allocate from their arena cost nothing.
+struct FrameArena {
+    char* data = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t overflowBytes = 0;
+    size_t peak = 0;
+    char* overflowList = nullptr; //heap blocks taken this frame, linked through their first bytes
+
+    explicit FrameArena(size_t capacity) : capacity(capacity) {}
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+    ~FrameArena() {
+        releaseOverflow();
+        free(data);
+    }
+
+    void* allocBytes(size_t size, size_t align) {
+        if (!data) data = static_cast<char*>(malloc(capacity));
+        size_t start = ((uintptr_t(data) + used + align - 1) & ~uintptr_t(align - 1)) - uintptr_t(data);
+        if (start + size <= capacity) {
+            used = start + size;
+            peak = max(peak, used + overflowBytes);
+            return data + start;
+        }
+
+        //Out of space, take a separate block aligned like the request and remember it
+        size_t header = max(sizeof(char*), align);
+        char* block = static_cast<char*>(_mm_malloc(header + size, max(alignof(char*), align)));
+        *reinterpret_cast<char**>(block) = overflowList;
+        overflowList = block;
+        overflowBytes += size + align;
+        peak = max(peak, used + overflowBytes);
+        return block + header;
+    }
+    template <class T> //T must be trivially destructible, reset() destroys nothing
+    T* alloc(size_t n) {
+        T* ptr = static_cast<T*>(allocBytes(n * sizeof(T), alignof(T)));
+        for (size_t i = 0; i != n; i++) new (ptr + i) T();
+        return ptr;
+    }
+
+    void releaseOverflow() {
+        while (overflowList) {
+            char* next = *reinterpret_cast<char**>(overflowList);
+            _mm_free(overflowList);
+            overflowList = next;
+        }
+        overflowBytes = 0;
+    }
+    void reset() {
+        if (overflowBytes) {
+            releaseOverflow();
+            free(data);
+            capacity = max(2 * capacity, peak);
+            data = nullptr;
+        }
+        used = 0;
+    }
+};
+thread_local FrameArena frameArena(FRAME_ARENA_BYTES); //one per thread, each thread resets its own
@@ -0,0 +1,1211 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdio>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "rigidbody.h"
+#include "lightsource.h"
+#include "camera.h"
+#include "raytracer.h"
+#include "incremental.h"
+#include "texture.h"
+#include "physics.h"
+#include "snapshot.h"
+#include "scenequery.h"
+#include "multiview.h"
+#include "particles.h"
+#include "staticlight.h"
+#include "streaming.h"
+
+//Timing
+inline unsigned long long readCycles() {
+    return __rdtsc();
+}
+volatile float benchSink = 0; //keeps results alive so kernels are not optimized away
+
+struct BenchResult {
+    string name;
+    long long elements = 0;
+    double nsPerElem = 0;
+    double cyclesPerElem = 0;
+};
+
+//Runs kernel(n) reps times and keeps the fastest run; kernel processes n elements per call.
+//setup() runs before every call, outside the timed region
+template <class Kernel, class Setup>
+BenchResult runBenchSetup(const string& name, long long n, Kernel kernel, Setup setup, int reps = BENCH_REPS) {
+    BenchResult res;
+    res.name = name;
+    res.elements = n;
+    res.nsPerElem = numeric_limits<double>::max();
+    res.cyclesPerElem = numeric_limits<double>::max();
+
+    setup();
+    kernel(n); //warm up caches
+    for (int i = 0; i != reps; i++) {
+        setup();
+        auto t1 = chrono::steady_clock::now();
+        unsigned long long c1 = readCycles();
+        kernel(n);
+        unsigned long long c2 = readCycles();
+        auto t2 = chrono::steady_clock::now();
+
+        res.nsPerElem = min(res.nsPerElem, double(chrono::duration_cast<chrono::nanoseconds>(t2 - t1).count()) / n);
+        res.cyclesPerElem = min(res.cyclesPerElem, double(c2 - c1) / n);
+    }
+    return res;
+}
+template <class Kernel>
+BenchResult runBench(const string& name, long long n, Kernel kernel, int reps = BENCH_REPS) {
+    return runBenchSetup(name, n, kernel, [] {}, reps);
+}
+void printBench(const BenchResult& res) {
+    printf("%-44s %10lld %12.2f %12.2f\n", res.name.c_str(), res.elements, res.nsPerElem, res.cyclesPerElem);
+}
+
+//Input generation
+inline float benchRand(unsigned& state) { //xorshift, returns value in [-1, 1)
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state & 0xffffff) / float(0x800000) - 1.f;
+}
+vector<Vec3> randomVecs(int n, float range, unsigned seed = 12345) {
+    vector<Vec3> vecs(n);
+    for (int i = 0; i != n; i++) {
+        vecs[i] = Vec3(range * benchRand(seed), range * benchRand(seed), range * benchRand(seed));
+    }
+    return vecs;
+}
+
+//Math kernels
+void benchLinal(long long n) {
+    vector<Vec3> a = randomVecs(n, 100.f, 1), b = randomVecs(n, 100.f, 2);
+    vector<Mat3x3> mats(n);
+    for (int i = 0; i != n; i++) mats[i] = createRotMat(a[i], 0.1f * i);
+
+    printBench(runBench("Vec3 add+scale " + to_string(n), n, [&](long long cnt) {
+        Vec3 acc;
+        for (int i = 0; i != cnt; i++) acc += (a[i] + b[i]) * 0.5f;
+        benchSink = acc.x;
+    }));
+    printBench(runBench("Vec3 crossProd+dotProd " + to_string(n), n, [&](long long cnt) {
+        float acc = 0;
+        for (int i = 0; i != cnt; i++) acc += dotProd(crossProd(a[i], b[i]), a[i]);
+        benchSink = acc;
+    }));
+    printBench(runBench("Vec3 normalize " + to_string(n), n, [&](long long cnt) {
+        Vec3 acc;
+        for (int i = 0; i != cnt; i++) acc += normalize(a[i]);
+        benchSink = acc.x;
+    }));
+    printBench(runBench("Mat3x3 * Vec3 " + to_string(n), n, [&](long long cnt) {
+        Vec3 acc;
+        for (int i = 0; i != cnt; i++) acc += mats[i] * b[i];
+        benchSink = acc.x;
+    }));
+    printBench(runBench("Mat3x3 * Mat3x3 " + to_string(n), n, [&](long long cnt) {
+        Mat3x3 acc;
+        for (int i = 0; i != cnt; i++) acc += mats[i] * mats[cnt - 1 - i];
+        benchSink = acc.a1;
+    }));
+    printBench(runBench("Mat3x3 inv " + to_string(n), n, [&](long long cnt) {
+        Mat3x3 acc;
+        for (int i = 0; i != cnt; i++) acc += mats[i].inv();
+        benchSink = acc.a1;
+    }));
+    printBench(runBench("createRotMat " + to_string(n), n, [&](long long cnt) {
+        Mat3x3 acc;
+        for (int i = 0; i != cnt; i++) acc += createRotMat(a[i], b[i].x);
+        benchSink = acc.a1;
+    }));
+}
+
+//Raster kernels
+struct BenchTriangle {
+    string name;
+    Vec3 r1, r2, r3; //in camera CS
+};
+vector<BenchTriangle> benchTriangles() {
+    vector<BenchTriangle> tris;
+    tris.push_back({ "small", Vec3(-2, -2, 200), Vec3(2, -2, 200), Vec3(0, 2, 200) });
+    tris.push_back({ "large", Vec3(-150, -120, 200), Vec3(150, -120, 220), Vec3(0, 120, 180) });
+    tris.push_back({ "thin", Vec3(-150, -1, 200), Vec3(150, 0, 200), Vec3(-150, 1, 200) });
+    return tris;
+}
+void benchRaster(Camera& cam) {
+    const float planeDist = cam.planeDist;
+    vector<BenchTriangle> tris = benchTriangles();
+
+    for (int t = 0; t != tris.size(); t++) {
+        Vec3& r1 = tris[t].r1; Vec3& r2 = tris[t].r2; Vec3& r3 = tris[t].r3;
+        float x1(r1.x * planeDist / r1.z), y1(r1.y * planeDist / r1.z),
+            x2(r2.x * planeDist / r2.z), y2(r2.y * planeDist / r2.z),
+            x3(r3.x * planeDist / r3.z), y3(r3.y * planeDist / r3.z);
+
+        //Pixels of the triangle's bounding box, which is what updBuff iterates over
+        long long minX(max(0, int(0.5f * WIDTH + min({ x1, x2, x3 }) * cam.scale)));
+        long long maxX(min(WIDTH, int(0.5f * WIDTH + max({ x1, x2, x3 }) * cam.scale)));
+        long long minY(max(0, int(0.5f * HEIGHT + min({ y1, y2, y3 }) * cam.scale)));
+        long long maxY(min(HEIGHT, int(0.5f * HEIGHT + max({ y1, y2, y3 }) * cam.scale)));
+        long long bboxPixels = max(1ll, (maxX - minX) * (maxY - minY));
+
+        //Both point tests walk the same bbox pixel centres, row by row as updBuff does
+        long long bboxW = max(1ll, maxX - minX);
+        vector<float> walkX(bboxPixels), walkY(bboxPixels);
+        for (long long i = 0; i != bboxPixels; i++) {
+            walkX[i] = (minX + i % bboxW - 0.5f * WIDTH) * cam.pixelSize;
+            walkY[i] = (minY + i / bboxW - 0.5f * HEIGHT) * cam.pixelSize;
+        }
+
+        printBench(runBench("pointInTriangle " + tris[t].name, bboxPixels, [&](long long cnt) {
+            int inside = 0;
+            for (int i = 0; i != cnt; i++) inside += pointInTriangle(walkX[i], walkY[i], x1, y1, x2, y2, x3, y3);
+            benchSink = inside;
+        }));
+        printBench(runBench("findIntersection " + tris[t].name, bboxPixels, [&](long long cnt) {
+            Vec3 acc;
+            for (int i = 0; i != cnt; i++) acc += findIntersection(Vec3(walkX[i], walkY[i], planeDist), r1, r2, r3);
+            benchSink = acc.z;
+        }));
+        printBench(runBenchSetup("updBuff " + tris[t].name + " (per bbox pixel)", bboxPixels, [&](long long) {
+            cam.updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, 255, 255, 255);
+        }, [&] {
+            for (long long y = minY; y != maxY; y++) { //reset only the touched area so the depth test always passes
+                for (long long x = minX; x != maxX; x++) cam.fb->zBuff[y][x] = numeric_limits<float>::max();
+            }
+        }));
+    }
+}
+
+//Lighting kernels
+void benchLighting(Camera& cam) {
+    //Fill the whole screen with one big polygon so every pixel is shaded
+    cam.clearBuffers();
+    cam.beginFrame();
+    cam.renderPolygon(Polygon(Vec3(-2000, 200, -2000), Vec3(2000, 200, -2000), Vec3(0, 200, 4000)));
+    cam.renderPolygon(Polygon(Vec3(-2000, 200, 2000), Vec3(2000, 200, 2000), Vec3(0, 200, -4000)));
+
+    vector<Uint32> pixels(WIDTH * HEIGHT);
+    for (int i = 0; i != BENCH_LIGHT_COUNTS_NUM; i++) {
+        int lightNum = BENCH_LIGHT_COUNTS[i];
+        vector<LightSource> lights;
+        for (int l = 0; l != lightNum; l++) lights.push_back(LightSource(100.f * l, 0, 300, 40000));
+
+        BenchResult res = runBench("applyLight " + to_string(lightNum) + " lights (per pixel)", WIDTH * HEIGHT, [&](long long) {
+            frameArena.reset();
+            cam.shadeBuffer(lights, pixels.data(), WIDTH);
+        });
+        printBench(res);
+        res.name = "applyLight " + to_string(lightNum) + " lights (per pixel*light)";
+        res.elements *= lightNum;
+        res.nsPerElem /= lightNum;
+        res.cyclesPerElem /= lightNum;
+        printBench(res);
+
+        //The kernel the frame loop selects against the run-time light loop doing the same work (same gloss setting),
+        //so the ratio shows only what fixing the light count at compile time saves
+        vector<Vec3> lightPos(lightNum);
+        for (int l = 0; l != lightNum; l++) lightPos[l] = cam.toCameraCS(lights[l].r - cam.eye);
+        for (int g = 1; g >= 0; g--) {
+            string gloss = g ? "" : " no gloss";
+            BenchResult generic = runBench("  run-time loop " + to_string(lightNum) + " lights" + gloss, WIDTH * HEIGHT, [&](long long) {
+                (g ? shadeRectKernel<0, true, false, false> : shadeRectKernel<0, false, false, false>)(*cam.fb, lightPos.data(), lights.data(), lightNum, 0,
+                    pixels.data(), WIDTH, 0, 0, WIDTH, HEIGHT);
+            });
+            printBench(generic);
+            if (lightNum > SHADE_FIXED_LIGHTS) continue; //selected kernel is the run-time loop itself
+            BenchResult special = runBench("  specialized " + to_string(lightNum) + " lights" + gloss, WIDTH * HEIGHT, [&](long long) {
+                selectShadeKernel(lightNum, g)(*cam.fb, lightPos.data(), lights.data(), lightNum, 0, pixels.data(), WIDTH, 0, 0, WIDTH, HEIGHT);
+            });
+            printBench(special);
+            printf("  -> %.1f%% of the run-time loop's cycles\n", 100. * special.cyclesPerElem / generic.cyclesPerElem);
+        }
+    }
+    benchSink = pixels[WIDTH * HEIGHT / 2];
+}
+
+//Physics kernels
+void benchPhysics() {
+    for (int s = 0; s != BENCH_SIZES_NUM; s++) {
+        int n = BENCH_SIZES[s];
+
+        vector<RigidBody> bodies(min(n, 4096), createIcosahedron(1e-4, 20.f));
+        for (int i = 0; i != bodies.size(); i++) bodies[i].angMom = Vec3(0, 15000, 0.01f * i);
+        printBench(runBench("RigidBody::integrator " + to_string(bodies.size()), bodies.size(), [&](long long cnt) {
+            for (int i = 0; i != cnt; i++) bodies[i].integrator(TIMESTEP);
+        }));
+
+        vector<Polygon> mesh;
+        vector<Vec3> verts = randomVecs(n, 50.f, 7);
+        for (int i = 0; i + 2 < n; i += 3) {
+            Polygon poly(verts[i], verts[i + 1], verts[i + 2]);
+            makeRightHand(&poly);
+            mesh.push_back(poly);
+        }
+        if (mesh.empty()) continue;
+        printBench(runBench("createBodyFromMesh (per poly) " + to_string(mesh.size()), mesh.size(), [&](long long) {
+            benchSink = createBodyFromMesh(1e-4, mesh).mass;
+        }));
+
+        RigidBody meshBody = createBodyFromMesh(1e-4, mesh);
+        RigidBody cuboid = createCuboid(1e-4, 50, 100, 50);
+        cuboid.bodyMove(Vec3(75, 0, 0));
+        printBench(runBench("glueTogether (per poly) " + to_string(mesh.size() + cuboid.polyNum), mesh.size() + cuboid.polyNum, [&](long long) {
+            benchSink = glueTogether(meshBody, cuboid).mass;
+        }));
+    }
+}
+
+//Instancing
+void benchInstancing(Camera& cam) {
+    const int side = 32;
+    int icosMesh = meshRegistry.add(icosahedronPolys(5.f));
+    RigidBody owned = createIcosahedron(1e-4, 5.f);
+    BodyPool ownedWorld(side * side), instWorld(side * side);
+
+    //Grid of bodies in front of the camera (camera looks along +z)
+    for (int i = 0; i != side * side; i++) {
+        Vec3 pos(30.f * (i % side - side / 2), 30.f * (i / side - side / 2), 800.f);
+        ownedWorld[ownedWorld.create(owned)].bodyMove(pos);
+        RigidBody inst = createInstance(icosMesh, 1e-4);
+        inst.bodyMove(pos);
+        instWorld.create(inst);
+    }
+
+    long long polyNum = side * side * owned.polyNum;
+    cam.clearBuffers();
+    printBench(runBench("renderWorld owned meshes (per poly)", polyNum, [&](long long) {
+        frameArena.reset();
+        cam.renderWorld(ownedWorld);
+    }, 2));
+    printBench(runBench("renderWorld instanced meshes (per poly)", polyNum, [&](long long) {
+        frameArena.reset();
+        cam.renderWorld(instWorld);
+    }, 2));
+    printf("mesh bytes owned: %lld, instanced: %lld\n", polyNum * (long long)sizeof(Polygon), (long long)(owned.polyNum * sizeof(Polygon)));
+}
+
+//Compound bodies
+//The demo's hammer glued from copies of its parts' polygons against a compound referencing their meshes, then
+//attaching and detaching one child of compounds of growing size
+void benchCompound(Camera& cam) {
+    RigidBody head = createCuboid(1e-4f, 50, 100, 50);
+    RigidBody handle = createCuboid(1e-4f, 100, 10, 10);
+    handle.bodyMove(Vec3(75, 0, 0));
+    RigidBody icosahedron = createIcosahedron(1e-4f, 20.f);
+    icosahedron.bodyMove(Vec3(125, 0, 0));
+    int headMesh = meshRegistry.add(head.polys), handleMesh = meshRegistry.add(handle.polys), icosMesh = meshRegistry.add(icosahedron.polys);
+
+    RigidBody glued, compound;
+    printBench(runBench("hammer by glueTogether (per body)", 1, [&](long long) {
+        glued = glueTogether(glueTogether(head, handle), icosahedron);
+    }));
+    printBench(runBench("hammer by attachChild (per body)", 1, [&](long long) {
+        compound = RigidBody();
+        compound.attachChild(headMesh, 1e-4f, head.cmPos);
+        compound.attachChild(handleMesh, 1e-4f, handle.cmPos);
+        compound.attachChild(icosMesh, 1e-4f, icosahedron.cmPos);
+    }));
+    Mat3x3 gluedTensor = glued.invInertiaTensor.inv(), compoundTensor = compound.invInertiaTensor.inv();
+    printf("glued against compound: mass %g / %g, cm x %g / %g, inertia xx %g / %g, yy %g / %g\n", glued.mass, compound.mass,
+        glued.cmPos.x, compound.cmPos.x, gluedTensor.a1, compoundTensor.a1, gluedTensor.b2, compoundTensor.b2);
+
+    //Same hammers on screen: rendering goes through the children's meshes by reference
+    const int side = 8;
+    BodyPool gluedWorld(side * side), compoundWorld(side * side);
+    for (int i = 0; i != side * side; i++) {
+        Vec3 pos(300.f * (i % side - side / 2), 300.f * (i / side - side / 2), 2500.f);
+        gluedWorld[gluedWorld.create(glued)].bodyMove(pos - glued.cmPos);
+        compoundWorld[compoundWorld.create(compound)].bodyMove(pos - compound.cmPos);
+    }
+    long long polyNum = side * side * glued.polyNum;
+    cam.clearBuffers();
+    printBench(runBench("renderWorld glued hammers (per poly)", polyNum, [&](long long) {
+        frameArena.reset();
+        cam.renderWorld(gluedWorld);
+    }, 2));
+    printBench(runBench("renderWorld compound hammers (per poly)", polyNum, [&](long long) {
+        frameArena.reset();
+        cam.renderWorld(compoundWorld);
+    }, 2));
+
+    //One more part on a body of n parts: gluing copies every polygon, attaching touches each child once
+    int sizes[] = { 4, 64 };
+    for (int s = 0; s != 2; s++) {
+        int n = sizes[s];
+        RigidBody gluedBody = icosahedron, compoundBody;
+        for (int i = 0; i != n; i++) {
+            RigidBody part = createIcosahedron(1e-4f, 20.f);
+            part.bodyMove(Vec3(50.f * i, 0, 0));
+            if (i) gluedBody = glueTogether(gluedBody, part);
+            compoundBody.attachChild(icosMesh, 1e-4f, part.cmPos);
+        }
+        RigidBody extra = createIcosahedron(1e-4f, 20.f);
+        extra.bodyMove(Vec3(0, 50, 0));
+        printBench(runBench("glueTogether one more part to " + to_string(n), 1, [&](long long) {
+            benchSink = glueTogether(gluedBody, extra).mass;
+        }));
+        printBench(runBench("attachChild + detachChild on " + to_string(n), 1, [&](long long) {
+            compoundBody.attachChild(icosMesh, 1e-4f, extra.cmPos);
+            benchSink = compoundBody.detachChild(n).mass;
+        }));
+    }
+}
+
+//Scene queries
+//Batches of ray casts, sphere overlaps and closest points on worlds of growing size at constant density, mixing
+//instances, compounds and bodies owning their polygons. The smallest world is also checked against brute force
+//over every triangle
+void benchSceneQueries() {
+    int icosMesh = meshRegistry.add(icosahedronPolys(5.f));
+    int boxMesh = meshRegistry.add(createCuboid(1e-4f, 10, 4, 6).polys);
+    const int q = BENCH_SCENE_QUERIES;
+
+    for (int s = 0; s != BENCH_SCENE_SIZES_NUM; s++) {
+        int n = BENCH_SCENE_SIZES[s];
+        float extent = 30.f * cbrtf(float(n));
+        unsigned seed = 99;
+        BodyPool world(n);
+        for (int i = 0; i != n; i++) {
+            RigidBody body;
+            if (i % 3 == 0) body = createInstance(icosMesh, 1e-4f);
+            else if (i % 3 == 1) {
+                body.attachChild(boxMesh, 1e-4f, Vec3());
+                body.attachChild(icosMesh, 1e-4f, Vec3(8, 0, 0));
+            }
+            else body = createCuboid(1e-4f, 6, 6, 6);
+            body.bodyMove(Vec3(benchRand(seed), benchRand(seed), benchRand(seed)) * (extent / 2.f) - body.cmPos);
+            Vec3 axis(benchRand(seed), benchRand(seed), benchRand(seed) + 2.f);
+            body.orientMat = createRotMat(normalize(axis), 3.f * benchRand(seed));
+            body.cmVel = Vec3(benchRand(seed), benchRand(seed), benchRand(seed));
+            world.create(body);
+        }
+
+        SceneQuery scene(world);
+        printBench(runBench("SceneQuery::update first " + to_string(n) + " (per body)", n, [&](long long) {
+            SceneQuery fresh(world);
+            fresh.update();
+        }, 2));
+        scene.update();
+        printBench(runBench("SceneQuery::update moving " + to_string(n) + " (per body)", n, [&](long long) {
+            for (int id = 0; id != n; id++) world[id].cmPos += world[id].cmVel * 0.1f;
+            scene.update();
+        }));
+        printf("tree height %d, bodies reinserted by the last update: %d\n", scene.tree.height(), scene.movedNum);
+
+        vector<RayQuery> rays(q);
+        vector<SphereQuery> spheres(q);
+        vector<PointQuery> points(q);
+        for (int i = 0; i != q; i++) {
+            Vec3 from = normalize(Vec3(benchRand(seed), benchRand(seed), benchRand(seed))) * extent;
+            Vec3 to = Vec3(benchRand(seed), benchRand(seed), benchRand(seed)) * (extent / 2.f);
+            rays[i].orig = from;
+            rays[i].dir = to - from;
+            spheres[i].centre = to;
+            spheres[i].radius = 5.f;
+            points[i].point = to;
+        }
+        vector<RayHit> rayHits(q);
+        vector<SphereOverlap> overlaps(q);
+        vector<PointHit> pointHits(q);
+        BenchResult rayRes = runBench("raycast batch " + to_string(n) + " bodies (per query)", q, [&](long long) {
+            scene.raycast(rays.data(), rayHits.data(), q);
+        });
+        BenchResult sphereRes = runBench("sphereOverlap batch " + to_string(n) + " bodies (per query)", q, [&](long long) {
+            scene.sphereOverlap(spheres.data(), overlaps.data(), q);
+        });
+        BenchResult pointRes = runBench("closestPoint batch " + to_string(n) + " bodies (per query)", q, [&](long long) {
+            scene.closestPoint(points.data(), pointHits.data(), q);
+        });
+        printBench(rayRes);
+        printBench(sphereRes);
+        printBench(pointRes);
+        int rayHitNum = 0, overlapNum = 0;
+        for (int i = 0; i != q; i++) {
+            rayHitNum += rayHits[i].body >= 0;
+            overlapNum += overlaps[i].count;
+        }
+        printf("queries/s: raycast %.0f, sphereOverlap %.0f, closestPoint %.0f; rays hitting: %d of %d, overlaps: %d\n",
+            1e9 / rayRes.nsPerElem, 1e9 / sphereRes.nsPerElem, 1e9 / pointRes.nsPerElem, rayHitNum, q, overlapNum);
+        if (s != 0) continue;
+
+        //Brute force: every triangle of every body in world CS
+        vector<RTTriangle> tris;
+        for (int id = 0; id != n; id++) {
+            for (int k = 0; k != world[id].pieceNum(); k++) {
+                ShapePiece piece = world[id].shapePiece(k);
+                Mat3x3 orient = world[id].orientMat * piece.orient;
+                Vec3 pos = world[id].orientMat * piece.pos + world[id].cmPos;
+                for (int i = 0; i != piece.polys->size(); i++) {
+                    const Polygon& poly = (*piece.polys)[i];
+                    tris.push_back({ orient * poly.r1 + pos, orient * poly.r2 + pos, orient * poly.r3 + pos, 0, 0, 0, id, k, i });
+                }
+            }
+        }
+        int rayMismatches = 0, pointMismatches = 0;
+        BenchResult bruteRes = runBench("raycast brute force " + to_string(n) + " bodies (per query)", q, [&](long long) {
+            rayMismatches = 0;
+            for (int i = 0; i != q; i++) {
+                float tHit = rays[i].tMax;
+                int body = -1;
+                for (int t = 0; t != tris.size(); t++) {
+                    float tt = intersectTriangle(rays[i].orig, rays[i].dir, tris[t], tHit);
+                    if (tt < tHit) {
+                        tHit = tt;
+                        body = tris[t].body;
+                    }
+                }
+                rayMismatches += body != rayHits[i].body or (body >= 0 and fabs(tHit - rayHits[i].t) > 1e-4f);
+            }
+        }, 1);
+        printBench(bruteRes);
+        for (int i = 0; i != q; i++) {
+            float best = numeric_limits<float>::max();
+            for (int t = 0; t != tris.size(); t++) {
+                best = min(best, mod(closestOnTriangle(points[i].point, tris[t].r1, tris[t].r2, tris[t].r3) - points[i].point));
+            }
+            pointMismatches += fabs(best - pointHits[i].dist) > 1e-3f;
+        }
+        printf("against brute force: %d of %d rays and %d of %d closest points differ\n", rayMismatches, q, pointMismatches, q);
+    }
+}
+
+//Multi-view rendering
+//Split-screen and six cube faces over one world surrounding the cameras: every view running renderWorld on its own
+//against one shared geometry pass with per-view culling. The multi-view output is compared with renderWorld's
+void benchMultiView() {
+    int icosMesh = meshRegistry.add(icosahedronPolys(10.f));
+    int boxMesh = meshRegistry.add(createCuboid(1e-4f, 20, 8, 12).polys);
+    const int n = BENCH_MULTIVIEW_BODIES;
+    unsigned seed = 7;
+    BodyPool world(n);
+    for (int i = 0; i != n; i++) {
+        RigidBody body;
+        if (i % 3 == 0) body = createInstance(icosMesh, 1e-4f);
+        else if (i % 3 == 1) {
+            body.attachChild(boxMesh, 1e-4f, Vec3());
+            body.attachChild(icosMesh, 1e-4f, Vec3(16, 0, 0));
+        }
+        else body = createCuboid(1e-4f, 12, 12, 12);
+        Vec3 dir = normalize(Vec3(benchRand(seed), benchRand(seed), benchRand(seed)));
+        body.bodyMove(dir * (400.f + 1200.f * fabsf(benchRand(seed))) - body.cmPos);
+        body.orientMat = createRotMat(Vec3(benchRand(seed), benchRand(seed), 1.f), 3.f * benchRand(seed));
+        world.create(body);
+    }
+
+    const int maxViews = 6;
+    Camera* views[maxViews];
+    for (int v = 0; v != maxViews; v++) {
+        views[v] = new Camera(nullptr, 0, 0, 0, FOV);
+        views[v]->ownFrameBuffer();
+    }
+    MultiViewRenderer multiView;
+    vector<float> refZ(HEIGHT * WIDTH);
+    vector<Uint32> refColor(3 * HEIGHT * WIDTH);
+
+    for (int layout = 0; layout != 2; layout++) {
+        int viewNum = layout == 0 ? 2 : 6;
+        const char* name = layout == 0 ? "split-screen" : "cube faces";
+        for (int v = 0; v != viewNum; v++) {
+            Camera& cam = *views[v];
+            if (layout == 0) { //side by side, both looking along +z
+                cam.eye = Vec3(v ? 50.f : -50.f, 0, 0);
+                cam.orientMat = IdMat;
+            }
+            else {
+                cam.eye = Vec3();
+                if (v < 4) cam.orientMat = createRotMat(yUnit, v * float(M_PI) / 2.f);
+                else cam.orientMat = createRotMat(xUnit, v == 4 ? float(M_PI) / 2.f : -float(M_PI) / 2.f);
+            }
+        }
+
+        for (int v = 0; v != viewNum; v++) views[v]->clearBuffers();
+        printBench(runBench(string("renderWorld per view, ") + name + " (per view)", viewNum, [&](long long) {
+            for (int v = 0; v != viewNum; v++) {
+                frameArena.reset();
+                views[v]->beginFrame();
+                views[v]->renderWorld(world);
+            }
+        }, 2));
+        for (int v = 0; v != viewNum; v++) views[v]->clearBuffers();
+        printBench(runBench(string("MultiViewRenderer, ") + name + " (per view)", viewNum, [&](long long) {
+            multiView.render(views, viewNum, world);
+        }, 2));
+        printf("%s: geometry pass %.2f ms for %d polys\n", name, multiView.geometryMs, (int)multiView.polys.size());
+
+        //Same pixels as renderWorld, up to the rounding of the world-space detour
+        for (int v = 0; v != viewNum; v++) {
+            Camera& cam = *views[v];
+            cam.clearBuffers();
+            frameArena.reset();
+            cam.renderWorld(world);
+            for (int y = 0; y != HEIGHT; y++) {
+                for (int x = 0; x != WIDTH; x++) {
+                    refZ[y * WIDTH + x] = cam.fb->zBuff[y][x];
+                    for (int c = 0; c != 3; c++) refColor[3 * (y * WIDTH + x) + c] = cam.fb->preLightBuff[y][x][c];
+                }
+            }
+            cam.clearBuffers();
+            multiView.renderView(cam, multiView.stats[v]);
+            int colorDiff = 0, depthDiff = 0;
+            for (int y = 0; y != HEIGHT; y++) {
+                for (int x = 0; x != WIDTH; x++) {
+                    float z = cam.fb->zBuff[y][x], ref = refZ[y * WIDTH + x];
+                    const Uint32* color = cam.fb->preLightBuff[y][x];
+                    colorDiff += color[0] != refColor[3 * (y * WIDTH + x)] or color[1] != refColor[3 * (y * WIDTH + x) + 1] or
+                        color[2] != refColor[3 * (y * WIDTH + x) + 2];
+                    depthDiff += fabsf(z - ref) > 1e-3f * fabsf(ref);
+                }
+            }
+            const ViewStats& stat = multiView.stats[v];
+            printf("%s view %d: %d bodies drawn, %d culled, %lld polys, %.2f ms, pixels differing from renderWorld: color %d, depth %d\n",
+                name, v, stat.bodiesDrawn, stat.bodiesCulled, stat.polysDrawn, stat.rasterMs, colorDiff, depthDiff);
+        }
+    }
+    for (int v = 0; v != maxViews; v++) delete views[v];
+}
+
+//Ray tracing
+void benchRayTracer() {
+    Camera cam(nullptr, CAM_INIT_X, CAM_INIT_Y, CAM_INIT_Z, FOV);
+    cam.rotSelfOX(-M_PI / 2);
+
+    BodyPool world(64);
+    RigidBody hammer = glueTogether(createCuboid(1e-4, 50, 100, 50), createCuboid(1e-4, 100, 10, 10));
+    hammer.bodyMove(-hammer.cmPos);
+    hammer.angMom = Vec3(0, 15000, 0.01f);
+    int hammerId = world.create(hammer);
+    for (int i = 0; i != 16; i++) {
+        RigidBody icos = createIcosahedron(1e-4, 10.f);
+        icos.bodyMove(Vec3(40.f * (i % 4) - 60.f, 150.f, 40.f * (i / 4) - 60.f));
+        world.create(icos);
+    }
+    vector<Polygon> axes = { polyOX, polyOY, polyOZ };
+    vector<LightSource> lights(1, LightSource(0, 0, 300, 40000));
+
+    //Rasterizer reference
+    vector<Uint32> rasterPixels(WIDTH * HEIGHT), rtPixels(WIDTH * HEIGHT);
+    frameArena.reset();
+    cam.clearBuffers();
+    cam.beginFrame();
+    for (int i = 0; i != axes.size(); i++) cam.renderPolygon(axes[i]);
+    cam.renderWorld(world);
+    cam.shadeBuffer(lights, rasterPixels.data(), WIDTH);
+
+    //Same image without the ray-traced-only effects must match the rasterizer
+    RayTracer tracer;
+    tracer.update(world, axes);
+    tracer.shadows = false;
+    tracer.reflectivity = 0.f;
+    tracer.render(cam, lights, rtPixels.data(), WIDTH);
+    int covered = 0, differ = 0;
+    for (int i = 0; i != WIDTH * HEIGHT; i++) {
+        covered += rasterPixels[i] != 0;
+        differ += rasterPixels[i] != rtPixels[i];
+    }
+    printf("ray tracer vs rasterizer: %d of %d covered pixels differ\n", differ, covered);
+
+    tracer.shadows = true;
+    tracer.reflectivity = RT_REFLECTIVITY;
+    BenchResult res = runBench("ray trace frame (per primary ray)", WIDTH * HEIGHT, [&](long long) {
+        tracer.render(cam, lights, rtPixels.data(), WIDTH);
+    }, 2);
+    printBench(res);
+    printf("primary Mrays/s: %.2f\n", 1e3 / res.nsPerElem);
+
+    printBench(runBench("BVH refit (per triangle)", tracer.tris.size(), [&](long long) {
+        world[hammerId].integrator(TIMESTEP);
+        tracer.update(world, axes);
+    }));
+    printBench(runBench("BVH rebuild (per triangle)", tracer.tris.size(), [&](long long) {
+        tracer.build();
+    }));
+}
+
+//Incremental rendering
+void benchIncremental() {
+    Camera cam(nullptr, CAM_INIT_X, CAM_INIT_Y, CAM_INIT_Z, FOV);
+    cam.rotSelfOX(-M_PI / 2);
+
+    //One spinning body among many resting ones
+    BodyPool world(64);
+    for (int i = 0; i != 63; i++) {
+        RigidBody icos = createIcosahedron(1e-4, 8.f);
+        icos.bodyMove(Vec3(30.f * (i % 9) - 120.f, 100.f, 30.f * (i / 9) - 90.f));
+        world.create(icos);
+    }
+    RigidBody spinner = createCuboid(1e-4, 40, 10, 10);
+    spinner.angMom = Vec3(0, 200, 100);
+    int spinnerId = world.create(spinner);
+    vector<Polygon> axes = { polyOX, polyOY, polyOZ };
+    vector<LightSource> lights(1, LightSource(0, 0, 300, 40000));
+
+    IncrementalRenderer incremental;
+    FrameBuffer* scratch = new FrameBuffer;
+    int frames = 0, mismatched = 0;
+    incremental.render(cam, world, axes, lights); //first frame is a full redraw
+    long long shadedBefore = incremental.totalShadedPixels;
+
+    BenchResult res = runBench("incremental frame (per screen pixel)", WIDTH * HEIGHT, [&](long long) {
+        frameArena.reset();
+        world[spinnerId].integrator(TIMESTEP);
+        incremental.render(cam, world, axes, lights);
+        frames++;
+    });
+    printBench(res);
+    printf("re-shaded pixels: %.2f %% of the screen per frame\n", 100. * (incremental.totalShadedPixels - shadedBefore) / (double(frames) * WIDTH * HEIGHT));
+
+    printBench(runBench("full redraw frame (per screen pixel)", WIDTH * HEIGHT, [&](long long) {
+        frameArena.reset();
+        world[spinnerId].integrator(TIMESTEP);
+        incremental.verify(cam, world, axes, lights, *scratch);
+    }));
+
+    for (int i = 0; i != 10; i++) {
+        frameArena.reset();
+        world[spinnerId].integrator(TIMESTEP);
+        incremental.render(cam, world, axes, lights);
+        mismatched += incremental.verify(cam, world, axes, lights, *scratch);
+    }
+    printf("incremental vs full redraw: %d differing pixels over 10 frames\n", mismatched);
+    delete scratch;
+}
+
+//Texture sampling
+//The same rotated walk over a texture larger than the caches, read from a row-major copy, from the Morton
+//ordered level 0 and from the mip level the rasterizer would pick, shows what layout and mipmapping do to cache misses
+void benchTextures(Camera& cam) {
+    const int size = BENCH_TEXTURE_SIZE, side = 512;
+    vector<Uint32> pixels(size * size);
+    unsigned seed = 7;
+    for (int i = 0; i != size * size; i++) pixels[i] = Uint32(benchRand(seed) * 0x7fffff) & 0xffffff;
+    int texId = textureRegistry.add(size, pixels);
+    const Texture& tex = textureRegistry[texId];
+
+    float minifications[] = { 1.f, 4.f };
+    for (int m = 0; m != 2; m++) {
+        float texelsPerPixel = minifications[m];
+        float cu = cosf(0.5f) * texelsPerPixel, cv = sinf(0.5f) * texelsPerPixel; //level 0 texels per screen pixel
+        int level = tex.levelFor(texelsPerPixel * texelsPerPixel);
+        string suffix = ", " + to_string(int(texelsPerPixel)) + " texel/px";
+
+        printBench(runBench("4 texels row-major L0" + suffix, side * side, [&](long long cnt) {
+            Uint32 acc = 0;
+            unsigned mask = size - 1;
+            for (int i = 0; i != cnt; i++) {
+                int x = i % side, y = i / side;
+                unsigned tx = unsigned(cu * x - cv * y), ty = unsigned(cv * x + cu * y);
+                acc += pixels[(ty & mask) * size + (tx & mask)] + pixels[(ty & mask) * size + ((tx + 1) & mask)];
+                acc += pixels[((ty + 1) & mask) * size + (tx & mask)] + pixels[((ty + 1) & mask) * size + ((tx + 1) & mask)];
+            }
+            benchSink = acc;
+        }));
+        printBench(runBench("4 texels Morton L0" + suffix, side * side, [&](long long cnt) {
+            Uint32 acc = 0;
+            for (int i = 0; i != cnt; i++) {
+                int x = i % side, y = i / side;
+                int tx = int(cu * x - cv * y), ty = int(cv * x + cu * y);
+                acc += tex.texel(0, tx, ty) + tex.texel(0, tx + 1, ty) + tex.texel(0, tx, ty + 1) + tex.texel(0, tx + 1, ty + 1);
+            }
+            benchSink = acc;
+        }));
+        if (level != 0) printBench(runBench("4 texels Morton L" + to_string(level) + suffix, side * side, [&](long long cnt) { //L0 is just above
+            Uint32 acc = 0;
+            for (int i = 0; i != cnt; i++) {
+                int x = i % side, y = i / side;
+                int tx = int(cu * x - cv * y) >> level, ty = int(cv * x + cu * y) >> level;
+                acc += tex.texel(level, tx, ty) + tex.texel(level, tx + 1, ty) + tex.texel(level, tx, ty + 1) + tex.texel(level, tx + 1, ty + 1);
+            }
+            benchSink = acc;
+        }));
+        printBench(runBench("bilinear sample L" + to_string(level) + suffix, side * side, [&](long long cnt) {
+            Uint32 acc = 0;
+            for (int i = 0; i != cnt; i++) {
+                int x = i % side, y = i / side;
+                acc += tex.sample((cu * x - cv * y) / size, (cv * x + cu * y) / size, level);
+            }
+            benchSink = acc;
+        }));
+    }
+
+    //Whole lighting pass over a textured floor filling the screen
+    Polygon floor1(Vec3(-2000, 200, -2000), Vec3(2000, 200, -2000), Vec3(0, 200, 4000));
+    Polygon floor2(Vec3(-2000, 200, 2000), Vec3(2000, 200, 2000), Vec3(0, 200, -4000));
+    vector<Polygon> floorPolys = { floor1, floor2 };
+    boxMapUVs(floorPolys, 500.f, texId);
+    vector<LightSource> lights(1, LightSource(0, 0, 300, 40000));
+    vector<Uint32> out(WIDTH * HEIGHT);
+    for (int textured = 0; textured != 2; textured++) {
+        cam.clearBuffers();
+        cam.beginFrame();
+        cam.renderPolygon(textured ? floorPolys[0] : floor1);
+        cam.renderPolygon(textured ? floorPolys[1] : floor2);
+
+        long long fetchedBefore = texelsFetched;
+        int frames = 0;
+        printBench(runBench(string("applyLight 1 light ") + (textured ? "textured" : "flat") + " (per pixel)", WIDTH * HEIGHT, [&](long long) {
+            frameArena.reset();
+            cam.shadeBuffer(lights, out.data(), WIDTH);
+            frames++;
+        }));
+        if (textured) printf("texels fetched per frame: %lld\n", (texelsFetched - fetchedBefore) / frames);
+    }
+    benchSink = out[WIDTH * HEIGHT / 2];
+}
+
+//Static lighting
+//A floor and a field of static boxes under static lights and one dynamic light: the lighting pass with everything
+//lit per pixel against the pass adding the baked light maps, plus the cost of baking and of the per-frame check
+void benchStaticLighting(Camera& cam) {
+    vector<Polygon> floorPolys = { Polygon(Vec3(-2000, 200, -2000), Vec3(2000, 200, -2000), Vec3(0, 200, 4000)),
+        Polygon(Vec3(-2000, 200, 2000), Vec3(2000, 200, 2000), Vec3(0, 200, -4000)) };
+    const int side = 8;
+    BodyPool world(side * side + 1);
+    for (int i = 0; i != side * side; i++) {
+        RigidBody box = createCuboid(1e-4f, 60, 60, 60);
+        box.bodyMove(Vec3(150.f * (i % side - side / 2), 170.f, 600.f + 150.f * (i / side)) - box.cmPos);
+        box.isStatic = true;
+        world.create(box);
+    }
+    RigidBody mover = createIcosahedron(1e-4f, 40.f);
+    mover.bodyMove(Vec3(0, 100, 500) - mover.cmPos);
+    world.create(mover);
+
+    vector<LightSource> lights;
+    for (int l = 0; l != BENCH_STATIC_LIGHTS; l++) {
+        lights.push_back(LightSource(600.f * (l % 2) - 300.f, -200.f, 500.f + 500.f * (l / 2), 40000));
+        lights.back().isStatic = true;
+    }
+    lights.push_back(LightSource(0, 0, 300, 40000)); //dynamic
+
+    StaticLighting staticLighting;
+    long long bakedPolys = floorPolys.size() + side * side * world[0].polyNum;
+    printBench(runBench("StaticLighting::update first bake (per poly)", bakedPolys, [&](long long) {
+        StaticLighting fresh;
+        fresh.update(world, floorPolys, lights);
+        benchSink = fresh.polysBaked;
+    }, 2));
+    staticLighting.update(world, floorPolys, lights);
+    printBench(runBench("StaticLighting::update unchanged (per body)", world.capacity(), [&](long long) {
+        staticLighting.update(world, floorPolys, lights);
+    }));
+    lights[0].r.x += 1.f;
+    staticLighting.update(world, floorPolys, lights);
+    printf("static light moved: %d polygons baked again, unchanged frame: ", staticLighting.polysBaked);
+    staticLighting.update(world, floorPolys, lights);
+    printf("%d\n", staticLighting.polysBaked);
+
+    //Both frames rasterized once, then lit in alternation so load on the machine hits both sides alike
+    vector<Uint32> exact(WIDTH * HEIGHT), baked(WIDTH * HEIGHT);
+    unique_ptr<FrameBuffer> frames[2] = { unique_ptr<FrameBuffer>(new FrameBuffer), unique_ptr<FrameBuffer>(new FrameBuffer) };
+    FrameBuffer* fbWas = cam.fb;
+    for (int useMaps = 0; useMaps != 2; useMaps++) {
+        cam.fb = frames[useMaps].get();
+        cam.beginFrame();
+        cam.staticLighting = useMaps ? &staticLighting : nullptr;
+        for (int i = 0; i != floorPolys.size(); i++) cam.renderPolygon(floorPolys[i], useMaps ? staticLighting.polyMap(i) : nullptr);
+        frameArena.reset();
+        cam.renderWorld(world);
+    }
+    cam.fb = fbWas;
+    bool glossWas = cam.gloss;
+    for (int g = 0; g != 2; g++) {
+        cam.gloss = g;
+        BenchResult res[2];
+        for (int round = 0; round != BENCH_REPS; round++) {
+            for (int useMaps = 0; useMaps != 2; useMaps++) {
+                vector<Uint32>& out = useMaps ? baked : exact;
+                BenchResult run = runBench(string("applyLight ") + to_string(lights.size()) + " lights" + (g ? " gloss " : " ") +
+                    (useMaps ? "baked" : "per pixel") + " (per pixel)", WIDTH * HEIGHT, [&](long long) {
+                    frameArena.reset();
+                    cam.shadeBuffer(*frames[useMaps], lights, out.data(), WIDTH);
+                }, 1);
+                if (round == 0 or run.nsPerElem < res[useMaps].nsPerElem) res[useMaps] = run;
+            }
+        }
+        printBench(res[0]);
+        printBench(res[1]);
+        double nsPerPixel[2] = { res[0].nsPerElem, res[1].nsPerElem };
+        int maxDiff = 0;
+        for (int i = 0; i != WIDTH * HEIGHT; i++) {
+            maxDiff = max({ maxDiff, abs(hexToRed(exact[i]) - hexToRed(baked[i])), abs(hexToGreen(exact[i]) - hexToGreen(baked[i])),
+                abs(hexToBlue(exact[i]) - hexToBlue(baked[i])) });
+        }
+        printf("baked static light%s: %.2f ns per pixel saved (%.0f %%), largest channel difference %d\n", g ? " with gloss" : "",
+            nsPerPixel[0] - nsPerPixel[1], 100.0 * (nsPerPixel[0] - nsPerPixel[1]) / nsPerPixel[0], maxDiff);
+    }
+    cam.gloss = glossWas;
+    cam.staticLighting = nullptr;
+    cam.clearBuffers();
+}
+
+//Particles
+//Emission from a body's surface, sprite rasterization and the update, scalar and AVX2 kernels alone and the
+//whole parallel update, for growing particle counts. The throughput gives the particles a frame can afford
+void benchParticles(Camera& cam) {
+    RigidBody wall = createCuboid(1e-4f, 400, 300, 50);
+    wall.bodyMove(Vec3(0, 0, 800) - wall.cmPos);
+    wall.angVel = Vec3(0, 0, 0.5f);
+
+    for (int s = 0; s != BENCH_PARTICLE_COUNTS_NUM; s++) {
+        int n = BENCH_PARTICLE_COUNTS[s];
+        string suffix = " " + to_string(n) + " (per particle)";
+        ParticleSystem particles(n), reference(n);
+        particles.groundZ = reference.groundZ = 700.f; //some of them bounce
+        BenchResult emit = runBench("emitFromBody" + suffix, n, [&](long long cnt) {
+            particles.count = 0;
+            particles.emitFromBody(wall, cnt, 50.f, 1e9f);
+        });
+        printBench(emit);
+        reference.seed = particles.seed = 1;
+        particles.count = 0;
+        particles.emitFromBody(wall, n, 50.f, 1e9f);
+        reference.emitFromBody(wall, n, 50.f, 1e9f);
+
+        cam.clearBuffers();
+        cam.beginFrame();
+        BenchResult raster = runBench("particle sprites" + suffix, n, [&](long long) {
+            particles.render(cam);
+        });
+        printBench(raster);
+
+        int end = (n + 7) / 8 * 8;
+        printBench(runBench("particle update scalar" + suffix, n, [&](long long) {
+            reference.updateScalar(0, end, TIMESTEP);
+        }));
+        if (particles.simd) {
+            printBench(runBench("particle update AVX2" + suffix, n, [&](long long) {
+                particles.updateSimd(0, end, TIMESTEP);
+            }));
+            float maxDiff = 0;
+            for (int i = 0; i != n; i++) maxDiff = max(maxDiff, fabsf(particles.posZ[i] - reference.posZ[i]) + fabsf(particles.velZ[i] - reference.velZ[i]));
+            printf("AVX2 against scalar update after the same steps: max difference %g\n", maxDiff);
+        }
+        BenchResult update = runBench("ParticleSystem::update" + suffix, n, [&](long long) {
+            particles.update(TIMESTEP);
+        });
+        printBench(update);
+        printf("particles a %d ms frame affords (update + sprites): %lld\n", 1000 / FPS,
+            (long long)(1e9 / FPS / (update.nsPerElem + raster.nsPerElem)));
+    }
+}
+
+//Sleeping
+//Mostly resting world: steps with sleeping against the same steps with every body kept awake
+void benchSleeping() {
+    int icosMesh = meshRegistry.add(icosahedronPolys(5.f));
+    int sizes[] = { 64, MAX_BODIES };
+    for (int s = 0; s != 2; s++) {
+        int n = sizes[s], side = int(sqrtf(float(n)));
+        BodyPool world(n);
+        for (int i = 0; i != n; i++) {
+            RigidBody body = createInstance(icosMesh, 1e-4f);
+            body.bodyMove(Vec3(20.f * (i % side), 0, 20.f * (i / side)));
+            if (i % 16 == 0) { //movers in a lane of their own, above the resting ones
+                body.bodyMove(Vec3(0, 100, 0));
+                body.cmVel = Vec3(5, 0, 0);
+                body.angMom = Vec3(0, 20, 0);
+            }
+            world.create(body);
+        }
+        PhysicsWorld physics(world);
+        for (int i = 0; i <= SLEEP_TIME / TIMESTEP + 1; i++) physics.step(TIMESTEP);
+        printf("%d bodies after %.2f s: %d active, %d sleeping, %d awake islands\n", n, SLEEP_TIME, physics.activeNum, physics.sleepingNum, physics.islandNum);
+
+        printBench(runBench("PhysicsWorld::step sleeping " + to_string(n) + " (per body)", n, [&](long long) {
+            physics.step(TIMESTEP);
+        }));
+        physics.sleepEnabled = false;
+        printBench(runBench("PhysicsWorld::step all awake " + to_string(n) + " (per body)", n, [&](long long) {
+            physics.step(TIMESTEP);
+        }));
+
+        //Wake-up paths: an impulse on one resting body, then a mover dropped onto its neighbour
+        physics.sleepEnabled = true;
+        for (int i = 0; i <= SLEEP_TIME / TIMESTEP + 1; i++) physics.step(TIMESTEP);
+        int sleepingBefore = physics.sleepingNum;
+        physics.applyImpulse(1, Vec3(0, 0, 1e-2f), world[1].cmPos + Vec3(5, 0, 0));
+        physics.step(TIMESTEP);
+        int afterImpulse = physics.sleepingNum;
+        world[0].cmPos = world[2].cmPos + Vec3(0, 5, 0);
+        world[0].wake();
+        physics.step(TIMESTEP);
+        printf("sleeping: %d, after an impulse: %d, after a contact: %d\n", sleepingBefore, afterImpulse, physics.sleepingNum);
+    }
+}
+
+//Continuous collision
+//Fast projectiles and a fast-spinning rod whose tip sweeps through a thin heavy plate, next to slowly drifting bodies
+//that make up most of the world. None should get through the plate: discrete detection only manages that with the
+//whole world on small steps, continuous detection with large ones as it only applies to the fast bodies.
+//Cost is per simulated second
+void benchCCD() {
+    const int projectileNum = 16, drifterNum = 256;
+    auto simulate = [&](float dt, bool ccd, int& passed) {
+        BodyPool world(projectileNum + 2 + drifterNum);
+        RigidBody plate = createCuboid(1e2f, 200, 2, 200);
+        plate.bodyMove(-plate.cmPos);
+        world.create(plate);
+
+        RigidBody rod = createCuboid(1e-4f, 100, 4, 4);
+        rod.bodyMove(Vec3(0, -45, 0) - rod.cmPos);
+        rod.angMom = rod.invInertiaTensor.inv() * Vec3(0, 0, 100); //tip at 5000 units/s
+        int rodId = world.create(rod);
+
+        for (int i = 0; i != projectileNum; i++) { //own columns, so they only meet the plate
+            RigidBody projectile = createIcosahedron(1e-4f, 5.f);
+            projectile.bodyMove(Vec3(-75.f + 10.f * i, -60.f - 10.f * i, i % 2 ? 55.f : -55.f) - projectile.cmPos);
+            projectile.cmVel = Vec3(0, 1000, 0);
+            world.create(projectile);
+        }
+        unsigned seed = 4242;
+        for (int i = 0; i != drifterNum; i++) {
+            RigidBody drifter = createIcosahedron(1e-4f, 5.f);
+            drifter.bodyMove(Vec3(30.f * (i % 16) - 225.f, 300, 30.f * (i / 16) - 225.f) - drifter.cmPos);
+            drifter.cmVel = Vec3(10.f * benchRand(seed), 10.f * benchRand(seed), 10.f * benchRand(seed));
+            world.create(drifter);
+        }
+
+        PhysicsWorld physics(world);
+        physics.ccdEnabled = ccd;
+        for (float t = 0.f; t < BENCH_CCD_TIME; t += dt) physics.step(dt);
+
+        //Projectiles must end below the plate, the rod must have been pushed down by it
+        passed = world[rodId].cmVel.y >= 0.f;
+        for (int id = rodId + 1; id != rodId + 1 + projectileNum; id++) passed += world[id].cmPos.y > 0.f;
+    };
+
+    float steps[] = { 0.0005f, 0.002f, 0.01f, 0.05f };
+    for (int ccd = 0; ccd != 2; ccd++) {
+        for (int s = ccd ? 2 : 0; s != 4; s++) {
+            int passed = 0;
+            BenchResult res = runBench(string(ccd ? "ccd" : "discrete") + " dt " + to_string(steps[s]).substr(0, 6) + " (per sim. second)", 1, [&](long long) {
+                simulate(steps[s], ccd, passed);
+            });
+            res.nsPerElem /= BENCH_CCD_TIME;
+            res.cyclesPerElem /= BENCH_CCD_TIME;
+            printBench(res);
+            printf("got through the plate: %d of %d\n", passed, projectileNum + 1);
+        }
+    }
+}
+
+//Snapshots
+//A world of hammers glued together like the demo's, built from scratch against saved to and restored from a snapshot.
+//Restoring and stepping on must give bit for bit the states the original world reaches
+void benchSnapshot() {
+    const string path = "bench_snapshot.bin";
+    int n = MAX_BODIES, side = int(sqrtf(float(n)));
+    vector<LightSource> lights(1, LightSource(0, 0, 300, 40000));
+    Camera cam(nullptr, CAM_INIT_X, CAM_INIT_Y, CAM_INIT_Z, FOV);
+    auto build = [&](BodyPool& world) {
+        unsigned seed = 777;
+        for (int i = 0; i != n; i++) {
+            RigidBody head = createCuboid(1e-4f, 50, 100, 50);
+            RigidBody handle = createCuboid(1e-4f, 100, 10, 10);
+            handle.bodyMove(Vec3(75, 0, 0));
+            RigidBody hammer = glueTogether(head, handle);
+            RigidBody icosahedron = createIcosahedron(1e-4f, 20.f);
+            icosahedron.bodyMove(Vec3(125, 0, 0));
+            hammer = glueTogether(hammer, icosahedron);
+            hammer.bodyMove(Vec3(250.f * (i % side), 0, 250.f * (i / side)) - hammer.cmPos);
+            hammer.cmVel = Vec3(50.f * benchRand(seed), 0, 50.f * benchRand(seed));
+            hammer.angMom = Vec3(0, 5000.f * benchRand(seed), 0);
+            world.create(hammer);
+        }
+    };
+
+    BodyPool world(n);
+    printBench(runBench("build hammers from scratch (per body)", n, [&](long long) {
+        BodyPool scratch(n);
+        build(scratch);
+    }));
+    build(world);
+    PhysicsWorld physics(world);
+    for (int i = 0; i != BENCH_SNAPSHOT_STEPS; i++) physics.step(TIMESTEP);
+
+    bool saved = true, loaded = true;
+    printBench(runBench("saveSnapshot (per body)", n, [&](long long) {
+        saved = saved and saveSnapshot(path, physics, lights, cam);
+    }));
+    BodyPool restored(n);
+    PhysicsWorld restoredPhysics(restored);
+    vector<LightSource> restoredLights;
+    Camera restoredCam(nullptr, 0, 0, 0, FOV);
+    printBench(runBench("loadSnapshot (per body)", n, [&](long long) {
+        loaded = loaded and loadSnapshot(path, restoredPhysics, restoredLights, restoredCam);
+    }));
+    FILE* file = fopen(path.c_str(), "rb");
+    long fileSize = 0;
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        fileSize = ftell(file);
+        fclose(file);
+    }
+    remove(path.c_str());
+
+    for (int i = 0; i != BENCH_SNAPSHOT_STEPS; i++) {
+        physics.step(TIMESTEP);
+        restoredPhysics.step(TIMESTEP);
+    }
+    int differ = 0;
+    for (int id = 0; id != n; id++) {
+        const RigidBody& a = world[id];
+        const RigidBody& b = restored[id];
+        differ += memcmp(&a.cmPos, &b.cmPos, sizeof(Vec3)) or memcmp(&a.cmVel, &b.cmVel, sizeof(Vec3)) or
+            memcmp(&a.angMom, &b.angMom, sizeof(Vec3)) or memcmp(&a.orientMat, &b.orientMat, sizeof(Mat3x3)) or a.sleeping != b.sleeping;
+    }
+    printf("snapshot of %d bodies: %.2f MB, saved: %s, loaded: %s, differing after %d more steps: %d\n", n, fileSize / 1048576.,
+        saved ? "yes" : "no", loaded ? "yes" : "no", BENCH_SNAPSHOT_STEPS, differ);
+}
+
+//World streaming
+//A world of side x side chunks, each with a few instanced, compound and owning bodies, flown over diagonally at a
+//paced frame rate. The main thread's time in the streamer's update is the stall; latency is from a chunk's request
+//to its integration. Reading every chunk up front is the baseline, and a second flight under half the memory the
+//first one peaked at shows eviction by budget
+void buildStreamWorld(BodyPool& pool, int side, int perChunk) {
+    int boxMesh = meshRegistry.add(createCuboid(1e-4f, 120, 80, 60).polys);
+    int icosMesh = meshRegistry.add(icosahedronPolys(40.f));
+    unsigned seed = 4242;
+    for (int iy = 0; iy != side; iy++) {
+        for (int ix = 0; ix != side; ix++) {
+            Vec3 corner = Vec3(float(ix - side / 2), float(iy - side / 2), 0.f) * STREAM_CHUNK_SIZE;
+            for (int i = 0; i != perChunk; i++) {
+                RigidBody body;
+                if (i % 3 == 0) body = createInstance(boxMesh, 1e-4f);
+                else if (i % 3 == 1) {
+                    body.attachChild(boxMesh, 1e-4f, Vec3());
+                    body.attachChild(icosMesh, 1e-4f, Vec3(0, 0, 70));
+                }
+                else body = createCuboid(1e-4f, 40.f + 30.f * fabsf(benchRand(seed)), 40, 160);
+                Vec3 offset(0.5f + 0.45f * benchRand(seed), 0.5f + 0.45f * benchRand(seed), 0.25f + 0.1f * benchRand(seed));
+                body.bodyMove(corner + offset * STREAM_CHUNK_SIZE - body.cmPos);
+                body.orientMat = createRotMat(Vec3(0, 0, 1), 3.f * benchRand(seed));
+                body.isStatic = true;
+                body.sleeping = true;
+                pool.create(body);
+            }
+        }
+    }
+}
+
+void benchStreaming() {
+    const string prefix = "bench_world";
+    int side = STREAM_DEMO_SIDE, n = side * side * STREAM_DEMO_BODIES;
+    {
+        BodyPool source(n);
+        buildStreamWorld(source, side, STREAM_DEMO_BODIES);
+        if (!saveWorldChunks(prefix, source, STREAM_CHUNK_SIZE)) {
+            printf("could not write the streamed world\n");
+            return;
+        }
+    }
+
+    //Baseline: everything read before the first frame
+    vector<string> paths;
+    {
+        BodyPool scratch(1);
+        ChunkStreamer reader(scratch);
+        if (!reader.open(prefix)) {
+            printf("could not open the streamed world\n");
+            return;
+        }
+        paths = reader.paths;
+        long long bytes = 0;
+        for (int c = 0; c != reader.chunks.size(); c++) bytes += reader.chunks[c].bytes;
+        auto t1 = chrono::steady_clock::now();
+        int read = 0;
+        for (int c = 0; c != paths.size(); c++) {
+            LoadedChunk loaded;
+            read += readChunk(paths[c], loaded);
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+        printf("world of %d chunks, %d bodies, %.2f MB: all read up front in %.1f ms (%d read)\n", int(paths.size()), n, bytes / 1048576., ms, read);
+    }
+
+    long long budget = STREAM_MEMORY_BUDGET;
+    for (int run = 0; run != 2; run++) {
+        BodyPool pool(MAX_BODIES);
+        PhysicsWorld physics(pool);
+        ChunkStreamer streamer(pool, budget);
+        streamer.open(prefix);
+        Vec3 eye = Vec3(float(-side / 2), float(-side / 2), 0.3f) * STREAM_CHUNK_SIZE;
+        Vec3 dir = normalize(Vec3(1, 1, 0));
+        double stallSum = 0;
+        for (int frame = 0; frame != BENCH_STREAM_FRAMES; frame++) {
+            auto t1 = chrono::steady_clock::now();
+            physics.step(TIMESTEP);
+            streamer.update(eye);
+            stallSum += streamer.stats.stallMs;
+            eye += dir * BENCH_STREAM_SPEED;
+            this_thread::sleep_until(t1 + chrono::milliseconds(1000 / FPS));
+        }
+        const StreamStats& st = streamer.stats;
+        printf("streamed flight, budget %.2f MB: stall %.3f ms avg, %.3f ms max; latency %.1f ms avg, %.1f ms max; read %.3f ms per chunk; "
+            "peak %.2f MB, %d chunks resident, %lld loads, %lld evictions\n", budget / 1048576., stallSum / BENCH_STREAM_FRAMES, st.maxStallMs,
+            st.loads ? st.latencySumMs / st.loads : 0., st.maxLatencyMs, st.loads ? st.ioSumMs / st.loads : 0., st.peakBytes / 1048576., st.residentChunks, st.loads, st.evictions);
+        budget = st.peakBytes / 2;
+    }
+
+    remove(worldManifestPath(prefix).c_str());
+    for (int c = 0; c != paths.size(); c++) remove(paths[c].c_str());
+}
+
+//Steady-state frame, must not touch the heap
+void benchFrameAllocs(Camera& cam) {
+    RigidBody body = createIcosahedron(1e-4, 20.f);
+    body.angMom = Vec3(0, 15000, 0.01f);
+    vector<LightSource> lights(1, LightSource(0, 0, 300, 40000));
+    vector<Uint32> pixels(WIDTH * HEIGHT);
+
+    long long allocs = 0;
+    for (int frame = 0; frame != BENCH_REPS + 1; frame++) {
+        frameArena.reset();
+        long long before = allocCount;
+        cam.renderPolygon(polyOX);
+        cam.renderShape(body);
+        cam.shadeBuffer(lights, pixels.data(), WIDTH);
+        cam.clearBuffers();
+        body.integrator(TIMESTEP);
+        if (frame) allocs += allocCount - before; //first frame may grow the arena
+    }
+    printf("heap allocations per steady-state frame: %lld\n", allocs / BENCH_REPS);
+}
+
+int runBenchmarks() {
+    printf("%-44s %10s %12s %12s\n", "kernel", "elements", "ns/elem", "cycles/elem");
+
+    for (int s = 0; s != BENCH_SIZES_NUM; s++) benchLinal(BENCH_SIZES[s]);
+
+    Camera cam(nullptr, 0, 0, 0, FOV);
+    benchRaster(cam);
+    benchLighting(cam);
+    benchPhysics();
+    benchSleeping();
+    benchCCD();
+    benchSnapshot();
+    benchStreaming();
+    benchInstancing(cam);
+    benchCompound(cam);
+    benchSceneQueries();
+    benchMultiView();
+    benchRayTracer();
+    benchIncremental();
+    benchTextures(cam);
+    benchParticles(cam);
+    benchStaticLighting(cam);
+    benchFrameAllocs(cam);
+
+    return 0;
+}
@@ -1,16 +1,58 @@
 #pragma once
 
 #include <SDL.h>
+#include <memory>
 #include "parameters.h"
 #include "mylinal.h"
 #include "polygon.h"
 #include "rigidbody.h"
 #include "lightsource.h"
+#include "arena.h"
+#include "texture.h"
+#include "staticlight.h"
+
+//Frame buffer
+//Everything the rasterizer produces for one frame, plus the view it was rendered from so it can be lit later
+struct FrameBuffer {
+    float zBuff[HEIGHT][WIDTH]; //view-space z, or squared eye distance in euclideanDepth mode
+    Vec3 directionBuff[HEIGHT][WIDTH];
+    Vec3 normalBuff[HEIGHT][WIDTH];
+    Uint32 preLightBuff[HEIGHT][WIDTH][3];
+    TexSample texBuff[HEIGHT][WIDTH];
+    float bakedBuff[HEIGHT][WIDTH]; //diffuse light of the static lights where static geometry was drawn, -1 elsewhere; all -1 unless baked
+    bool textured = false; //any textured polygon was drawn, the lighting pass skips texBuff otherwise
+    bool baked = false;    //any polygon with a light map was drawn, the lighting pass skips bakedBuff otherwise
+
+    Vec3 eye = Vec3();
+    Mat3x3 orientMat = IdMat;
+
+    FrameBuffer() {
+        baked = true;
+        clear();
+    }
 
-float zBuff[HEIGHT][WIDTH] = { numeric_limits<float>::max() };
-Vec3 directionBuff[HEIGHT][WIDTH];
-Vec3 normalBuff[HEIGHT][WIDTH];
-Uint32 preLightBuff[HEIGHT][WIDTH][3] = { 0 };
+    void clear() {
+        for (int y = 0; y != HEIGHT; y++) {
+            for (int x = 0; x != WIDTH; x++) {
+                zBuff[y][x] = numeric_limits<float>::max();
+                directionBuff[y][x] = Vec3();
+                normalBuff[y][x] = Vec3();
+                preLightBuff[y][x][0] = 0;
+                preLightBuff[y][x][1] = 0;
+                preLightBuff[y][x][2] = 0;
+                texBuff[y][x].texId = -1;
+            }
+        }
+        if (baked) { //only frames that drew light maps wrote bakedBuff
+            for (int y = 0; y != HEIGHT; y++) {
+                for (int x = 0; x != WIDTH; x++) bakedBuff[y][x] = -1.f;
+            }
+        }
+        textured = false;
+        baked = false;
+    }
+};
+FrameBuffer frameBuffers[FRAME_BUFFER_NUM];
 
 //Functions
 bool pointInTriangle(float px, float py, float x1, float y1, float x2, float y2, float x3, float y3) {
@@ -39,6 +81,107 @@ inline int hexToBlue(Uint32 hex) {
     return (hex & 0x0000ff);
 }
 
+//Shading kernels
+//Diffuse + gloss shading of one surface point, everything in camera CS, normalVec already facing the viewer.
+//LightNum and Gloss are compile-time so the light loop unrolls and the gloss terms disappear when off,
+//LightNum 0 means the light count is only known at run time. lightVisible may mark shadowed lights.
+//A baked value of 0 or more is the diffuse light of the last bakedNum lights (the static ones) already summed up,
+//only their gloss is left to add
+template <int LightNum, bool Gloss>
+inline Uint32 shadeFacingPixel(const Vec3& pointVec, const Vec3& viewVec, const Vec3& normalVec, int red, int green, int blue,
+    const Vec3* lightPos, const LightSource* lights, int lightNum, const bool* lightVisible = nullptr, float baked = -1.f, int bakedNum = 0) {
+    Vec3 incidentVec(0), reflectVec(0);
+    float illumSum(max(baked, 0.f)), glossSum(0), gloss(0);
+    const int num = LightNum ? LightNum : lightNum;
+    const int diffuseNum = baked >= 0.f ? num - bakedNum : num;
+
+    for (int i = 0; i != (Gloss ? num : diffuseNum); i++) {
+        if (lightVisible and !lightVisible[i]) continue;
+
+        incidentVec = lightPos[i] - pointVec;
+        if (i < diffuseNum) illumSum += 0.5f * (normDotProd(normalVec, incidentVec) + 1.f) * lights[i].rad / modSqr(incidentVec);
+
+        if (Gloss) {
+            reflectVec = incidentVec - 2.f * incidentVec.projOn(normalVec);
+            gloss = max(normDotProd(viewVec, reflectVec), 0.f);
+            gloss *= gloss;
+            gloss *= gloss;
+            glossSum += gloss * gloss;
+        }
+    }
+
+    illumSum = min(illumSum, 1.f);
+    glossSum *= GLOSS_FACTOR;
+
+    red = min(red * illumSum + glossSum, 255.f);
+    green = min(green * illumSum + glossSum, 255.f);
+    blue = min(blue * illumSum + glossSum, 255.f);
+
+    return rgbToHex(red, green, blue);
+}
+//Generic version for normals of either orientation, viewVec is the direction the point is seen along
+inline Uint32 shadePixel(const Vec3& pointVec, const Vec3& viewVec, Vec3 normalVec, int red, int green, int blue,
+    const Vec3* lightPos, const LightSource* lights, int lightNum, const bool* lightVisible = nullptr) {
+    if (dotProd(viewVec, normalVec) > 0) normalVec = -1.f * normalVec;
+    return shadeFacingPixel<0, true>(pointVec, viewVec, normalVec, red, green, blue, lightPos, lights, lightNum, lightVisible);
+}
+
+//Lights a rectangle of a frame buffer, lightPos in the buffer's camera CS.
+//The rasterizer stores normals already facing the eye, so there is no per-pixel flip.
+//Baked kernels take the static lights last, bakedNum of them
+template <int LightNum, bool Gloss, bool Textured, bool Baked>
+void shadeRectKernel(const FrameBuffer& src, const Vec3* lightPos, const LightSource* lights, int lightNum, int bakedNum,
+    Uint32* pixelArr, int rowLen, int x0, int y0, int x1, int y1) {
+    Uint32 texColor[WIDTH];
+    long long fetched = 0;
+
+    for (int y = y0; y < y1; y++) {
+        //Texture pass: all texel reads of the row are done together, apart from the lighting math
+        if (Textured) {
+            for (int x = x0; x < x1; x++) {
+                const TexSample& tex = src.texBuff[y][x];
+                if (tex.texId < 0) continue;
+                texColor[x] = textureRegistry[tex.texId].sample(tex.u, tex.v, tex.level);
+                fetched += 4;
+            }
+        }
+
+        for (int x = x0; x < x1; x++) {
+            int red = src.preLightBuff[y][x][0];
+            int green = src.preLightBuff[y][x][1];
+            int blue = src.preLightBuff[y][x][2];
+
+            if (red + green + blue == 0) {
+                pixelArr[y * rowLen + x] = 0x0;
+                continue;
+            }
+            if (Textured and src.texBuff[y][x].texId >= 0) { //texture modulates the polygon colour
+                red = red * hexToRed(texColor[x]) / 255;
+                green = green * hexToGreen(texColor[x]) / 255;
+                blue = blue * hexToBlue(texColor[x]) / 255;
+            }
+
+            const Vec3& directionVec = src.directionBuff[y][x]; //already in eye CS
+            pixelArr[y * rowLen + x] = shadeFacingPixel<LightNum, Gloss>(directionVec, directionVec, src.normalBuff[y][x],
+                red, green, blue, lightPos, lights, lightNum, nullptr, Baked ? src.bakedBuff[y][x] : -1.f, bakedNum);
+        }
+    }
+    if (Textured) texelsFetched += fetched;
+}
+typedef void (*ShadeRectKernel)(const FrameBuffer&, const Vec3*, const LightSource*, int, int, Uint32*, int, int, int, int, int);
+
+//Picks the instantiation for a light count and material features, counts above SHADE_FIXED_LIGHTS use the run-time loop
+inline ShadeRectKernel selectShadeKernel(int lightNum, bool gloss, bool textured = false, bool baked = false) {
+    static_assert(SHADE_FIXED_LIGHTS == 1, "kernel table below lists light counts 0..1");
+    static const ShadeRectKernel kernels[SHADE_FIXED_LIGHTS + 1][2][2][2] = {
+        { { { shadeRectKernel<0, false, false, false>, shadeRectKernel<0, false, false, true> }, { shadeRectKernel<0, false, true, false>, shadeRectKernel<0, false, true, true> } },
+          { { shadeRectKernel<0, true, false, false>, shadeRectKernel<0, true, false, true> }, { shadeRectKernel<0, true, true, false>, shadeRectKernel<0, true, true, true> } } },
+        { { { shadeRectKernel<1, false, false, false>, shadeRectKernel<1, false, false, true> }, { shadeRectKernel<1, false, true, false>, shadeRectKernel<1, false, true, true> } },
+          { { shadeRectKernel<1, true, false, false>, shadeRectKernel<1, true, false, true> }, { shadeRectKernel<1, true, true, false>, shadeRectKernel<1, true, true, true> } } },
+    };
+    return kernels[lightNum <= SHADE_FIXED_LIGHTS ? lightNum : 0][gloss][textured][baked];
+}
+
 //Input variables
 bool wKey(false), aKey(false), sKey(false), dKey(false), altKey(false), spaceKey(false), qKey(false), eKey(false), mouseButton(false), mouseMotion(false);
 float mdx(0), mdy(0);
@@ -50,6 +193,13 @@ struct Camera {
     float scale, pixelSize, width, height;
     const float planeDist = 100.f;
     Mat3x3 orientMat = IdMat;
+    bool euclideanDepth = false; //zBuff holds squared distance to the eye instead of view-space z
+    FrameBuffer* fb = &frameBuffers[0]; //render target
+    unique_ptr<FrameBuffer> ownFb;      //set by ownFrameBuffer, lets several cameras render at once
+    int clipMinX = 0, clipMinY = 0, clipMaxX = WIDTH, clipMaxY = HEIGHT; //scissor rectangle for rasterization
+    bool gloss = GLOSS_FACTOR > 0; //specular highlights, off selects the cheaper shading kernels
+    const StaticLighting* staticLighting = nullptr; //light maps of static bodies drawn by renderWorld, optional
+
 
 
     Camera(SDL_Renderer* rend, float x, float y, float z, float fov) : rend(rend), eye(x, y, z) {
@@ -59,124 +209,184 @@ struct Camera {
         height = HEIGHT * pixelSize;
     }
 
+    void ownFrameBuffer() { //switches the camera to a frame buffer of its own instead of the shared ones
+        if (!ownFb) ownFb.reset(new FrameBuffer);
+        fb = ownFb.get();
+    }
+
     inline Vec3 toCameraCS(const Vec3& vec) {
         return orientMat.T() * vec;
     }
 
-    void updBuff(Vec3& r1, Vec3& r2, Vec3& r3, float x1, float y1, float x2, float y2, float x3, float y3, float red, float green, float blue) {
-
-        int minX(max(0, int(0.5f * WIDTH + min({ x1, x2, x3 }) * scale)));
-        int maxX(min(WIDTH, int(0.5f * WIDTH + max({ x1, x2, x3 }) * scale)));
-        int minY(max(0, int(0.5f * HEIGHT + min({ y1, y2, y3 }) * scale)));
-        int maxY(min(HEIGHT, int(0.5f * HEIGHT + max({ y1, y2, y3 }) * scale)));
+    //Per-triangle dispatch to a rasterization kernel specialized on winding, depth mode, texturing and baked light.
+    //uvSrc holds the texture coordinates of r1, r2, r3 if the polygon is textured, lightMap its baked static light
+    void updBuff(const Vec3& r1, const Vec3& r2, const Vec3& r3, float x1, float y1, float x2, float y2, float x3, float y3,
+        float red, float green, float blue, const Polygon* uvSrc = nullptr, const float* lightMap = nullptr) {
+        typedef void (Camera::* Kernel)(const Vec3&, const Vec3&, const Vec3&, float, float, float, float, float, float, float, float, float,
+            const Polygon*, const float*);
+        static const Kernel kernels[2][2][2][2] = { //[euclideanDepth][ccw][textured][baked]
+            { { { &Camera::updBuffKernel<false, false, false, false>, &Camera::updBuffKernel<false, false, false, true> },
+                { &Camera::updBuffKernel<false, false, true, false>, &Camera::updBuffKernel<false, false, true, true> } },
+              { { &Camera::updBuffKernel<true, false, false, false>, &Camera::updBuffKernel<true, false, false, true> },
+                { &Camera::updBuffKernel<true, false, true, false>, &Camera::updBuffKernel<true, false, true, true> } } },
+            { { { &Camera::updBuffKernel<false, true, false, false>, &Camera::updBuffKernel<false, true, false, true> },
+                { &Camera::updBuffKernel<false, true, true, false>, &Camera::updBuffKernel<false, true, true, true> } },
+              { { &Camera::updBuffKernel<true, true, false, false>, &Camera::updBuffKernel<true, true, false, true> },
+                { &Camera::updBuffKernel<true, true, true, false>, &Camera::updBuffKernel<true, true, true, true> } } }
+        };
+        bool ccw = (x2 - x1) * (y3 - y1) > (y2 - y1) * (x3 - x1);
+        bool textured = uvSrc and uvSrc->texId >= 0;
+        (this->*kernels[euclideanDepth][ccw][textured][lightMap != nullptr])(r1, r2, r3, x1, y1, x2, y2, x3, y3, red, green, blue, uvSrc, lightMap);
+    }
+    template <bool Ccw, bool EuclideanDepth, bool Textured, bool Baked>
+    void updBuffKernel(const Vec3& r1, const Vec3& r2, const Vec3& r3, float x1, float y1, float x2, float y2, float x3, float y3,
+        float red, float green, float blue, const Polygon* uvSrc, const float* lightMap) {
+
+        int minX(max(clipMinX, int(0.5f * WIDTH + min({ x1, x2, x3 }) * scale)));
+        int maxX(min(clipMaxX, int(0.5f * WIDTH + max({ x1, x2, x3 }) * scale)));
+        int minY(max(clipMinY, int(0.5f * HEIGHT + min({ y1, y2, y3 }) * scale)));
+        int maxY(min(clipMaxY, int(0.5f * HEIGHT + max({ y1, y2, y3 }) * scale)));
+
+        if (minX >= maxX) return;
+        if (minY >= maxY) return;
+
+        //Triangle setup
+        //The polygon plane is n*p = d, so the ray through screen point (px, py, planeDist) hits it at t * (px, py, planeDist)
+        //with 1/t = (n.x * px + n.y * py + n.z * planeDist) / d, which is affine in px and py and can be stepped per pixel
+        Vec3 normalVec = crossProd(r2 - r1, r3 - r1);
+        float d = dotProd(normalVec, r1);
+        if (d == 0.f) return; //plane seen edge-on
+        float invTdx = normalVec.x / d * pixelSize;
+
+        //Every visible point p of the plane has p*n = d, so the side facing the eye is known here and not per pixel
+        Vec3 facingNormal = d > 0 ? -1.f * normalVec : normalVec;
+
+        //Texture setup: on the plane u is linear in the camera-space point, u = uGrad * p, and uGrad follows from
+        //the three vertices (their matrix has determinant d, so it is invertible). Screen derivatives of u and v give
+        //the pixel's footprint in texels, which selects the mip level
+        Vec3 uGrad, vGrad;
+        const Texture* tex = nullptr;
+        float footprintScale = 0, nxd = normalVec.x / d, nyd = normalVec.y / d;
+        Mat3x3 invVerts;
+        if (Textured or Baked) invVerts = Mat3x3(r1.x, r1.y, r1.z, r2.x, r2.y, r2.z, r3.x, r3.y, r3.z).inv();
+        if (Textured) {
+            uGrad = invVerts * Vec3(uvSrc->u1, uvSrc->u2, uvSrc->u3);
+            vGrad = invVerts * Vec3(uvSrc->v1, uvSrc->v2, uvSrc->v3);
+            tex = &textureRegistry[uvSrc->texId];
+            footprintScale = float(tex->size) * tex->size * pixelSize * pixelSize;
+            fb->textured = true;
+        }
 
-        if (minX > WIDTH) return;
-        if (maxX < 0) return;
-        if (minY > HEIGHT) return;
-        if (maxY < 0) return;
+        //Light map setup: the weights of r2 and r3 are linear in the point the same way, the side seen picks the map half
+        Vec3 aGrad, bGrad;
+        const float* sideMap = nullptr;
+        if (Baked) {
+            aGrad = Vec3(invVerts.a2, invVerts.b2, invVerts.c2);
+            bGrad = Vec3(invVerts.a3, invVerts.b3, invVerts.c3);
+            sideMap = lightMap + (d > 0 ? BAKE_MAP_SIZE * BAKE_MAP_SIZE : 0);
+            fb->baked = true;
+        }
+        bool unbake = !Baked and fb->baked; //bakedBuff is all -1 until the first light map of the frame is drawn
 
-        float pxStart((minX - 0.5f * WIDTH) * pixelSize),
-            px(pxStart),
-            py((minY - 0.5f * HEIGHT) * pixelSize),
-            polyDistSqr(0);
-        Vec3 directionVec(0);
+        //Edge functions, signed so that all three are non-negative inside the triangle (same test as pointInTriangle)
+        const float sign = Ccw ? 1.f : -1.f;
+        float e1dx = -sign * (y2 - y1) * pixelSize;
+        float e2dx = -sign * (y3 - y2) * pixelSize;
+        float e3dx = -sign * (y1 - y3) * pixelSize;
 
+        //Steps restart from exact values at every RASTER_ROW_BLOCK-th screen column, so the result of a pixel
+        //depends only on its column and not on where the triangle or the scissor rectangle starts the row
         for (int y = minY; y != maxY; y++) {
-            for (int x = minX; x != maxX; x++) {
-                if (!pointInTriangle(px, py, x1, y1, x2, y2, x3, y3)) {
+            float py((y - 0.5f * HEIGHT) * pixelSize);
+            for (int blockX = minX - minX % RASTER_ROW_BLOCK; blockX < maxX; blockX += RASTER_ROW_BLOCK) {
+                float px((blockX - 0.5f * WIDTH) * pixelSize);
+                float e1(sign * ((x2 - x1) * (py - y1) - (y2 - y1) * (px - x1))),
+                    e2(sign * ((x3 - x2) * (py - y2) - (y3 - y2) * (px - x2))),
+                    e3(sign * ((x1 - x3) * (py - y3) - (y1 - y3) * (px - x3))),
+                    invT((normalVec.x * px + normalVec.y * py + normalVec.z * planeDist) / d);
+
+                for (int x = blockX; x < minX; x++) {
+                    e1 += e1dx; e2 += e2dx; e3 += e3dx;
+                    invT += invTdx;
                     px += pixelSize;
-                    continue;
                 }
 
-                directionVec = findIntersection(Vec3(px, py, planeDist), r1, r2, r3);
-                polyDistSqr = modSqr(directionVec);
-                if (polyDistSqr < zBuff[y][x]) {
-                    zBuff[y][x] = polyDistSqr;
-                    directionBuff[y][x] = directionVec;
-                    normalBuff[y][x] = crossProd(r2 - r1, r3 - r1);
-                    preLightBuff[y][x][0] = red;
-                    preLightBuff[y][x][1] = green;
-                    preLightBuff[y][x][2] = blue;
+                for (int x = max(blockX, minX), blockEnd = min(blockX + RASTER_ROW_BLOCK, maxX); x != blockEnd; x++) {
+                    if (e1 >= 0.f and e2 >= 0.f and e3 >= 0.f) {
+                        float t = 1.f / invT;
+                        Vec3 pointVec(px * t, py * t, planeDist * t);
+                        float depth = EuclideanDepth ? modSqr(pointVec) : pointVec.z;
+
+                        if (depth < fb->zBuff[y][x]) {
+                            fb->zBuff[y][x] = depth;
+                            fb->directionBuff[y][x] = pointVec;
+                            fb->normalBuff[y][x] = facingNormal;
+                            fb->preLightBuff[y][x][0] = red;
+                            fb->preLightBuff[y][x][1] = green;
+                            fb->preLightBuff[y][x][2] = blue;
+
+                            TexSample& sample = fb->texBuff[y][x];
+                            if (Textured) {
+                                float u = dotProd(uGrad, pointVec), v = dotProd(vGrad, pointVec);
+                                float dudx = t * (uGrad.x - u * nxd), dvdx = t * (vGrad.x - v * nxd);
+                                float dudy = t * (uGrad.y - u * nyd), dvdy = t * (vGrad.y - v * nyd);
+                                sample.u = u;
+                                sample.v = v;
+                                sample.texId = uvSrc->texId;
+                                sample.level = tex->levelFor(max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy) * footprintScale);
+                            }
+                            else sample.texId = -1;
+                            if (Baked) fb->bakedBuff[y][x] = sampleLightMap(sideMap, dotProd(aGrad, pointVec), dotProd(bGrad, pointVec));
+                            else if (unbake) fb->bakedBuff[y][x] = -1.f;
+                        }
+                    }
+
+                    e1 += e1dx; e2 += e2dx; e3 += e3dx;
+                    invT += invTdx;
+                    px += pixelSize;
                 }
-
-                px += pixelSize;
             }
-            px = pxStart;
-            py += pixelSize;
         }
     }
-    void renderPolygon(Polygon poly) {
-        Vec3 r1(toCameraCS(poly.r1 - eye)), r2(toCameraCS(poly.r2 - eye)), r3(toCameraCS(poly.r3 - eye));
-        bool back1(false), back2(false), back3(false);
-
-        if (r1.z < planeDist) back1 = true;
-        if (r2.z < planeDist) back2 = true;
-        if (r3.z < planeDist) back3 = true;
-
-
-        if (!back1 and !back2 and !back3) {
-            float x1, y1, x2, y2, x3, y3;
-
-            x1 = r1.x * planeDist / r1.z;
-            y1 = r1.y * planeDist / r1.z;
-
-            x2 = r2.x * planeDist / r2.z;
-            y2 = r2.y * planeDist / r2.z;
-
-            x3 = r3.x * planeDist / r3.z;
-            y3 = r3.y * planeDist / r3.z;
-
-            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, poly.r, poly.g, poly.b);
-
-            return;
-        }
-        else if (back1 and back2 and back3) {
-            return;
-        }
-        else if (back1 and !back2 and !back3) {
-            Vec3& f1 = r2; Vec3& f2 = r3; Vec3& b = r1;
-            float x1, y1, x2, y2, x3, y3, x4, y4;
-
-            x1 = f1.x * planeDist / f1.z;
-            y1 = f1.y * planeDist / f1.z;
-
-            x2 = f2.x * planeDist / f2.z;
-            y2 = f2.y * planeDist / f2.z;
-
-            x3 = b.x + (f1.x - b.x) * (planeDist - b.z) / (f1.z - b.z);
-            y3 = b.y + (f1.y - b.y) * (planeDist - b.z) / (f1.z - b.z);
-
-            x4 = b.x + (f2.x - b.x) * (planeDist - b.z) / (f2.z - b.z);
-            y4 = b.y + (f2.y - b.y) * (planeDist - b.z) / (f2.z - b.z);
-
-            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, poly.r, poly.g, poly.b);
-            updBuff(r1, r2, r3, x2, y2, x3, y3, x4, y4, poly.r, poly.g, poly.b);
+    void renderPolygon(const Polygon& poly, const float* lightMap = nullptr) {
+        Mat3x3 toCamMat = orientMat.T();
+        renderCameraPolygon(toCamMat * (poly.r1 - eye), toCamMat * (poly.r2 - eye), toCamMat * (poly.r3 - eye), poly.r, poly.g, poly.b, &poly, lightMap);
+    }
+    //Vertices already in camera CS, uvSrc and lightMap as in updBuff
+    void renderCameraPolygon(const Vec3& r1, const Vec3& r2, const Vec3& r3, int red, int green, int blue, const Polygon* uvSrc = nullptr,
+        const float* lightMap = nullptr) {
+        //Near-clip case as a mask of the vertices behind the near plane, each case has its own kernel
+        int backMask = (r1.z < planeDist) | (r2.z < planeDist) << 1 | (r3.z < planeDist) << 2;
+        static void (Camera::* const clipKernels[8])(const Vec3&, const Vec3&, const Vec3&, int, int, int, const Polygon*, const float*) = {
+            &Camera::renderClipped<0>, &Camera::renderClipped<1>, &Camera::renderClipped<2>, &Camera::renderClipped<3>,
+            &Camera::renderClipped<4>, &Camera::renderClipped<5>, &Camera::renderClipped<6>, &Camera::renderClipped<7>
+        };
+        (this->*clipKernels[backMask])(r1, r2, r3, red, green, blue, uvSrc, lightMap);
+    }
 
-            return;
+    //Vertex roles of a clip case: with one vertex behind, f1 and f2 are the front ones in order and b the back one,
+    //with two behind, f is the front one and b1 and b2 the back ones in order
+    static constexpr int backCount(int mask) {
+        return (mask & 1) + (mask >> 1 & 1) + (mask >> 2 & 1);
+    }
+    static constexpr int nthVertex(int mask, int n, bool back) { //index of the n-th vertex that is (not) behind
+        for (int i = 0; i != 3; i++) {
+            if (((mask >> i & 1) != 0) == back and n-- == 0) return i;
         }
-        else if (!back1 and back2 and !back3) {
-            Vec3& f1 = r1; Vec3& f2 = r3; Vec3& b = r2;
-            float x1, y1, x2, y2, x3, y3, x4, y4;
-
-            x1 = f1.x * planeDist / f1.z;
-            y1 = f1.y * planeDist / f1.z;
-
-            x2 = f2.x * planeDist / f2.z;
-            y2 = f2.y * planeDist / f2.z;
-
-            x3 = b.x + (f1.x - b.x) * (planeDist - b.z) / (f1.z - b.z);
-            y3 = b.y + (f1.y - b.y) * (planeDist - b.z) / (f1.z - b.z);
-
-            x4 = b.x + (f2.x - b.x) * (planeDist - b.z) / (f2.z - b.z);
-            y4 = b.y + (f2.y - b.y) * (planeDist - b.z) / (f2.z - b.z);
-
-            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, poly.r, poly.g, poly.b);
-            updBuff(r1, r2, r3, x2, y2, x3, y3, x4, y4, poly.r, poly.g, poly.b);
+        return 0;
+    }
+    template <int BackMask>
+    void renderClipped(const Vec3& r1, const Vec3& r2, const Vec3& r3, int red, int green, int blue, const Polygon* uvSrc, const float* lightMap) {
+        const Vec3* r[3] = { &r1, &r2, &r3 };
 
-            return;
+        if (backCount(BackMask) == 0) {
+            updBuff(r1, r2, r3, r1.x * planeDist / r1.z, r1.y * planeDist / r1.z,
+                r2.x * planeDist / r2.z, r2.y * planeDist / r2.z, r3.x * planeDist / r3.z, r3.y * planeDist / r3.z, red, green, blue, uvSrc, lightMap);
         }
-        else if (!back1 and !back2 and back3) {
-            Vec3& f1 = r1; Vec3& f2 = r2; Vec3& b = r3;
+        else if (backCount(BackMask) == 1) {
+            const Vec3& f1 = *r[nthVertex(BackMask, 0, false)];
+            const Vec3& f2 = *r[nthVertex(BackMask, 1, false)];
+            const Vec3& b = *r[nthVertex(BackMask, 0, true)];
             float x1, y1, x2, y2, x3, y3, x4, y4;
 
             x1 = f1.x * planeDist / f1.z;
@@ -191,13 +401,13 @@ struct Camera {
             x4 = b.x + (f2.x - b.x) * (planeDist - b.z) / (f2.z - b.z);
             y4 = b.y + (f2.y - b.y) * (planeDist - b.z) / (f2.z - b.z);
 
-            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, poly.r, poly.g, poly.b);
-            updBuff(r1, r2, r3, x2, y2, x3, y3, x4, y4, poly.r, poly.g, poly.b);
-
-            return;
+            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, red, green, blue, uvSrc, lightMap);
+            updBuff(r1, r2, r3, x2, y2, x3, y3, x4, y4, red, green, blue, uvSrc, lightMap);
         }
-        else if (back1 and back2 and !back3) {
-            Vec3& f = r3; Vec3& b1 = r1; Vec3& b2 = r2;
+        else if (backCount(BackMask) == 2) {
+            const Vec3& f = *r[nthVertex(BackMask, 0, false)];
+            const Vec3& b1 = *r[nthVertex(BackMask, 0, true)];
+            const Vec3& b2 = *r[nthVertex(BackMask, 1, true)];
             float x1, y1, x2, y2, x3, y3;
 
             x1 = f.x * planeDist / f.z;
@@ -209,118 +419,110 @@ struct Camera {
             x3 = b2.x + (f.x - b2.x) * (planeDist - b2.z) / (f.z - b2.z);
             y3 = b2.y + (f.y - b2.y) * (planeDist - b2.z) / (f.z - b2.z);
 
-            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, poly.r, poly.g, poly.b);
-
-            return;
+            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, red, green, blue, uvSrc, lightMap);
         }
-        else if (back1 and !back2 and back3) {
-            Vec3& f = r2; Vec3& b1 = r1; Vec3& b2 = r3;
-            float x1, y1, x2, y2, x3, y3;
-
-            x1 = f.x * planeDist / f.z;
-            y1 = f.y * planeDist / f.z;
-
-            x2 = b1.x + (f.x - b1.x) * (planeDist - b1.z) / (f.z - b1.z);
-            y2 = b1.y + (f.y - b1.y) * (planeDist - b1.z) / (f.z - b1.z);
-
-            x3 = b2.x + (f.x - b2.x) * (planeDist - b2.z) / (f.z - b2.z);
-            y3 = b2.y + (f.y - b2.y) * (planeDist - b2.z) / (f.z - b2.z);
-
-            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, poly.r, poly.g, poly.b);
-
-            return;
-        }
-        else if (!back1 and back2 and back3) {
-            Vec3& f = r1; Vec3& b1 = r2; Vec3& b2 = r3;
-            float x1, y1, x2, y2, x3, y3;
-
-            x1 = f.x * planeDist / f.z;
-            y1 = f.y * planeDist / f.z;
-
-            x2 = b1.x + (f.x - b1.x) * (planeDist - b1.z) / (f.z - b1.z);
-            y2 = b1.y + (f.y - b1.y) * (planeDist - b1.z) / (f.z - b1.z);
-
-            x3 = b2.x + (f.x - b2.x) * (planeDist - b2.z) / (f.z - b2.z);
-            y3 = b2.y + (f.y - b2.y) * (planeDist - b2.z) / (f.z - b2.z);
-
-            updBuff(r1, r2, r3, x1, y1, x2, y2, x3, y3, poly.r, poly.g, poly.b);
-
-            return;
+        //all three behind: nothing visible
+    }
+    void renderShape(const RigidBody& body, const float* lightMaps = nullptr) { //lightMaps as StaticLighting::bodyMap
+        Mat3x3 bodyToCam = orientMat.T() * body.orientMat;
+        Vec3 bodyDispl = toCameraCS(body.cmPos - eye);
+        for (int k = 0; k != body.pieceNum(); k++) {
+            ShapePiece piece = body.shapePiece(k);
+            const vector<Polygon>& polys = *piece.polys;
+            int polyNum = polys.size();
+            Mat3x3 toCamMat = bodyToCam * piece.orient;
+            Vec3 displVec = bodyToCam * piece.pos + bodyDispl;
+
+            //Transform all vertices to camera CS first, the transient copy lives in the frame arena
+            Vec3* verts = frameArena.alloc<Vec3>(3 * polyNum);
+            for (int i = 0; i != polyNum; i++) {
+                verts[3 * i] = toCamMat * polys[i].r1 + displVec;
+                verts[3 * i + 1] = toCamMat * polys[i].r2 + displVec;
+                verts[3 * i + 2] = toCamMat * polys[i].r3 + displVec;
+            }
+            for (int i = 0; i != polyNum; i++) {
+                const Polygon& poly = polys[i];
+                const float* lightMap = lightMaps ? lightMaps + i * BAKE_MAP_FLOATS : nullptr;
+                if (piece.colorOverride) renderCameraPolygon(verts[3 * i], verts[3 * i + 1], verts[3 * i + 2], piece.r, piece.g, piece.b, &poly, lightMap);
+                else renderCameraPolygon(verts[3 * i], verts[3 * i + 1], verts[3 * i + 2], poly.r, poly.g, poly.b, &poly, lightMap);
+            }
+            if (lightMaps) lightMaps += polyNum * BAKE_MAP_FLOATS;
         }
     }
-    void renderShape(RigidBody& body) {
-        Mat3x3 rotMat = body.orientMat;
-        Vec3 displVec = body.cmPos;
-        for (int i = 0; i != body.polys.size(); i++) {
-            renderPolygon(rotMat * body.polys[i] + displVec);
+    void renderWorld(BodyPool& world) {
+        //Bodies owning their polygons first, then instances grouped by mesh (counting sort on meshId)
+        //so each shared mesh stays in cache while only the instance transforms change
+        int meshNum = meshRegistry.size();
+        int* meshStart = frameArena.alloc<int>(meshNum + 1);
+        for (int i = 0; i != world.capacity(); i++) {
+            if (!world.alive[i]) continue;
+            if (world[i].meshId < 0) renderShape(world[i], staticLighting ? staticLighting->bodyMap(i) : nullptr);
+            else meshStart[world[i].meshId + 1]++;
+        }
+        for (int m = 0; m != meshNum; m++) meshStart[m + 1] += meshStart[m];
+
+        int* order = frameArena.alloc<int>(meshStart[meshNum]);
+        int* fill = frameArena.alloc<int>(meshNum);
+        for (int i = 0; i != world.capacity(); i++) {
+            if (!world.alive[i] or world[i].meshId < 0) continue;
+            int m = world[i].meshId;
+            order[meshStart[m] + fill[m]++] = i;
+        }
+        for (int i = 0; i != meshStart[meshNum]; i++) {
+            renderShape(world[order[i]], staticLighting ? staticLighting->bodyMap(order[i]) : nullptr);
         }
     }
-    void applyLight(vector<LightSource> lights, SDL_Texture* texture) {
-        Vec3 directionVec(0), normalVec(0), incidentVec(0), reflectVec(0);
-        float illumSum(0), glossSum(0), gloss(0);
-        int red(0), green(0), blue(0);
-
-        void* pixelsPtr; int byteRowLen;
-        SDL_LockTexture(texture, NULL, &pixelsPtr, &byteRowLen);
-        Uint32* pixelArr = static_cast<Uint32*>(pixelsPtr);
-        int rowLen = byteRowLen / sizeof(Uint32);
-
-        for (int y = 0; y != HEIGHT; y++) {
-            for (int x = 0; x != WIDTH; x++) {
-                red = preLightBuff[y][x][0];
-                green = preLightBuff[y][x][1];
-                blue = preLightBuff[y][x][2];
-
-                if (red + green + blue == 0) {
-                    pixelArr[y * rowLen + x] = 0x0;
-                    continue;
-                }
-
-                directionVec = directionBuff[y][x]; //already in eye CS
-                normalVec = normalBuff[y][x];       //already in eye CS
-                if (dotProd(directionVec, normalVec) > 0) normalVec = -1.f * normalVec;
-
-                illumSum = 0;
-                glossSum = 0;
-                for (int i = 0; i != lights.size(); i++) {
-                    incidentVec = toCameraCS(lights[i].r - eye) - directionVec;
-                    illumSum += 0.5f * (normDotProd(normalVec, incidentVec) + 1.f) * lights[i].rad / modSqr(incidentVec);
-
-                    reflectVec = incidentVec - 2.f * incidentVec.projOn(normalVec);
-                    gloss = max(normDotProd(directionVec, reflectVec), 0.f);
-                    gloss *= gloss;
-                    gloss *= gloss;
-                    glossSum += gloss * gloss;
-
+    void beginFrame() { //records the view the target is rasterized from, call before rendering a frame
+        fb->eye = eye;
+        fb->orientMat = orientMat;
+    }
+    void shadeRect(const FrameBuffer& src, const vector<LightSource>& lights, Uint32* pixelArr, int rowLen, int x0, int y0, int x1, int y1) {
+        //Light positions in camera CS, computed once per frame instead of once per pixel
+        int lightNum = lights.size();
+        Vec3* lightPos = frameArena.alloc<Vec3>(lightNum);
+        Mat3x3 toCamMat = src.orientMat.T();
+        for (int i = 0; i != lightNum; i++) lightPos[i] = toCamMat * (lights[i].r - src.eye);
+
+        //With light maps drawn, the static lights go last so baked pixels stop the diffuse loop before them
+        const LightSource* lightArr = lights.data();
+        int bakedNum = 0;
+        if (src.baked) {
+            LightSource* ordered = static_cast<LightSource*>(frameArena.allocBytes(lightNum * sizeof(LightSource), alignof(LightSource)));
+            Vec3* orderedPos = frameArena.alloc<Vec3>(lightNum);
+            for (int pass = 0, k = 0; pass != 2; pass++) {
+                for (int i = 0; i != lightNum; i++) {
+                    if (lights[i].isStatic != (pass == 1)) continue;
+                    new (ordered + k) LightSource(lights[i]);
+                    orderedPos[k++] = lightPos[i];
+                    bakedNum += pass;
                 }
-
-                illumSum = min(illumSum, 1.f);
-                glossSum *= GLOSS_FACTOR;
-
-                red = min(red * illumSum + glossSum, 255.f);
-                green = min(green * illumSum + glossSum, 255.f);
-                blue = min(blue * illumSum + glossSum, 255.f);
-
-                pixelArr[y * rowLen + x] = rgbToHex(red, green, blue);
             }
+            lightArr = ordered;
+            lightPos = orderedPos;
         }
-
+        selectShadeKernel(lightNum, gloss, src.textured, src.baked)(src, lightPos, lightArr, lightNum, bakedNum, pixelArr, rowLen, x0, y0, x1, y1);
+    }
+    void shadeBuffer(const FrameBuffer& src, const vector<LightSource>& lights, Uint32* pixelArr, int rowLen) {
+        shadeRect(src, lights, pixelArr, rowLen, 0, 0, WIDTH, HEIGHT);
+    }
+    void shadeBuffer(const vector<LightSource>& lights, Uint32* pixelArr, int rowLen) {
+        shadeBuffer(*fb, lights, pixelArr, rowLen);
+    }
+    void applyLight(const FrameBuffer& src, const vector<LightSource>& lights, SDL_Texture* texture) {
+        void* pixelsPtr; int byteRowLen;
+        SDL_LockTexture(texture, NULL, &pixelsPtr, &byteRowLen);
+        shadeBuffer(src, lights, static_cast<Uint32*>(pixelsPtr), byteRowLen / sizeof(Uint32));
         SDL_UnlockTexture(texture);
     }
+    void applyLight(const vector<LightSource>& lights, SDL_Texture* texture) {
+        applyLight(*fb, lights, texture);
+    }
+    void clearBuffers() {
+        fb->clear();
+    }
     void draw(SDL_Texture* texture) {
         SDL_RenderCopy(rend, texture, NULL, NULL);
-
-        for (int y = 0; y != HEIGHT; y++) {
-            for (int x = 0; x != WIDTH; x++) {
-                zBuff[y][x] = numeric_limits<float>::max();
-                directionBuff[y][x] = Vec3();
-                normalBuff[y][x] = Vec3();
-                preLightBuff[y][x][0] = 0;
-                preLightBuff[y][x][1] = 0;
-                preLightBuff[y][x][2] = 0;
-            }
-        }
-
+        clearBuffers();
     }
 
     void rotSelfOX(float angle) {
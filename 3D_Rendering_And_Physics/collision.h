@@ -0,0 +1,346 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <cmath>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "rigidbody.h"
+
+//Closest points (Ericson, Real-Time Collision Detection 5.1.5 and 5.1.9)
+Vec3 closestOnTriangle(const Vec3& p, const Vec3& a, const Vec3& b, const Vec3& c) {
+    Vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = dotProd(ab, ap), d2 = dotProd(ac, ap);
+    if (d1 <= 0.f and d2 <= 0.f) return a;
+
+    Vec3 bp = p - b;
+    float d3 = dotProd(ab, bp), d4 = dotProd(ac, bp);
+    if (d3 >= 0.f and d4 <= d3) return b;
+
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.f and d1 >= 0.f and d3 <= 0.f) return a + ab * (d1 / (d1 - d3));
+
+    Vec3 cp = p - c;
+    float d5 = dotProd(ab, cp), d6 = dotProd(ac, cp);
+    if (d6 >= 0.f and d5 <= d6) return c;
+
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.f and d2 >= 0.f and d6 <= 0.f) return a + ac * (d2 / (d2 - d6));
+
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.f and d4 - d3 >= 0.f and d5 - d6 >= 0.f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    float denom = 1.f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+void closestOnSegments(const Vec3& p1, const Vec3& q1, const Vec3& p2, const Vec3& q2, Vec3& c1, Vec3& c2) {
+    Vec3 d1 = q1 - p1, d2 = q2 - p2, r = p1 - p2;
+    float a = dotProd(d1, d1), e = dotProd(d2, d2), f = dotProd(d2, r);
+    float s = 0.f, t = 0.f;
+
+    if (a <= 1e-12f and e <= 1e-12f) {
+        c1 = p1;
+        c2 = p2;
+        return;
+    }
+    if (a <= 1e-12f) t = min(max(f / e, 0.f), 1.f);
+    else {
+        float c = dotProd(d1, r);
+        if (e <= 1e-12f) s = min(max(-c / a, 0.f), 1.f);
+        else {
+            float b = dotProd(d1, d2), denom = a * e - b * b;
+            if (denom != 0.f) s = min(max((b * f - c * e) / denom, 0.f), 1.f);
+            t = (b * s + f) / e;
+            if (t < 0.f) {
+                t = 0.f;
+                s = min(max(-c / a, 0.f), 1.f);
+            }
+            else if (t > 1.f) {
+                t = 1.f;
+                s = min(max((b - c) / a, 0.f), 1.f);
+            }
+        }
+    }
+    c1 = p1 + d1 * s;
+    c2 = p2 + d2 * t;
+}
+bool segmentCrossesTriangle(const Vec3& p, const Vec3& q, const Vec3& a, const Vec3& b, const Vec3& c, Vec3& hit) {
+    Vec3 dir = q - p, e1 = b - a, e2 = c - a;
+    Vec3 h = crossProd(dir, e2);
+    float det = dotProd(e1, h);
+    if (fabs(det) < 1e-12f) return false;
+
+    float invDet = 1.f / det;
+    Vec3 s = p - a;
+    float u = dotProd(s, h) * invDet;
+    if (u < 0.f or u > 1.f) return false;
+    Vec3 k = crossProd(s, e1);
+    float v = dotProd(dir, k) * invDet;
+    if (v < 0.f or u + v > 1.f) return false;
+
+    float t = dotProd(e2, k) * invDet;
+    if (t < 0.f or t > 1.f) return false;
+    hit = p + dir * t;
+    return true;
+}
+
+//Distance between two triangles with their closest points, 0 when they intersect. dir points from t1 to t2:
+//c2 - c1 when apart, else the normal of the triangle crossed, turned away from t1's centroid
+float triangleDistance(const Vec3* t1, const Vec3* t2, Vec3& c1, Vec3& c2, Vec3& dir) {
+    for (int i = 0; i != 3; i++) {
+        Vec3 hit;
+        bool crossesT2 = segmentCrossesTriangle(t1[i], t1[(i + 1) % 3], t2[0], t2[1], t2[2], hit);
+        if (crossesT2 or segmentCrossesTriangle(t2[i], t2[(i + 1) % 3], t1[0], t1[1], t1[2], hit)) {
+            const Vec3* crossed = crossesT2 ? t2 : t1;
+            dir = crossProd(crossed[1] - crossed[0], crossed[2] - crossed[0]);
+            if (dotProd(dir, (t2[0] + t2[1] + t2[2]) - (t1[0] + t1[1] + t1[2])) < 0.f) dir = -dir;
+            c1 = c2 = hit;
+            return 0.f;
+        }
+    }
+
+    float best = numeric_limits<float>::max();
+    for (int i = 0; i != 3; i++) { //vertices against faces
+        Vec3 p = closestOnTriangle(t1[i], t2[0], t2[1], t2[2]);
+        float dist = modSqr(p - t1[i]);
+        if (dist < best) { best = dist; c1 = t1[i]; c2 = p; }
+
+        p = closestOnTriangle(t2[i], t1[0], t1[1], t1[2]);
+        dist = modSqr(p - t2[i]);
+        if (dist < best) { best = dist; c1 = p; c2 = t2[i]; }
+    }
+    for (int i = 0; i != 3; i++) { //edges against edges
+        for (int j = 0; j != 3; j++) {
+            Vec3 p1, p2;
+            closestOnSegments(t1[i], t1[(i + 1) % 3], t2[j], t2[(j + 1) % 3], p1, p2);
+            float dist = modSqr(p2 - p1);
+            if (dist < best) { best = dist; c1 = p1; c2 = p2; }
+        }
+    }
+    dir = c2 - c1;
+    return sqrtf(best);
+}
+
+//Body motion
+//Pose after time t of a step, the same motion RigidBody::integrator performs: constant velocity and rotation
+//about the angular velocity of the step's start
+struct BodyPose {
+    Vec3 pos;
+    Mat3x3 orient;
+};
+inline BodyPose poseAt(const RigidBody& body, float t) {
+    BodyPose pose;
+    pose.pos = body.cmPos + body.cmVel * t;
+    float angSpeed = mod(body.angVel);
+    pose.orient = angSpeed > 0.f ? createRotMat(body.angVel, angSpeed * t) * body.orientMat : body.orientMat;
+    return pose;
+}
+
+//Contact between bodies a and b, normal pointing from a to b
+struct Contact {
+    int pair;          //index into PhysicsWorld::pairs
+    int a, b;
+    float toi;         //time into the step
+    Vec3 point, normal;
+    float normalSpeed; //velocity of b's point relative to a's along the normal, negative when closing
+    int eventA, eventB; //contacts a and b had taken in the step when this one was found
+};
+
+//Narrow phase
+//Reusable buffers so queries do not allocate once warmed up
+struct CollisionScratch {
+    vector<Vec3> verts[2];   //of a and b, world-space triangle vertices
+    vector<Vec3> boxMin[2];  //per triangle, bounding box
+    vector<Vec3> boxMax[2];
+    Vec3 bodyMin[2], bodyMax[2];
+    vector<Vec3> normal[2];  //per triangle, unit normal
+    vector<float> gap;       //per triangle pair, lower bound on the distance
+};
+
+//Lower bound on the distance of triangle t from the triangle in plane (normalVec unit, through p0):
+//how far t lies wholly on one side of the plane, 0 if it straddles it
+inline float planeGap(const Vec3& normalVec, const Vec3& p0, const Vec3* t) {
+    float d0 = dotProd(normalVec, t[0] - p0), d1 = dotProd(normalVec, t[1] - p0), d2 = dotProd(normalVec, t[2] - p0);
+    if (d0 > 0.f and d1 > 0.f and d2 > 0.f) return min(d0, min(d1, d2));
+    if (d0 < 0.f and d1 < 0.f and d2 < 0.f) return -max(d0, max(d1, d2));
+    return 0.f;
+}
+
+//Velocity of the body's material point p (world CS) when placed at pose
+inline Vec3 pointVelocity(const RigidBody& body, const BodyPose& pose, const Vec3& p) {
+    return body.cmVel + crossProd(body.angVel, p - pose.pos);
+}
+
+//Distance between two boxes, 0 if they overlap
+inline float boxGap(const Vec3& min1, const Vec3& max1, const Vec3& min2, const Vec3& max2) {
+    float dx = max(0.f, max(min1.x - max2.x, min2.x - max1.x));
+    float dy = max(0.f, max(min1.y - max2.y, min2.y - max1.y));
+    float dz = max(0.f, max(min1.z - max2.z, min2.z - max1.z));
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+//World-space triangles of a body at pose, with their bounding boxes and normals
+void placeTriangles(const RigidBody& body, const BodyPose& pose, CollisionScratch& scratch, int side) {
+    scratch.verts[side].resize(3 * body.polyNum);
+    scratch.boxMin[side].resize(body.polyNum);
+    scratch.boxMax[side].resize(body.polyNum);
+    scratch.normal[side].resize(body.polyNum);
+    Vec3& bodyMin = scratch.bodyMin[side];
+    Vec3& bodyMax = scratch.bodyMax[side];
+    bodyMin = Vec3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+    bodyMax = -bodyMin;
+    int i = 0;
+    for (int k = 0; k != body.pieceNum(); k++) {
+        ShapePiece piece = body.shapePiece(k);
+        const vector<Polygon>& polys = *piece.polys;
+        Mat3x3 orient = pose.orient * piece.orient;
+        Vec3 pos = pose.orient * piece.pos + pose.pos;
+        for (int j = 0; j != polys.size(); j++, i++) {
+            Vec3* v = &scratch.verts[side][3 * i];
+            v[0] = orient * polys[j].r1 + pos;
+            v[1] = orient * polys[j].r2 + pos;
+            v[2] = orient * polys[j].r3 + pos;
+            scratch.boxMin[side][i] = Vec3(min(v[0].x, min(v[1].x, v[2].x)), min(v[0].y, min(v[1].y, v[2].y)), min(v[0].z, min(v[1].z, v[2].z)));
+            scratch.boxMax[side][i] = Vec3(max(v[0].x, max(v[1].x, v[2].x)), max(v[0].y, max(v[1].y, v[2].y)), max(v[0].z, max(v[1].z, v[2].z)));
+            const Vec3& lo = scratch.boxMin[side][i];
+            const Vec3& hi = scratch.boxMax[side][i];
+            bodyMin = Vec3(min(bodyMin.x, lo.x), min(bodyMin.y, lo.y), min(bodyMin.z, lo.z));
+            bodyMax = Vec3(max(bodyMax.x, hi.x), max(bodyMax.y, hi.y), max(bodyMax.z, hi.z));
+            scratch.normal[side][i] = normalize(crossProd(v[1] - v[0], v[2] - v[0]));
+        }
+    }
+}
+
+//Distance between two bodies placed at the given poses, with world-space closest points.
+//Brute force over triangle pairs, pruned by lower bounds from per-triangle bounding boxes and planes; the pair with
+//the smallest bound goes first so the rest mostly fall below the distance found. Features already within
+//CONTACT_TOLERANCE and moving apart are skipped, so a body spinning off one contact is measured against the next one
+//coming. normal is the unit direction from a to b at the closest points. Returns limit, outputs unset, when the bodies
+//are not closer than it
+float bodyDistance(const RigidBody& a, const BodyPose& pa, const RigidBody& b, const BodyPose& pb, CollisionScratch& scratch,
+    Vec3& ca, Vec3& cb, Vec3& normal, float limit = numeric_limits<float>::max()) {
+    placeTriangles(a, pa, scratch, 0);
+    placeTriangles(b, pb, scratch, 1);
+    if (boxGap(scratch.bodyMin[0], scratch.bodyMax[0], scratch.bodyMin[1], scratch.bodyMax[1]) >= limit) return limit;
+    int numB = b.polyNum;
+    scratch.gap.resize(a.polyNum * numB);
+    int first = -1;
+    float firstGap = limit;
+    for (int i = 0; i != a.polyNum; i++) {
+        const Vec3* ta = &scratch.verts[0][3 * i];
+        for (int j = 0; j != numB; j++) {
+            const Vec3* tb = &scratch.verts[1][3 * j];
+            float gap = max(boxGap(scratch.boxMin[0][i], scratch.boxMax[0][i], scratch.boxMin[1][j], scratch.boxMax[1][j]),
+                max(planeGap(scratch.normal[0][i], ta[0], tb), planeGap(scratch.normal[1][j], tb[0], ta)));
+            scratch.gap[i * numB + j] = gap;
+            if (gap < firstGap) {
+                firstGap = gap;
+                first = i * numB + j;
+            }
+        }
+    }
+    if (first < 0) return limit;
+
+    float best = limit;
+    for (int k = -1; k != a.polyNum * numB; k++) {
+        int pair = k < 0 ? first : k;
+        if (scratch.gap[pair] >= best or (k >= 0 and k == first)) continue;
+        const Vec3* ta = &scratch.verts[0][3 * (pair / numB)];
+        const Vec3* tb = &scratch.verts[1][3 * (pair % numB)];
+        Vec3 c1, c2, dir;
+        float dist = triangleDistance(ta, tb, c1, c2, dir);
+        if (dist >= best) continue;
+        if (dist <= CONTACT_TOLERANCE and dotProd(pointVelocity(b, pb, c2) - pointVelocity(a, pa, c1), dir) >= 0.f) continue;
+        best = dist;
+        ca = c1;
+        cb = c2;
+        normal = modSqr(dir) > 0.f ? normalize(dir) : normalize(pb.pos - pa.pos); //touching exactly, no direction of their own
+        if (best == 0.f) return 0.f;
+    }
+    return best;
+}
+
+//Closest points of a and b at time t of the step, timeA and timeB being the times their states are at.
+//Fills in the contact's time, point, normal and normal speed, returns the distance or limit if not closer
+float contactAt(const RigidBody& a, float timeA, const RigidBody& b, float timeB, float t, CollisionScratch& scratch, Contact& contact,
+    float limit = numeric_limits<float>::max()) {
+    BodyPose pa = poseAt(a, t - timeA), pb = poseAt(b, t - timeB);
+    Vec3 ca, cb;
+    float dist = bodyDistance(a, pa, b, pb, scratch, ca, cb, contact.normal, limit);
+    if (dist >= limit) return limit;
+
+    contact.toi = t;
+    contact.point = (ca + cb) / 2.f;
+    contact.normalSpeed = dotProd(pointVelocity(b, pb, contact.point) - pointVelocity(a, pa, contact.point), contact.normal);
+    return dist;
+}
+
+//Discrete test: a and b are closing in on each other within CONTACT_TOLERANCE at time t
+bool contactTest(const RigidBody& a, float timeA, const RigidBody& b, float timeB, float t, CollisionScratch& scratch, Contact& contact) {
+    float limit = nextafterf(CONTACT_TOLERANCE, numeric_limits<float>::max());
+    return contactAt(a, timeA, b, timeB, t, scratch, contact, limit) < limit and contact.normalSpeed < 0.f;
+}
+
+//Fastest speed of a body's point about cmPos from its spin. |angVel x r| is largest at a vertex, and taken in body
+//space it is tight for long bodies spinning about their long axis, where |angVel| * boundRadius is far off
+float spinSpeed(const RigidBody& body) {
+    Vec3 localAngVel = body.orientMat.T() * body.angVel;
+    float fastest = 0.f;
+    for (int k = 0; k != body.pieceNum(); k++) {
+        ShapePiece piece = body.shapePiece(k);
+        const vector<Polygon>& polys = *piece.polys;
+        for (int i = 0; i != polys.size(); i++) {
+            fastest = max(fastest, max(modSqr(crossProd(localAngVel, piece.orient * polys[i].r1 + piece.pos)),
+                max(modSqr(crossProd(localAngVel, piece.orient * polys[i].r2 + piece.pos)), modSqr(crossProd(localAngVel, piece.orient * polys[i].r3 + piece.pos)))));
+        }
+    }
+    return sqrtf(fastest);
+}
+
+//Conservative advancement (Mirtich): no point of either body approaches the other faster than the relative linear
+//velocity along the closest-point direction plus the spin speed of each, so advancing by distance / that bound
+//can never skip a contact. Touching bodies that separate are stepped past by CONTACT_TOLERANCE worth of motion, so a
+//body spinning off one contact still finds its next one. Finds the first closing contact of a and b within [t0, t1]
+bool timeOfImpact(const RigidBody& a, float timeA, const RigidBody& b, float timeB, float t0, float t1, CollisionScratch& scratch, Contact& contact) {
+    float spinBound = spinSpeed(a) + spinSpeed(b);
+    float t = t0;
+    for (int iter = 0; iter != CCD_MAX_ITERATIONS; iter++) {
+        float dist = contactAt(a, timeA, b, timeB, t, scratch, contact);
+        //Every feature in reach separates, so contact got no normal: step past them on a bound of any point's relative speed
+        if (dist == numeric_limits<float>::max()) {
+            float speed = mod(a.cmVel - b.cmVel) + spinBound;
+            if (speed <= 0.f) return false;
+            t += CONTACT_TOLERANCE / speed;
+            if (t > t1) return false;
+            continue;
+        }
+        bool touching = dist <= CONTACT_TOLERANCE;
+        if (touching and contact.normalSpeed < 0.f) return true;
+
+        float approach = dotProd(a.cmVel - b.cmVel, contact.normal) + spinBound;
+        if (approach <= 0.f) return false;
+        t += touching ? CONTACT_TOLERANCE / approach : (dist - 0.5f * CONTACT_TOLERANCE) / approach;
+        if (t > t1) return false;
+    }
+    return false;
+}
+
+//Frictionless impulse along the contact normal, the bodies must already be at the contact pose
+void resolveContact(RigidBody& a, RigidBody& b, const Contact& contact) {
+    Vec3 rA = contact.point - a.cmPos, rB = contact.point - b.cmPos;
+    Mat3x3 invIA = a.orientMat * a.invInertiaTensor * a.orientMat.T();
+    Mat3x3 invIB = b.orientMat * b.invInertiaTensor * b.orientMat.T();
+    Vec3 angVelA = invIA * a.angMom, angVelB = invIB * b.angMom;
+
+    const Vec3& n = contact.normal;
+    float vRel = dotProd(b.cmVel + crossProd(angVelB, rB) - a.cmVel - crossProd(angVelA, rA), n);
+    if (vRel >= 0.f) return; //already separating
+
+    float k = 1.f / a.mass + 1.f / b.mass + dotProd(n, crossProd(invIA * crossProd(rA, n), rA) + crossProd(invIB * crossProd(rB, n), rB));
+    float j = -(1.f + RESTITUTION) * vRel / k;
+    a.applyImpulse(-j * n, contact.point);
+    b.applyImpulse(j * n, contact.point);
+    a.angVel = invIA * a.angMom; //the rest of the step moves with the new spin
+    b.angVel = invIB * b.angMom;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstdio>
+#include <csignal>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <SDL.h>
+#include "parameters.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define popen _popen
+#define pclose _pclose
+#define POPEN_WRITE_MODE "wb"
+#else
+#define POPEN_WRITE_MODE "w"
+#endif
+
+//Frame sink
+//Streams lit frames to a file, stdout or a pipe (e.g. an encoder) as raw RGB24 or YUV4MPEG2.
+//The renderer shades straight into one of FRAME_SINK_RING preallocated slots (acquire/commit),
+//and a writer thread converts and writes them. When the consumer falls behind and the ring is full
+//the frame is dropped instead of stalling the render loop. A failed write (e.g. the encoder behind the pipe
+//exited) closes the sink: later frames are neither queued nor counted as dropped.
+enum SinkFormat { SINK_RGB, SINK_Y4M };
+
+struct FrameSink {
+    FILE* out;
+    bool ownsFile, isPipe;
+    SinkFormat format;
+
+    vector<vector<Uint32>> slots;
+    int head = 0;       //next slot to fill
+    int tail = 0;       //next slot to write
+    int queued = 0;
+    bool acquired = false;
+    bool quit = false;
+    mutex m;
+    condition_variable cv;
+
+    vector<Uint8> packed; //converted frame, owned by the writer thread
+
+    //Statistics
+    atomic<long long> framesWritten, framesDropped, bytesWritten;
+    atomic<bool> failed;
+    chrono::steady_clock::time_point openTime;
+
+    thread writer; //declared last so everything above exists before it starts
+
+    FrameSink(FILE* out, SinkFormat format, bool ownsFile = false, bool isPipe = false) :
+        out(out), ownsFile(ownsFile), isPipe(isPipe), format(format), slots(FRAME_SINK_RING, vector<Uint32>(WIDTH * HEIGHT)),
+        packed(format == SINK_RGB ? 3 * WIDTH * HEIGHT : WIDTH * HEIGHT + 2 * ((WIDTH + 1) / 2) * ((HEIGHT + 1) / 2)),
+        framesWritten(0), framesDropped(0), bytesWritten(0), failed(false), openTime(chrono::steady_clock::now()) {
+#ifndef _WIN32
+        signal(SIGPIPE, SIG_IGN); //a reader gone away fails the write instead of killing the process
+#endif
+        if (format == SINK_Y4M and fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", WIDTH, HEIGHT, FPS) < 0) close();
+        writer = thread(&FrameSink::writeLoop, this);
+    }
+    FrameSink(const FrameSink&) = delete;
+    FrameSink& operator=(const FrameSink&) = delete;
+    ~FrameSink() {
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+        }
+        cv.notify_all();
+        writer.join();
+        if (out) fflush(out);
+        close();
+    }
+    void close() { //stops the output after a failed write, the owned file or pipe is closed
+        failed = true;
+        if (out and ownsFile) {
+            if (isPipe) pclose(out);
+            else fclose(out);
+        }
+        out = nullptr;
+    }
+
+    //Target is "-" for stdout, "|command" for a pipe into command, anything else is a file path
+    static FrameSink* open(const string& target, SinkFormat format) {
+        if (target == "-") {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            return new FrameSink(stdout, format);
+        }
+        FILE* file = target[0] == '|' ? popen(target.c_str() + 1, POPEN_WRITE_MODE) : fopen(target.c_str(), "wb");
+        if (!file) return nullptr;
+        return new FrameSink(file, format, true, target[0] == '|');
+    }
+
+    //Returns a WIDTH x HEIGHT slot to shade into, nullptr (and a dropped frame) if the writer is behind
+    Uint32* acquire() {
+        lock_guard<mutex> lock(m);
+        if (failed) return nullptr;
+        if (queued == FRAME_SINK_RING) {
+            framesDropped++;
+            return nullptr;
+        }
+        acquired = true;
+        return slots[head].data();
+    }
+    void commit() {
+        {
+            lock_guard<mutex> lock(m);
+            if (!acquired) return;
+            acquired = false;
+            head = (head + 1) % FRAME_SINK_RING;
+            queued++;
+        }
+        cv.notify_all();
+    }
+
+    //Packs 0x00RRGGBB pixels into the output format
+    void pack(const Uint32* pixels) {
+        if (format == SINK_RGB) {
+            for (int i = 0; i != WIDTH * HEIGHT; i++) {
+                packed[3 * i] = (pixels[i] >> 16) & 0xff;
+                packed[3 * i + 1] = (pixels[i] >> 8) & 0xff;
+                packed[3 * i + 2] = pixels[i] & 0xff;
+            }
+            return;
+        }
+
+        //BT.601 full range, chroma averaged over 2x2 blocks
+        Uint8* yPlane = packed.data();
+        int chromaW = (WIDTH + 1) / 2, chromaH = (HEIGHT + 1) / 2;
+        Uint8* uPlane = yPlane + WIDTH * HEIGHT;
+        Uint8* vPlane = uPlane + chromaW * chromaH;
+        for (int y = 0; y != HEIGHT; y++) {
+            for (int x = 0; x != WIDTH; x++) {
+                Uint32 p = pixels[y * WIDTH + x];
+                int r = (p >> 16) & 0xff, g = (p >> 8) & 0xff, b = p & 0xff;
+                yPlane[y * WIDTH + x] = Uint8((77 * r + 150 * g + 29 * b) >> 8);
+            }
+        }
+        for (int cy = 0; cy != chromaH; cy++) {
+            for (int cx = 0; cx != chromaW; cx++) {
+                int r = 0, g = 0, b = 0, n = 0;
+                for (int k = 0; k != 4; k++) {
+                    int x = 2 * cx + (k & 1), y = 2 * cy + (k >> 1);
+                    if (x >= WIDTH or y >= HEIGHT) continue;
+                    Uint32 p = pixels[y * WIDTH + x];
+                    r += (p >> 16) & 0xff; g += (p >> 8) & 0xff; b += p & 0xff;
+                    n++;
+                }
+                r /= n; g /= n; b /= n;
+                uPlane[cy * chromaW + cx] = Uint8(min(255, max(0, ((-43 * r - 85 * g + 128 * b) >> 8) + 128)));
+                vPlane[cy * chromaW + cx] = Uint8(min(255, max(0, ((128 * r - 107 * g - 21 * b) >> 8) + 128)));
+            }
+        }
+    }
+    void writeLoop() {
+        unique_lock<mutex> lock(m);
+        if (failed) return;
+        while (true) {
+            cv.wait(lock, [this] { return queued > 0 or quit; });
+            if (!queued) return;
+
+            const Uint32* pixels = slots[tail].data();
+            lock.unlock();
+
+            pack(pixels);
+            size_t bytes = 0, expected = packed.size() + (format == SINK_Y4M ? 6 : 0);
+            if (format == SINK_Y4M) bytes += fwrite("FRAME\n", 1, 6, out);
+            if (bytes == expected - packed.size()) bytes += fwrite(packed.data(), 1, packed.size(), out);
+            bytesWritten += bytes;
+            if (bytes == expected) framesWritten++;
+
+            lock.lock();
+            tail = (tail + 1) % FRAME_SINK_RING;
+            queued--;
+            if (bytes != expected) { //the queued frames go with the output
+                close();
+                queued = 0;
+                return;
+            }
+        }
+    }
+
+    double megabytesPerSecond() const { //sustained since the sink was opened
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - openTime).count();
+        return seconds > 0 ? bytesWritten / seconds / (1 << 20) : 0;
+    }
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <SDL.h>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "rigidbody.h"
+#include "lightsource.h"
+#include "camera.h"
+#include "arena.h"
+
+//Screen rectangle, [x0, x1) x [y0, y1)
+struct ScreenRect {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    ScreenRect() {}
+    ScreenRect(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) {}
+
+    bool empty() const {
+        return x0 >= x1 or y0 >= y1;
+    }
+    int area() const {
+        return empty() ? 0 : (x1 - x0) * (y1 - y0);
+    }
+    bool overlaps(const ScreenRect& other) const {
+        return x0 < other.x1 and other.x0 < x1 and y0 < other.y1 and other.y0 < y1;
+    }
+    void merge(const ScreenRect& other) {
+        x0 = min(x0, other.x0); y0 = min(y0, other.y0);
+        x1 = max(x1, other.x1); y1 = max(y1, other.y1);
+    }
+};
+const ScreenRect fullScreen(0, 0, WIDTH, HEIGHT);
+
+inline bool sameVec(const Vec3& a, const Vec3& b) {
+    return a.x == b.x and a.y == b.y and a.z == b.z;
+}
+inline bool sameMat(const Mat3x3& a, const Mat3x3& b) {
+    return sameVec(Vec3(a.a1, a.a2, a.a3), Vec3(b.a1, b.a2, b.a3)) and
+        sameVec(Vec3(a.b1, a.b2, a.b3), Vec3(b.b1, b.b2, b.b3)) and
+        sameVec(Vec3(a.c1, a.c2, a.c3), Vec3(b.c1, b.c2, b.c3));
+}
+
+//Incremental renderer
+//For mostly static scenes: while the camera and lights stay put, only the screen areas a moving body
+//left or entered are restored from the cached static-geometry buffer, re-rasterized and re-lit.
+//Any camera movement falls back to a full redraw, which also refreshes the static cache.
+struct IncrementalRenderer {
+    FrameBuffer* staticFb = new FrameBuffer; //static polygons only, valid for lastEye/lastOrient
+    FrameBuffer* fb = new FrameBuffer;       //static + bodies
+    vector<Uint32> pixels = vector<Uint32>(WIDTH * HEIGHT); //lit output, kept between frames
+
+    bool valid = false;
+    Vec3 lastEye = Vec3();
+    Mat3x3 lastOrient = IdMat;
+    vector<LightSource> lastLights;
+    int lastBakeVersion = -1;
+
+    //Per body slot state of the previous frame
+    vector<bool> wasAlive;
+    vector<Vec3> lastPos;
+    vector<Mat3x3> lastBodyOrient;
+    vector<int> lastVersion;
+    vector<ScreenRect> lastRect;
+
+    vector<ScreenRect> dirty;
+
+    //Statistics
+    long long shadedPixels = 0; //last frame
+    double shadedFraction = 0;  //last frame
+    long long frameNum = 0, totalShadedPixels = 0;
+
+    IncrementalRenderer() {}
+    IncrementalRenderer(const IncrementalRenderer&) = delete;
+    IncrementalRenderer& operator=(const IncrementalRenderer&) = delete;
+    ~IncrementalRenderer() {
+        delete staticFb;
+        delete fb;
+    }
+
+    //Conservative screen bounds of a body, the whole screen if any vertex is behind the near plane
+    ScreenRect bodyRect(const Camera& cam, const RigidBody& body) const {
+        Mat3x3 bodyToCam = cam.orientMat.T() * body.orientMat;
+        Vec3 bodyDispl = cam.orientMat.T() * (body.cmPos - cam.eye);
+
+        float minX(numeric_limits<float>::max()), minY(minX), maxX(-minX), maxY(-minX);
+        for (int p = 0; p != body.pieceNum(); p++) {
+            ShapePiece piece = body.shapePiece(p);
+            const vector<Polygon>& polys = *piece.polys;
+            Mat3x3 toCamMat = bodyToCam * piece.orient;
+            Vec3 displVec = bodyToCam * piece.pos + bodyDispl;
+            for (int i = 0; i != polys.size(); i++) {
+                const Vec3* verts[3] = { &polys[i].r1, &polys[i].r2, &polys[i].r3 };
+                for (int k = 0; k != 3; k++) {
+                    Vec3 r = toCamMat * *verts[k] + displVec;
+                    if (r.z < cam.planeDist) return fullScreen;
+                    float x = 0.5f * WIDTH + r.x * cam.planeDist / r.z * cam.scale;
+                    float y = 0.5f * HEIGHT + r.y * cam.planeDist / r.z * cam.scale;
+                    minX = min(minX, x); maxX = max(maxX, x);
+                    minY = min(minY, y); maxY = max(maxY, y);
+                }
+            }
+        }
+        ScreenRect rect(max(0, int(minX) - 1), max(0, int(minY) - 1), min(WIDTH, int(maxX) + 2), min(HEIGHT, int(maxY) + 2));
+        return rect.empty() ? ScreenRect() : rect;
+    }
+    void addDirty(ScreenRect rect) {
+        if (rect.empty()) return;
+        //Merge with anything it touches so no pixel is processed twice
+        for (int i = 0; i != dirty.size();) {
+            if (dirty[i].overlaps(rect)) {
+                rect.merge(dirty[i]);
+                dirty[i] = dirty.back();
+                dirty.pop_back();
+                i = 0;
+            }
+            else i++;
+        }
+        dirty.push_back(rect);
+    }
+    void restoreStatic(const ScreenRect& rect) {
+        for (int y = rect.y0; y != rect.y1; y++) {
+            int len = rect.x1 - rect.x0;
+            memcpy(&fb->zBuff[y][rect.x0], &staticFb->zBuff[y][rect.x0], len * sizeof(float));
+            copy(&staticFb->directionBuff[y][rect.x0], &staticFb->directionBuff[y][rect.x1], &fb->directionBuff[y][rect.x0]);
+            copy(&staticFb->normalBuff[y][rect.x0], &staticFb->normalBuff[y][rect.x1], &fb->normalBuff[y][rect.x0]);
+            memcpy(&fb->preLightBuff[y][rect.x0], &staticFb->preLightBuff[y][rect.x0], len * sizeof(fb->preLightBuff[y][0]));
+            memcpy(&fb->texBuff[y][rect.x0], &staticFb->texBuff[y][rect.x0], len * sizeof(TexSample));
+            if (fb->baked or staticFb->baked) memcpy(&fb->bakedBuff[y][rect.x0], &staticFb->bakedBuff[y][rect.x0], len * sizeof(float));
+        }
+        fb->textured = fb->textured or staticFb->textured;
+        fb->baked = fb->baked or staticFb->baked;
+    }
+
+    void render(Camera& cam, BodyPool& world, const vector<Polygon>& staticPolys, const vector<LightSource>& lights) {
+        FrameBuffer* camFb = cam.fb;
+        int capacity = world.capacity();
+        if (wasAlive.size() != capacity) {
+            wasAlive.assign(capacity, false);
+            lastPos.assign(capacity, Vec3());
+            lastBodyOrient.assign(capacity, IdMat);
+            lastVersion.assign(capacity, -1);
+            lastRect.assign(capacity, ScreenRect());
+            valid = false;
+        }
+
+        bool camMoved = !valid or !sameVec(cam.eye, lastEye) or !sameMat(cam.orientMat, lastOrient);
+        camMoved = camMoved or (cam.staticLighting and cam.staticLighting->version != lastBakeVersion); //rebaked maps redraw everything too
+        bool lightsMoved = lights.size() != lastLights.size();
+        for (int i = 0; !lightsMoved and i != lights.size(); i++) {
+            const LightSource& light = lights[i];
+            const LightSource& last = lastLights[i];
+            lightsMoved = !sameVec(light.r, last.r) or light.rad != last.rad or light.isStatic != last.isStatic;
+        }
+
+        ScreenRect* rects = frameArena.alloc<ScreenRect>(capacity);
+        for (int id = 0; id != capacity; id++) {
+            if (world.alive[id]) rects[id] = bodyRect(cam, world[id]);
+        }
+
+        dirty.clear();
+        if (camMoved) {
+            //Full redraw, refreshing the static cache for the new view
+            cam.fb = staticFb;
+            cam.beginFrame();
+            staticFb->clear();
+            for (int i = 0; i != staticPolys.size(); i++) cam.renderPolygon(staticPolys[i], cam.staticLighting ? cam.staticLighting->polyMap(i) : nullptr);
+            dirty.push_back(fullScreen);
+        }
+        else {
+            for (int id = 0; id != capacity; id++) {
+                bool alive = world.alive[id];
+                if (!alive and !wasAlive[id]) continue;
+                if (alive and wasAlive[id] and world[id].shapeVersion == lastVersion[id] and sameVec(world[id].cmPos, lastPos[id])
+                    and sameMat(world[id].orientMat, lastBodyOrient[id])) continue;
+                if (wasAlive[id]) addDirty(lastRect[id]);
+                if (alive) addDirty(rects[id]);
+            }
+        }
+
+        cam.fb = fb;
+        cam.beginFrame();
+        for (int r = 0; r != dirty.size(); r++) {
+            const ScreenRect& rect = dirty[r];
+            restoreStatic(rect);
+
+            cam.clipMinX = rect.x0; cam.clipMinY = rect.y0;
+            cam.clipMaxX = rect.x1; cam.clipMaxY = rect.y1;
+            for (int id = 0; id != capacity; id++) {
+                if (world.alive[id] and rects[id].overlaps(rect)) cam.renderShape(world[id], cam.staticLighting ? cam.staticLighting->bodyMap(id) : nullptr);
+            }
+        }
+        cam.clipMinX = 0; cam.clipMinY = 0;
+        cam.clipMaxX = WIDTH; cam.clipMaxY = HEIGHT;
+        cam.fb = camFb;
+
+        //Lighting: the dirty areas, or everything if a light moved
+        shadedPixels = 0;
+        if (lightsMoved) {
+            cam.shadeBuffer(*fb, lights, pixels.data(), WIDTH);
+            shadedPixels = fullScreen.area();
+        }
+        else {
+            for (int r = 0; r != dirty.size(); r++) {
+                const ScreenRect& rect = dirty[r];
+                cam.shadeRect(*fb, lights, pixels.data(), WIDTH, rect.x0, rect.y0, rect.x1, rect.y1);
+                shadedPixels += rect.area();
+            }
+        }
+        shadedFraction = double(shadedPixels) / fullScreen.area();
+        frameNum++;
+        totalShadedPixels += shadedPixels;
+
+        //Remember this frame
+        valid = true;
+        lastEye = cam.eye;
+        lastOrient = cam.orientMat;
+        if (cam.staticLighting) lastBakeVersion = cam.staticLighting->version;
+        lastLights.assign(lights.begin(), lights.end());
+        for (int id = 0; id != capacity; id++) {
+            wasAlive[id] = world.alive[id];
+            if (!wasAlive[id]) continue;
+            lastPos[id] = world[id].cmPos;
+            lastBodyOrient[id] = world[id].orientMat;
+            lastVersion[id] = world[id].shapeVersion;
+            lastRect[id] = rects[id];
+        }
+    }
+    void render(Camera& cam, BodyPool& world, const vector<Polygon>& staticPolys, const vector<LightSource>& lights, SDL_Texture* texture) {
+        render(cam, world, staticPolys, lights);
+        SDL_UpdateTexture(texture, NULL, pixels.data(), WIDTH * sizeof(Uint32));
+    }
+
+    //Correctness check: full redraw of the same frame into scratch, returns the number of differing pixels
+    int verify(Camera& cam, BodyPool& world, const vector<Polygon>& staticPolys, const vector<LightSource>& lights, FrameBuffer& scratch) {
+        FrameBuffer* camFb = cam.fb;
+        cam.fb = &scratch;
+        cam.clearBuffers();
+        cam.beginFrame();
+        for (int i = 0; i != staticPolys.size(); i++) cam.renderPolygon(staticPolys[i], cam.staticLighting ? cam.staticLighting->polyMap(i) : nullptr);
+        cam.renderWorld(world);
+
+        vector<Uint32> reference(WIDTH * HEIGHT);
+        cam.shadeBuffer(lights, reference.data(), WIDTH);
+        cam.fb = camFb;
+
+        int differ = 0;
+        for (int i = 0; i != WIDTH * HEIGHT; i++) differ += reference[i] != pixels[i];
+        return differ;
+    }
+};
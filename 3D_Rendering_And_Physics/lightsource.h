@@ -6,6 +6,7 @@
 struct LightSource {
     Vec3 r;
     float rad;
+    bool isStatic = false; //never moves, its diffuse light on static geometry is baked
 
     LightSource(float x, float y, float z, float rad) : r(Vec3(x, y, z)), rad(rad) {}
 
@@ -1,5 +1,6 @@
 #include <SDL.h>
 #include <stdio.h>
+#include <string.h>
 #include <iostream>
 #include <math.h>
 #include <chrono>
@@ -11,6 +12,18 @@
 #include "polygon.h"
 #include "rigidbody.h"
 #include "camera.h"
+#include "pipeline.h"
+#include "physics.h"
+#include "raytracer.h"
+#include "incremental.h"
+#include "texture.h"
+#include "snapshot.h"
+#include "scenequery.h"
+#include "multiview.h"
+#include "particles.h"
+#include "staticlight.h"
+#include "streaming.h"
+#include "benchmark.h"
 
 using namespace std;
 
@@ -21,19 +34,66 @@ long long start, tickTime;
 SDL_Event event;
 int tickCnt = 0;
 bool quit = false;
+bool rayTraceMode = false;
+bool incrementalMode = false;
 auto t1 = chrono::system_clock::now().time_since_epoch();
 auto t2 = chrono::system_clock::now().time_since_epoch();
 
 
 //Main
 int main(int argc, char* args[]) {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    if (argc > 1 and string(args[1]) == "--bench") {
+        return runBenchmarks();
+    }
+
+    //Command line: --stream <file | - | "|command"> [--format rgb|y4m] [--headless] [--frames N] [--load <snapshot>] [--save <snapshot>]
+    //[--world <prefix>] [--make-world <prefix>]
+    string streamTarget, loadPath, savePath, worldPath, makeWorldPath;
+    SinkFormat streamFormat = SINK_Y4M;
+    bool headless = false;
+    long long frameLimit = -1;
+    for (int i = 1; i < argc; i++) {
+        string arg = args[i];
+        if (arg == "--stream" and i + 1 < argc) streamTarget = args[++i];
+        else if (arg == "--format" and i + 1 < argc) streamFormat = string(args[++i]) == "rgb" ? SINK_RGB : SINK_Y4M;
+        else if (arg == "--headless") headless = true;
+        else if (arg == "--frames" and i + 1 < argc) frameLimit = atoll(args[++i]);
+        else if (arg == "--load" and i + 1 < argc) loadPath = args[++i];
+        else if (arg == "--save" and i + 1 < argc) savePath = args[++i];
+        else if (arg == "--world" and i + 1 < argc) worldPath = args[++i];
+        else if (arg == "--make-world" and i + 1 < argc) makeWorldPath = args[++i];
+    }
+    if (!makeWorldPath.empty()) { //writes a chunked demo world to stream with --world, then exits
+        BodyPool source(STREAM_DEMO_SIDE * STREAM_DEMO_SIDE * STREAM_DEMO_BODIES);
+        buildStreamWorld(source, STREAM_DEMO_SIDE, STREAM_DEMO_BODIES);
+        if (!saveWorldChunks(makeWorldPath, source, STREAM_CHUNK_SIZE)) {
+            printf("Could not write world %s\n", makeWorldPath.c_str());
+            return -1;
+        }
+        return 0;
+    }
+    FrameSink* sink = nullptr;
+    if (!streamTarget.empty()) {
+        sink = FrameSink::open(streamTarget, streamFormat);
+        if (!sink) {
+            printf("Could not open stream output %s\n", streamTarget.c_str());
+            return -1;
+        }
+    }
+    ostream& statsOut = streamTarget == "-" ? cerr : cout; //keep stdout clean when the stream goes there
+
+    if (SDL_Init(headless ? 0 : SDL_INIT_VIDEO) < 0) {
         printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
         return -1;
     }
-    SDL_Window* window = SDL_CreateWindow("SDL Tutorial", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
-    SDL_Renderer* rend = SDL_CreateRenderer(window, 0, SDL_RENDERER_ACCELERATED);
-    SDL_Texture* texture = SDL_CreateTexture(rend, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, WINDOW_WIDTH, WINDOW_HEIGHT);
+    SDL_Window* window = nullptr;
+    SDL_Renderer* rend = nullptr;
+    SDL_Texture* texture = nullptr;
+    if (!headless) {
+        window = SDL_CreateWindow("SDL Tutorial", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
+        rend = SDL_CreateRenderer(window, 0, SDL_RENDERER_ACCELERATED);
+        texture = SDL_CreateTexture(rend, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, WINDOW_WIDTH, WINDOW_HEIGHT);
+    }
 
 
     //Creating camera
@@ -42,28 +102,62 @@ int main(int argc, char* args[]) {
 
 
     //Creating objects
-    RigidBody icosahedron = createIcosahedron(1e-4, 20.f);
-    icosahedron.bodyMove(Vec3(125, 0, 0));
-
+    //The hammer is a compound of three shared meshes, none of their polygons copied
     RigidBody hammerHead = createCuboid(1e-4, 50, 100, 50);
     hammerHead.colorPoly(4, 255, 0, 0); hammerHead.colorPoly(5, 255, 0, 0);
     hammerHead.colorPoly(6, 0, 0, 255); hammerHead.colorPoly(7, 0, 0, 255);
     RigidBody hammerHandle = createCuboid(1e-4, 100, 10, 10);
-    hammerHandle.bodyMove(Vec3(75, 0, 0));
-    RigidBody hammer = glueTogether(hammerHead, hammerHandle);
-    hammer = glueTogether(hammer, icosahedron);
+    int handleTex = textureRegistry.add(256, checkerPixels(256, 8, 0xffffff, 0x806040));
+    boxMapUVs(hammerHandle.polys, 20.f, handleTex);
+
+    RigidBody hammer;
+    hammer.attachChild(meshRegistry.add(hammerHead.polys), 1e-4, Vec3());
+    hammer.attachChild(meshRegistry.add(hammerHandle.polys), 1e-4, Vec3(75, 0, 0));
+    hammer.attachChild(meshRegistry.add(icosahedronPolys(20.f)), 1e-4, Vec3(125, 0, 0));
     hammer.bodyMove(-hammer.cmPos);
 
     hammer.angMom = Vec3(0, 15000, 0.01);
 
+    BodyPool world(MAX_BODIES);
+    world.create(hammer);
+    PhysicsWorld physics(world);
+    SceneQuery sceneQuery(world);
+
     vector<LightSource> lights;
     LightSource light1(0, 0, 300, 40000);
+    light1.isStatic = true;
     lights.push_back(light1);
 
+    //The saved world replaces the one built above, restored exactly as it was when saved
+    if (!loadPath.empty() and !loadSnapshot(loadPath, physics, lights, cam)) {
+        printf("Could not load snapshot %s\n", loadPath.c_str());
+        return -1;
+    }
+
+    //Chunks of a streamed world join the pool around the eye as it moves, loaded in the background
+    ChunkStreamer streamer(world);
+    if (!worldPath.empty() and !streamer.open(worldPath)) {
+        printf("Could not open world %s\n", worldPath.c_str());
+        return -1;
+    }
+
+    vector<Polygon> axes = { polyOX, polyOY, polyOZ };
+    StaticLighting staticLighting; //the axes and static lights never move, their diffuse light is baked
+    staticLighting.update(world, axes, lights);
+    cam.staticLighting = &staticLighting;
+    FramePipeline pipeline(cam, world, axes, lights);
+    pipeline.sink = sink;
+    ParticleSystem particles(PARTICLE_CAPACITY);
+    pipeline.particles = &particles;
+    RayTracer tracer;
+    IncrementalRenderer incremental;
 
     //Main loop
     while (not quit) {
         start = chrono::system_clock::now().time_since_epoch() / chrono::milliseconds(1);
+        frameArena.reset();
+        long long frameAllocs = allocCount;
+        long long frameTexels = texelsFetched;
         while (SDL_PollEvent(&event)) {
 
             switch (event.type) {
@@ -75,6 +169,17 @@ int main(int argc, char* args[]) {
                 break;
 
             case SDL_MOUSEBUTTONDOWN:
+                if (event.button.button == SDL_BUTTON_RIGHT) { //picking: the body under the cursor
+                    float px = (event.button.x * float(WIDTH) / WINDOW_WIDTH - 0.5f * WIDTH) * cam.pixelSize;
+                    float py = (event.button.y * float(HEIGHT) / WINDOW_HEIGHT - 0.5f * HEIGHT) * cam.pixelSize;
+                    RayQuery pick;
+                    pick.orig = cam.eye;
+                    pick.dir = cam.orientMat * Vec3(px, py, cam.planeDist);
+                    sceneQuery.update();
+                    RayHit hit = sceneQuery.raycast(pick);
+                    if (hit.body >= 0) statsOut << "picked body " << hit.body << " polygon " << hit.poly << " at " << hit.point.x << " " << hit.point.y << " " << hit.point.z << "\n";
+                    break;
+                }
                 mouseButton = true;
                 break;
 
@@ -110,6 +215,18 @@ int main(int argc, char* args[]) {
                 case SDLK_e:
                     eKey = true;
                     break;
+                case SDLK_r:
+                    rayTraceMode = !rayTraceMode;
+                    break;
+                case SDLK_i:
+                    incrementalMode = !incrementalMode;
+                    break;
+                case SDLK_g:
+                    cam.gloss = !cam.gloss;
+                    break;
+                case SDLK_F5:
+                    if (!savePath.empty() and !saveSnapshot(savePath, physics, lights, cam)) printf("Could not save snapshot %s\n", savePath.c_str());
+                    break;
                 default:
                     break;
                 }
@@ -158,30 +275,60 @@ int main(int argc, char* args[]) {
         }
 
         //Drawing
-        t1 = chrono::system_clock::now().time_since_epoch();
-        //cam.renderShape(icosahedron);
-        cam.renderPolygon(polyOX);
-        cam.renderPolygon(polyOY);
-        cam.renderPolygon(polyOZ);
-        cam.renderShape(hammer);
-        cam.applyLight(lights, texture);
-        t2 = chrono::system_clock::now().time_since_epoch();
-        cout << (t2 - t1) / chrono::milliseconds(1) << "    ";
-
-
-        t1 = chrono::system_clock::now().time_since_epoch();
-        cam.draw(texture);
-        SDL_RenderPresent(rend);
-        t2 = chrono::system_clock::now().time_since_epoch();
-        cout << (t2 - t1) / chrono::milliseconds(1) << "\n";
+        //The raster worker renders this tick's world while the previous frame is lit and presented
+        //The other modes stream too: the ray tracer traces straight into a ring slot, the incremental frame is copied in
+        if (rayTraceMode) {
+            pipeline.finish();
+            tracer.update(world, axes);
+            Uint32* slot = sink ? sink->acquire() : nullptr;
+            if (slot) {
+                tracer.render(cam, lights, slot, WIDTH);
+                if (texture) SDL_UpdateTexture(texture, NULL, slot, WIDTH * sizeof(Uint32));
+                sink->commit();
+            }
+            else if (texture) tracer.render(cam, lights, texture);
+            if (texture) {
+                SDL_RenderCopy(rend, texture, NULL, NULL);
+                SDL_RenderPresent(rend);
+            }
+        }
+        else if (incrementalMode) {
+            pipeline.finish();
+            incremental.render(cam, world, axes, lights);
+            Uint32* slot = sink ? sink->acquire() : nullptr;
+            if (slot) {
+                memcpy(slot, incremental.pixels.data(), WIDTH * HEIGHT * sizeof(Uint32));
+                sink->commit();
+            }
+            if (texture) {
+                SDL_UpdateTexture(texture, NULL, incremental.pixels.data(), WIDTH * sizeof(Uint32));
+                SDL_RenderCopy(rend, texture, NULL, NULL);
+                SDL_RenderPresent(rend);
+            }
+            statsOut << "re-shaded: " << 100 * incremental.shadedFraction << " %    ";
+        }
+        else pipeline.step(texture);
+        statsOut << "latency: " << pipeline.latencyMs << " ms    frame: " << pipeline.frameMs << " ms    ";
 
         //Camera movement
         cam.readKeyInput();
 
         //Objects movement
-        for (int i = 0; i != 50; i++) {
-            hammer.integrator(TIMESTEP);
+        for (int i = 0; i != SUBSTEPS; i++) {
+            physics.step(TIMESTEP);
+            for (int c = 0; c != physics.impacts.size(); c++) particles.emitImpact(world, physics.impacts[c]);
+            particles.update(TIMESTEP);
         }
+        if (!worldPath.empty()) streamer.update(cam.eye);
+        staticLighting.update(world, axes, lights);
+        statsOut << "bodies: " << physics.activeNum << " active, " << physics.sleepingNum << " sleeping, " << physics.ccdNum << " ccd    ";
+        statsOut << "particles: " << particles.count << ", " << particles.stats.updateMs << " ms update, " << particles.stats.rasterMs << " ms raster    ";
+        if (!worldPath.empty()) statsOut << "world: " << streamer.stats.residentChunks << " chunks, " << streamer.stats.pendingChunks << " pending, " <<
+            streamer.stats.residentBytes / 1048576. << " MB, " << streamer.stats.stallMs << " ms stall, " << streamer.stats.latencyMs << " ms load    ";
+        if (sink) statsOut << "stream: " << sink->framesWritten << " written, " << sink->framesDropped << " dropped, " << sink->megabytesPerSecond() << " MB/s" <<
+            (sink->failed ? ", closed after a write error    " : "    ");
+        statsOut << "texels: " << texelsFetched - frameTexels << "    allocs: " << allocCount - frameAllocs << "\n";
+        if (frameLimit >= 0 and ++tickCnt >= frameLimit) quit = true;
 
         //Sleep if neccessary
         tickTime = chrono::system_clock::now().time_since_epoch() / chrono::milliseconds(1) - start;
@@ -191,6 +338,9 @@ int main(int argc, char* args[]) {
     }
 
 
+    pipeline.finish();
+    if (!savePath.empty() and !saveSnapshot(savePath, physics, lights, cam)) printf("Could not save snapshot %s\n", savePath.c_str());
+    delete sink;
     SDL_DestroyWindow(window);
     SDL_DestroyRenderer(rend);
     SDL_Quit();
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include "mylinal.h"
+#include "polygon.h"
+
+//Mesh
+//Immutable polygon data shared by any number of bodies. Polygons are stored relative to the
+//mesh's centre of mass and the mass properties are cached for unit density, so creating an
+//instance needs no per-polygon work.
+struct Mesh {
+    vector<Polygon> polys;
+    float volume = 0.f;
+    Vec3 cm = Vec3();                      //centre of mass of the source polygons before recentring
+    Mat3x3 unitInertiaTensor = Mat3x3();   //about the centre of mass, for density 1
+};
+
+//Mesh registry
+struct MeshRegistry {
+    vector<Mesh> meshes;
+
+    //Returns the handle of the new mesh, -1 if the polygons enclose no volume (flat, empty or inside out), which
+    //would leave the centre of mass and inertia undefined
+    int add(const vector<Polygon>& polys) {
+        Mesh mesh;
+        Mat3x3 inertTen = Mat3x3();
+
+        for (int i = 0; i != polys.size(); i++) {
+            float vol = findSignedTetraVolume(polys[i]);
+
+            mesh.volume += vol;
+            mesh.cm += vol * findTetraCM(polys[i]);
+            inertTen += findSignedTetraInertTen(polys[i]);
+        }
+        if (!(mesh.volume > 0.f)) return -1;
+        mesh.cm = mesh.cm / mesh.volume;
+        mesh.unitInertiaTensor = TensorFromAnyToCM(inertTen, mesh.cm, mesh.volume);
+
+        mesh.polys.reserve(polys.size());
+        for (int i = 0; i != polys.size(); i++) {
+            mesh.polys.push_back(polys[i] + (-mesh.cm));
+        }
+
+        meshes.push_back(move(mesh));
+        return meshes.size() - 1;
+    }
+    const Mesh& operator[](int id) const {
+        return meshes[id];
+    }
+    int size() const {
+        return meshes.size();
+    }
+};
+MeshRegistry meshRegistry;
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "mesh.h"
+#include "rigidbody.h"
+#include "camera.h"
+
+//Multi-view rendering
+//Several cameras looking at one world in the same tick (split-screen, minimap, cube faces). The bodies' polygons
+//are placed in world CS once per frame, then every view culls bodies by their bounding spheres and rasterizes
+//the rest into its own frame buffer, the views in parallel. Each camera must own its frame buffer.
+
+struct ViewStats {
+    int bodiesDrawn = 0, bodiesCulled = 0;
+    long long polysDrawn = 0;
+    double rasterMs = 0;
+};
+
+struct PlacedPoly {
+    const Polygon* src; //body-space original, kept for texture coordinates
+    int r, g, b;
+};
+
+struct MultiViewRenderer {
+    //Shared geometry of the frame, bodies in the order renderWorld draws them
+    vector<int> order, meshStart, meshFill;
+    vector<int> bodyFirst;     //first placed polygon of each body, one past the last at the end
+    vector<Vec3> centres;      //bounding spheres in world CS
+    vector<float> radii;
+    vector<Vec3> verts;        //world CS, three per placed polygon
+    vector<PlacedPoly> polys;
+
+    vector<ViewStats> stats;   //of the last render, one per view
+    double geometryMs = 0;
+
+    //Places every alive body's polygons in world CS. Bodies owning their polygons come first, then instances
+    //grouped by mesh, as in Camera::renderWorld. Capacities are kept, so a steady scene doesn't touch the heap
+    void placeGeometry(BodyPool& world, int threadNum = 0) {
+        int meshNum = meshRegistry.size();
+        meshStart.assign(meshNum + 1, 0);
+        meshFill.assign(meshNum, 0);
+        order.clear();
+        for (int i = 0; i != world.capacity(); i++) {
+            if (!world.alive[i]) continue;
+            if (world[i].meshId < 0) order.push_back(i);
+            else meshStart[world[i].meshId + 1]++;
+        }
+        for (int m = 0; m != meshNum; m++) meshStart[m + 1] += meshStart[m];
+        int ownedNum = order.size();
+        order.resize(ownedNum + meshStart[meshNum]);
+        for (int i = 0; i != world.capacity(); i++) {
+            if (!world.alive[i] or world[i].meshId < 0) continue;
+            int m = world[i].meshId;
+            order[ownedNum + meshStart[m] + meshFill[m]++] = i;
+        }
+
+        //Offsets and bounding spheres serially, boundingRadius caches on first use
+        int bodyNum = order.size();
+        bodyFirst.resize(bodyNum + 1);
+        centres.resize(bodyNum);
+        radii.resize(bodyNum);
+        bodyFirst[0] = 0;
+        for (int b = 0; b != bodyNum; b++) {
+            RigidBody& body = world[order[b]];
+            int polyNum = 0;
+            for (int k = 0; k != body.pieceNum(); k++) polyNum += body.shapePiece(k).polys->size();
+            bodyFirst[b + 1] = bodyFirst[b] + polyNum;
+            centres[b] = body.cmPos;
+            radii[b] = body.boundingRadius();
+        }
+        verts.resize(3 * bodyFirst[bodyNum]);
+        polys.resize(bodyFirst[bodyNum]);
+
+        //The transform itself in blocks of bodies
+        int blockNum = (bodyNum + MULTIVIEW_BODY_BLOCK - 1) / MULTIVIEW_BODY_BLOCK;
+        atomic<int> nextBlock(0);
+        auto worker = [&]() {
+            for (int block = nextBlock++; block < blockNum; block = nextBlock++) {
+                int last = min(bodyNum, (block + 1) * MULTIVIEW_BODY_BLOCK);
+                for (int b = block * MULTIVIEW_BODY_BLOCK; b != last; b++) placeBody(world[order[b]], bodyFirst[b]);
+            }
+        };
+        if (threadNum <= 0) threadNum = max(1u, thread::hardware_concurrency());
+        threadNum = min(threadNum, blockNum);
+        vector<thread> threads;
+        for (int i = 1; i < threadNum; i++) threads.push_back(thread(worker));
+        worker();
+        for (int i = 0; i != threads.size(); i++) threads[i].join();
+    }
+    void placeBody(const RigidBody& body, int first) {
+        for (int k = 0; k != body.pieceNum(); k++) {
+            ShapePiece piece = body.shapePiece(k);
+            const vector<Polygon>& shape = *piece.polys;
+            Mat3x3 toWorldMat = body.orientMat * piece.orient;
+            Vec3 displVec = body.orientMat * piece.pos + body.cmPos;
+            for (int i = 0; i != shape.size(); i++, first++) {
+                const Polygon& poly = shape[i];
+                verts[3 * first] = toWorldMat * poly.r1 + displVec;
+                verts[3 * first + 1] = toWorldMat * poly.r2 + displVec;
+                verts[3 * first + 2] = toWorldMat * poly.r3 + displVec;
+                if (piece.colorOverride) polys[first] = { &poly, piece.r, piece.g, piece.b };
+                else polys[first] = { &poly, poly.r, poly.g, poly.b };
+            }
+        }
+    }
+
+    //Rasterizes the placed geometry into one view, bodies whose sphere is behind the near plane or outside one of
+    //the four side planes of the frustum are skipped
+    void renderView(Camera& cam, ViewStats& stat) {
+        auto t1 = chrono::steady_clock::now();
+        cam.beginFrame();
+        Mat3x3 toCamMat = cam.orientMat.T();
+        float halfW = 0.5f * cam.width, halfH = 0.5f * cam.height;
+        float sideW = sqrtf(cam.planeDist * cam.planeDist + halfW * halfW), sideH = sqrtf(cam.planeDist * cam.planeDist + halfH * halfH);
+
+        stat = ViewStats();
+        int bodyNum = centres.size();
+        for (int b = 0; b != bodyNum; b++) {
+            Vec3 c = toCamMat * (centres[b] - cam.eye);
+            float r = radii[b];
+            if (c.z + r < cam.planeDist or
+                cam.planeDist * c.x - halfW * c.z > r * sideW or -cam.planeDist * c.x - halfW * c.z > r * sideW or
+                cam.planeDist * c.y - halfH * c.z > r * sideH or -cam.planeDist * c.y - halfH * c.z > r * sideH) {
+                stat.bodiesCulled++;
+                continue;
+            }
+            stat.bodiesDrawn++;
+            stat.polysDrawn += bodyFirst[b + 1] - bodyFirst[b];
+            for (int i = bodyFirst[b]; i != bodyFirst[b + 1]; i++) {
+                const PlacedPoly& poly = polys[i];
+                cam.renderCameraPolygon(toCamMat * (verts[3 * i] - cam.eye), toCamMat * (verts[3 * i + 1] - cam.eye),
+                    toCamMat * (verts[3 * i + 2] - cam.eye), poly.r, poly.g, poly.b, poly.src);
+            }
+        }
+        stat.rasterMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+    }
+
+    //Renders the world into every view; targets are not cleared, as with renderWorld
+    void render(Camera* const* views, int viewNum, BodyPool& world, int threadNum = 0) {
+        auto t1 = chrono::steady_clock::now();
+        placeGeometry(world, threadNum);
+        geometryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+
+        stats.resize(viewNum);
+        atomic<int> nextView(0);
+        auto worker = [&]() {
+            for (int v = nextView++; v < viewNum; v = nextView++) renderView(*views[v], stats[v]);
+        };
+        if (threadNum <= 0) threadNum = max(1u, thread::hardware_concurrency());
+        threadNum = min(threadNum, viewNum);
+        vector<thread> threads;
+        for (int i = 1; i < threadNum; i++) threads.push_back(thread(worker));
+        worker();
+        for (int i = 0; i != threads.size(); i++) threads[i].join();
+    }
+};
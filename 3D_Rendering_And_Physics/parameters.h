@@ -5,11 +5,89 @@ const int   WIDTH = 1000;
 const int   HEIGHT = 800;
 const int   WINDOW_WIDTH = WIDTH;
 const int   WINDOW_HEIGHT = HEIGHT;
-const float TIMESTEP = 0.01f;
+const float TIMESTEP = 0.05f;
+const int   SUBSTEPS = 10;                  //physics steps per frame
 const float FOV = 90.f;
 const float CAM_INIT_X = 0.f;
 const float CAM_INIT_Y = -400.f;
 const float CAM_INIT_Z = 0.f;
 const float CAM_LIN_SPEED = 6.f;
 const float CAM_ROT_SPEED = 0.002f;
-const float GLOSS_FACTOR = 200;
\ No newline at end of file
+const float GLOSS_FACTOR = 200;
+const int   BENCH_REPS = 5;
+const int   BENCH_SIZES[] = { 64, 4096, 262144 };
+const int   BENCH_SIZES_NUM = sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]);
+const int   BENCH_LIGHT_COUNTS[] = { 1, 2, 4, 8 };
+const int   BENCH_LIGHT_COUNTS_NUM = sizeof(BENCH_LIGHT_COUNTS) / sizeof(BENCH_LIGHT_COUNTS[0]);
+const int   FRAME_ARENA_BYTES = 1 << 20;
+const int   MAX_BODIES = 1024;
+const int   FRAME_BUFFER_NUM = 2;
+const int   RASTER_ROW_BLOCK = 32;         //screen columns between exact restarts of the edge and depth steps
+const int   RT_TILE_SIZE = 16;
+const int   RT_LEAF_SIZE = 4;
+const int   RT_SAH_BINS = 12;
+const int   RT_MAX_LIGHTS = 16;            //lights past these are left out of ray-traced frames
+const int   RT_MAX_DEPTH = 63;             //BVH levels below the root, nodes there stay leaves
+const float RT_EPSILON = 1e-4f;            //ray parameter below which hits are ignored
+const float RT_OFFSET = 1e-2f;             //secondary rays start this far off the surface
+const float RT_REBUILD_AREA_RATIO = 2.f;   //rebuild the BVH once refitting grew the root this much
+const float RT_REFLECTIVITY = 0.2f;
+const int   FRAME_SINK_RING = 4;
+const int   SHADE_FIXED_LIGHTS = 1;        //light counts up to this get their own unrolled shading kernel, more did not pay
+const int   BENCH_TEXTURE_SIZE = 2048;     //larger than the caches, so the texel layout shows
+const float SLEEP_LINEAR_ENERGY = 0.5f;    //kinetic energy per unit mass below which a body counts as resting
+const float SLEEP_ANGULAR_ENERGY = 0.5f;
+const float SLEEP_TIME = 0.5f;             //seconds an island must rest before it is put to sleep
+const float CONTACT_TOLERANCE = 0.1f;      //bodies closer than this are in contact
+const int   CCD_MAX_ITERATIONS = 32;
+const float CCD_MOTION_RATIO = 0.25f;      //bodies moving more than this part of their bounding radius per step use continuous detection
+const float RESTITUTION = 0.5f;
+const int   MAX_PAIR_CONTACTS = 2;         //contacts a pair of bodies takes per step, further ones wait for the next step
+const float BENCH_CCD_TIME = 0.25f;        //simulated seconds per run of the continuous collision benchmark
+const int   SNAPSHOT_VERSION = 3;          //bump whenever a snapshot record changes
+const int   SNAPSHOT_ALIGN = 64;           //section alignment in snapshot files
+const int   SNAPSHOT_BODY_BLOCK = 64;      //bodies per save or restore job
+const int   BENCH_SNAPSHOT_STEPS = 40;     //steps simulated before and after the snapshot in the benchmark
+const int   SCENE_LEAF_SIZE = 4;           //triangles per leaf of a shape hierarchy
+const float SCENE_TREE_MARGIN = 2.f;       //body boxes in the query tree are enlarged by this
+const float SCENE_TREE_PREDICT = 0.5f;     //and by this many seconds of their motion
+const int   SCENE_MAX_OVERLAPS = 16;       //bodies listed per sphere overlap, more are only counted
+const int   SCENE_QUERY_CHUNK = 64;        //queries per job of a batch
+const int   SCENE_STACK_SIZE = 64;         //tree walk entries kept on the stack, taller trees spill to the heap
+const int   BENCH_SCENE_SIZES[] = { 64, 1024, 8192 };
+const int   BENCH_SCENE_SIZES_NUM = sizeof(BENCH_SCENE_SIZES) / sizeof(BENCH_SCENE_SIZES[0]);
+const int   BENCH_SCENE_QUERIES = 4096;
+const int   MULTIVIEW_BODY_BLOCK = 64;     //bodies per job of the multi-view geometry pass
+const int   BENCH_MULTIVIEW_BODIES = 3000;
+const int   PARTICLE_CAPACITY = 262144;
+const int   PARTICLE_CHUNK = 4096;         //particles per update job, a multiple of 8
+const int   PARTICLE_THREAD_MIN = 65536;   //particles per update thread, fewer are updated inline
+const int   PARTICLE_PROBE_INTERVAL = 64;  //updates between timings of the slower update path
+const float PARTICLE_GRAVITY = 400.f;
+const float PARTICLE_DRAG = 0.5f;          //per second
+const float PARTICLE_GROUND_Z = -200.f;
+const float PARTICLE_RESTITUTION = 0.4f;
+const float PARTICLE_GROUND_FRICTION = 0.8f;
+const float PARTICLE_SIZE = 1.5f;          //world-space half-width of a sprite
+const float PARTICLE_LIFETIME = 2.f;       //seconds, varied by a quarter either way
+const float PARTICLE_SURFACE_OFFSET = 0.5f;
+const int   PARTICLE_EMIT_ATTEMPTS = 8;    //surface samples tried per particle before giving it up
+const float PARTICLE_IMPACT_MIN_SPEED = 5.f;     //closing speeds below this throw no debris
+const float PARTICLE_IMPACT_PER_SPEED = 2.f;     //particles per unit of closing speed
+const int   PARTICLE_IMPACT_MAX = 512;
+const float PARTICLE_IMPACT_SPEED_RATIO = 0.5f;  //debris speed to closing speed
+const float PARTICLE_IMPACT_RADIUS = 20.f;       //debris comes off surfaces this close to the contact point
+const int   BENCH_PARTICLE_COUNTS[] = { 16384, 131072, 262144 };
+const int   BENCH_PARTICLE_COUNTS_NUM = sizeof(BENCH_PARTICLE_COUNTS) / sizeof(BENCH_PARTICLE_COUNTS[0]);
+const int   BAKE_MAP_SIZE = 16;            //light map samples along each edge of a static polygon
+const int   BAKE_MAP_FLOATS = 2 * BAKE_MAP_SIZE * BAKE_MAP_SIZE; //both sides
+const int   BENCH_STATIC_LIGHTS = 4;
+const float STREAM_CHUNK_SIZE = 1000.f;    //edge of the cubic chunks a streamed world is cut into
+const float STREAM_LOAD_RADIUS = 2500.f;   //chunks this close to the eye are loaded
+const float STREAM_EVICT_RADIUS = 3500.f;  //and this far evicted, farther than the load radius so chunks at the edge don't thrash
+const long long STREAM_MEMORY_BUDGET = 64ll << 20; //bytes resident and pending chunks may take
+const int   STREAM_INTEGRATE_PER_FRAME = 4;        //finished chunks added to the world per frame
+const int   STREAM_DEMO_SIDE = 24;         //chunks along each edge of the world --make-world writes
+const int   STREAM_DEMO_BODIES = 8;        //bodies per chunk of it
+const int   BENCH_STREAM_FRAMES = 400;
+const float BENCH_STREAM_SPEED = 60.f;     //eye travel per frame
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <immintrin.h>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "rigidbody.h"
+#include "collision.h"
+#include "camera.h"
+#include "worker.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//AVX2 kernels are compiled for AVX2 on their own and only called when the CPU has it, the rest of the program
+//keeps the default target. MSVC emits AVX2 intrinsics under any /arch
+#ifdef _MSC_VER
+#define TARGET_AVX2
+inline bool cpuHasAvx2() {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) or (_xgetbv(0) & 6) != 6) return false; //the OS must save the YMM registers
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+inline bool cpuHasAvx2() {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+//Particles
+//Debris, sparks and dust: points with a velocity, a lifetime, a size and a colour, stored as structure of arrays
+//so the update runs eight particles per instruction on CPUs with AVX2 (scalar otherwise), in parallel chunks. Particles
+//fall under gravity, slow down by drag and bounce off a ground plane z = groundZ. They are rasterized as square
+//sprites facing the camera, depth-tested against the frame buffer and written to it like polygon pixels, so the
+//lighting pass lights them with everything else. Live particles are kept packed at the front of the arrays.
+
+struct ParticleStats {
+    int spawned = 0, expired = 0; //by the last update and the spawns before it
+    double updateMs = 0, rasterMs = 0;
+    long long pixelsWritten = 0;
+};
+
+struct ParticleSystem {
+    int capacity, count = 0;
+    float* block;                          //one aligned allocation holding all streams, each padded to whole vectors
+    float *posX, *posY, *posZ, *velX, *velY, *velZ;
+    float *life, *size;                    //seconds left, world-space half-width of the sprite
+    Uint32* color;
+
+    Vec3 gravity = Vec3(0, 0, -PARTICLE_GRAVITY);
+    float drag = PARTICLE_DRAG;            //per second, velocity shrinks by drag * dt each step
+    float groundZ = PARTICLE_GROUND_Z;
+    float restitution = PARTICLE_RESTITUTION;
+    float friction = PARTICLE_GROUND_FRICTION; //share of the ground-parallel velocity kept by a bounce
+    unsigned seed = 2463534242u;           //xorshift state of the emitters
+    int spawnedSinceUpdate = 0;
+
+    mutable ParticleStats stats;
+    WorkerPool pool;                       //update threads, kept between steps
+    bool simd = cpuHasAvx2();              //updateSimd, else updateScalar
+
+    //Measured update cost per particle inline and on the pool, threads are used only while they are the faster
+    double inlineNs = 0, threadedNs = 0;
+    int updatesSinceProbe = 0;
+
+    explicit ParticleSystem(int capacity) : capacity(capacity) {
+        int stride = (capacity + 7) / 8 * 8;
+        block = static_cast<float*>(_mm_malloc(9 * stride * sizeof(float), 32));
+        memset(block, 0, 9 * stride * sizeof(float));
+        posX = block; posY = posX + stride; posZ = posY + stride;
+        velX = posZ + stride; velY = velX + stride; velZ = velY + stride;
+        life = velZ + stride; size = life + stride;
+        color = reinterpret_cast<Uint32*>(size + stride);
+    }
+    ParticleSystem(const ParticleSystem&) = delete;
+    ParticleSystem& operator=(const ParticleSystem&) = delete;
+    ~ParticleSystem() {
+        _mm_free(block);
+    }
+
+    //Spawning, fails when full
+    bool spawn(const Vec3& pos, const Vec3& vel, float lifetime, float halfSize, Uint32 hex) {
+        if (count == capacity) return false;
+        posX[count] = pos.x; posY[count] = pos.y; posZ[count] = pos.z;
+        velX[count] = vel.x; velY[count] = vel.y; velZ[count] = vel.z;
+        life[count] = lifetime;
+        size[count] = halfSize;
+        color[count] = hex;
+        count++;
+        spawnedSinceUpdate++;
+        return true;
+    }
+    float random() { //in [-1, 1)
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return (seed & 0xffffff) / float(0x800000) - 1.f;
+    }
+
+    //Spawns n particles on the body's surface, thrown off along the outward normal at about speed on top of the
+    //surface point's own velocity and coloured like the polygon they came from. With near set only surface points
+    //within nearRadius of it are taken, giving up on a particle after a few tries
+    int emitFromBody(const RigidBody& body, int n, float speed, float lifetime, const Vec3* near = nullptr, float nearRadius = 0) {
+        int pieceNum = body.pieceNum(), emitted = 0;
+        for (int i = 0; i != n; i++) {
+            for (int attempt = 0; attempt != PARTICLE_EMIT_ATTEMPTS; attempt++) {
+                ShapePiece piece = body.shapePiece(min(pieceNum - 1, int((random() + 1.f) * 0.5f * pieceNum)));
+                const vector<Polygon>& shape = *piece.polys;
+                if (shape.empty()) continue;
+                const Polygon& poly = shape[min(int(shape.size()) - 1, int((random() + 1.f) * 0.5f * shape.size()))];
+
+                //Uniform point of the triangle, folded back when outside
+                float a = 0.5f * (random() + 1.f), b = 0.5f * (random() + 1.f);
+                if (a + b > 1.f) { a = 1.f - a; b = 1.f - b; }
+                Mat3x3 toWorldMat = body.orientMat * piece.orient;
+                Vec3 r1 = toWorldMat * poly.r1, r2 = toWorldMat * poly.r2, r3 = toWorldMat * poly.r3;
+                Vec3 arm = r1 + (r2 - r1) * a + (r3 - r1) * b + body.orientMat * piece.pos; //from cmPos
+                Vec3 point = arm + body.cmPos;
+                if (near and modSqr(point - *near) > nearRadius * nearRadius) continue;
+
+                Vec3 normal = normalize(crossProd(r2 - r1, r3 - r1));
+                if (dotProd(normal, arm) < 0.f) normal = -1.f * normal;
+                Vec3 jitter(random(), random(), random());
+                Vec3 vel = body.cmVel + crossProd(body.angVel, arm) + (normal * (1.f + 0.5f * random()) + jitter * 0.5f) * speed;
+                Uint32 hex = piece.colorOverride ? rgbToHex(piece.r, piece.g, piece.b) : rgbToHex(poly.r, poly.g, poly.b);
+                if (!spawn(point + normal * PARTICLE_SURFACE_OFFSET, vel, lifetime * (1.f + 0.25f * random()), PARTICLE_SIZE, hex)) return emitted;
+                emitted++;
+                break;
+            }
+        }
+        return emitted;
+    }
+    //Debris off both surfaces of a contact, more the harder the bodies hit
+    int emitImpact(BodyPool& bodies, const Contact& contact) {
+        float hitSpeed = -contact.normalSpeed;
+        if (hitSpeed < PARTICLE_IMPACT_MIN_SPEED) return 0;
+        int n = min(PARTICLE_IMPACT_MAX, int(hitSpeed * PARTICLE_IMPACT_PER_SPEED));
+        float speed = PARTICLE_IMPACT_SPEED_RATIO * hitSpeed;
+        return emitFromBody(bodies[contact.a], n / 2, speed, PARTICLE_LIFETIME, &contact.point, PARTICLE_IMPACT_RADIUS) +
+            emitFromBody(bodies[contact.b], n - n / 2, speed, PARTICLE_LIFETIME, &contact.point, PARTICLE_IMPACT_RADIUS);
+    }
+
+    //Update kernels over [begin, end), both multiples of 8, the lanes past count are padding and harmless.
+    //Semi-implicit Euler: gravity, then drag, then the move; a particle below the ground is mirrored above it
+    void updateScalar(int begin, int end, float dt) {
+        float damp = max(0.f, 1.f - drag * dt);
+        for (int i = begin; i != end; i++) {
+            velX[i] = (velX[i] + gravity.x * dt) * damp;
+            velY[i] = (velY[i] + gravity.y * dt) * damp;
+            velZ[i] = (velZ[i] + gravity.z * dt) * damp;
+            posX[i] = posX[i] + velX[i] * dt;
+            posY[i] = posY[i] + velY[i] * dt;
+            posZ[i] = posZ[i] + velZ[i] * dt;
+            life[i] = life[i] - dt;
+            if (posZ[i] < groundZ) {
+                posZ[i] = groundZ + (groundZ - posZ[i]) * restitution;
+                velZ[i] = -velZ[i] * restitution;
+                velX[i] = velX[i] * friction;
+                velY[i] = velY[i] * friction;
+            }
+        }
+    }
+    TARGET_AVX2 void updateSimd(int begin, int end, float dt) {
+        __m256 gX = _mm256_set1_ps(gravity.x * dt), gY = _mm256_set1_ps(gravity.y * dt), gZ = _mm256_set1_ps(gravity.z * dt);
+        __m256 damp = _mm256_set1_ps(max(0.f, 1.f - drag * dt)), step = _mm256_set1_ps(dt);
+        __m256 ground = _mm256_set1_ps(groundZ), rest = _mm256_set1_ps(restitution), negRest = _mm256_set1_ps(-restitution);
+        __m256 keep = _mm256_set1_ps(friction);
+        for (int i = begin; i != end; i += 8) {
+            __m256 vx = _mm256_mul_ps(_mm256_add_ps(_mm256_load_ps(velX + i), gX), damp);
+            __m256 vy = _mm256_mul_ps(_mm256_add_ps(_mm256_load_ps(velY + i), gY), damp);
+            __m256 vz = _mm256_mul_ps(_mm256_add_ps(_mm256_load_ps(velZ + i), gZ), damp);
+            __m256 px = _mm256_add_ps(_mm256_load_ps(posX + i), _mm256_mul_ps(vx, step));
+            __m256 py = _mm256_add_ps(_mm256_load_ps(posY + i), _mm256_mul_ps(vy, step));
+            __m256 pz = _mm256_add_ps(_mm256_load_ps(posZ + i), _mm256_mul_ps(vz, step));
+            _mm256_store_ps(life + i, _mm256_sub_ps(_mm256_load_ps(life + i), step));
+
+            __m256 below = _mm256_cmp_ps(pz, ground, _CMP_LT_OQ);
+            pz = _mm256_blendv_ps(pz, _mm256_add_ps(ground, _mm256_mul_ps(_mm256_sub_ps(ground, pz), rest)), below);
+            vz = _mm256_blendv_ps(vz, _mm256_mul_ps(vz, negRest), below);
+            vx = _mm256_blendv_ps(vx, _mm256_mul_ps(vx, keep), below);
+            vy = _mm256_blendv_ps(vy, _mm256_mul_ps(vy, keep), below);
+
+            _mm256_store_ps(velX + i, vx); _mm256_store_ps(velY + i, vy); _mm256_store_ps(velZ + i, vz);
+            _mm256_store_ps(posX + i, px); _mm256_store_ps(posY + i, py); _mm256_store_ps(posZ + i, pz);
+        }
+    }
+    struct UpdateJob {
+        ParticleSystem* sys;
+        float dt;
+        int end, chunkNum;
+        atomic<int> nextChunk;
+    };
+    static void updateJob(void* arg) {
+        UpdateJob& job = *static_cast<UpdateJob*>(arg);
+        for (int chunk = job.nextChunk++; chunk < job.chunkNum; chunk = job.nextChunk++) {
+            job.sys->updateRange(chunk * PARTICLE_CHUNK, min(job.end, (chunk + 1) * PARTICLE_CHUNK), job.dt);
+        }
+    }
+    void updateRange(int begin, int end, float dt) {
+        if (simd) updateSimd(begin, end, dt);
+        else updateScalar(begin, end, dt);
+    }
+    //Inline until it is measured, then threaded once, then whichever was faster; every PARTICLE_PROBE_INTERVAL
+    //updates the other path is timed again, as the costs change with the particle count and the machine's load
+    bool pickThreaded() {
+        if (inlineNs == 0) return false;
+        if (threadedNs == 0) return true;
+        bool faster = threadedNs < inlineNs;
+        if (++updatesSinceProbe < PARTICLE_PROBE_INTERVAL) return faster;
+        updatesSinceProbe = 0;
+        return !faster;
+    }
+
+    //Advances every particle by dt in parallel chunks on the pool, inline when there are too few particles or the
+    //hand-over measured slower, then removes the expired ones by moving the last live particle into their place
+    void update(float dt, int threadNum = 0) {
+        auto t1 = chrono::steady_clock::now();
+        UpdateJob job;
+        job.sys = this;
+        job.dt = dt;
+        job.end = (count + 7) / 8 * 8;
+        job.chunkNum = (job.end + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+        job.nextChunk = 0;
+        if (threadNum <= 0) threadNum = max(1u, thread::hardware_concurrency());
+        threadNum = max(1, min(threadNum, job.end / PARTICLE_THREAD_MIN));
+        bool threaded = threadNum > 1 and pickThreaded();
+        if (threaded) pool.run(updateJob, &job, threadNum);
+        else updateRange(0, job.end, dt);
+        if (threadNum > 1) {
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t1).count() / job.end;
+            double& measured = threaded ? threadedNs : inlineNs;
+            measured = measured == 0 ? ns : 0.75 * measured + 0.25 * ns;
+        }
+
+        stats.expired = 0;
+        for (int i = 0; i < count; i++) {
+            while (i < count and life[i] <= 0.f) {
+                count--;
+                stats.expired++;
+                posX[i] = posX[count]; posY[i] = posY[count]; posZ[i] = posZ[count];
+                velX[i] = velX[count]; velY[i] = velY[count]; velZ[i] = velZ[count];
+                life[i] = life[count]; size[i] = size[count]; color[i] = color[count];
+            }
+        }
+        stats.spawned = spawnedSinceUpdate;
+        spawnedSinceUpdate = 0;
+        stats.updateMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+    }
+
+    //Sprites into the camera's frame buffer, at least one pixel each. The normal faces the eye, so a sprite is lit
+    //like a small disc turned towards the viewer
+    void render(Camera& cam) const {
+        auto t1 = chrono::steady_clock::now();
+        FrameBuffer& fb = *cam.fb;
+        Mat3x3 toCamMat = cam.orientMat.T();
+        float projScale = cam.planeDist * cam.scale;
+        long long written = 0;
+        bool unbake = fb.baked; //sprites cover light-mapped pixels with unbaked ones
+        for (int i = 0; i != count; i++) {
+            Vec3 p = toCamMat * (Vec3(posX[i], posY[i], posZ[i]) - cam.eye);
+            if (p.z < cam.planeDist) continue;
+            float invZ = projScale / p.z;
+            int cx = int(0.5f * WIDTH + p.x * invZ), cy = int(0.5f * HEIGHT + p.y * invZ);
+            int half = int(size[i] * invZ);
+            int minX = max(cam.clipMinX, cx - half), maxX = min(cam.clipMaxX, cx + half + 1);
+            int minY = max(cam.clipMinY, cy - half), maxY = min(cam.clipMaxY, cy + half + 1);
+            if (minX >= maxX or minY >= maxY) continue;
+
+            float depth = cam.euclideanDepth ? modSqr(p) : p.z;
+            Vec3 normal = p * (-1.f / mod(p));
+            Uint32 red = hexToRed(color[i]), green = hexToGreen(color[i]), blue = hexToBlue(color[i]);
+            for (int y = minY; y != maxY; y++) {
+                for (int x = minX; x != maxX; x++) {
+                    if (depth >= fb.zBuff[y][x]) continue;
+                    fb.zBuff[y][x] = depth;
+                    fb.directionBuff[y][x] = p;
+                    fb.normalBuff[y][x] = normal;
+                    fb.preLightBuff[y][x][0] = red;
+                    fb.preLightBuff[y][x][1] = green;
+                    fb.preLightBuff[y][x][2] = blue;
+                    fb.texBuff[y][x].texId = -1;
+                    if (unbake) fb.bakedBuff[y][x] = -1.f;
+                    written++;
+                }
+            }
+        }
+        stats.pixelsWritten = written;
+        stats.rasterMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+    }
+};
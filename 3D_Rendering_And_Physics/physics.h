@@ -0,0 +1,352 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <limits>
+#include "parameters.h"
+#include "mylinal.h"
+#include "rigidbody.h"
+#include "collision.h"
+
+//Physics world
+//Steps the bodies of a BodyPool. A sweep-and-prune broadphase over bounding spheres finds touching pairs and
+//touching bodies form islands. An island whose bodies all stayed below the sleep energy thresholds for SLEEP_TIME
+//goes to sleep: its bodies are no longer integrated, their bounds are not updated and pairs of two sleeping bodies
+//are not reported. A sleeping island wakes as a whole when an awake body touches it or one of its bodies gets an impulse.
+//Contacts are taken in time order within a step: both bodies move to the contact, get a frictionless impulse and their
+//pairs are tested again over the rest of the step. Bodies moving far relative to their size within a step find contacts
+//by conservative advancement (continuous detection), the others by a distance test at the step's end.
+struct PhysicsWorld {
+    BodyPool& bodies;
+    bool sleepEnabled = true;
+    bool ccdEnabled = true;
+
+    //Broadphase
+    vector<Vec3> boundMin, boundMax; //per slot, box around the bounding sphere swept over the step
+    vector<int> order;               //tracked slots sorted by boundMin.x, nearly sorted from step to step
+    vector<bool> inOrder;
+    vector<pair<int, int>> pairs;    //touching pairs of the last step, at least one body of each awake
+    vector<int> pairContacts;        //per pair, contacts taken this step
+    vector<int> pairStart, bodyPairs; //pairs of body id at bodyPairs[pairStart[id]] up to pairStart[id + 1], ascending
+
+    //Narrow phase
+    vector<bool> ccd;           //per slot, body moves too far this step for a test at its end
+    vector<float> bodyTime;     //per slot, time into the step the body's state is at
+    vector<int> eventNum;       //per slot, contacts this step that bent the body's path
+    vector<Contact> contacts;   //heap, earliest first
+    vector<Contact> impacts;    //contacts resolved in the last step, in time order, for effects
+    CollisionScratch scratch;
+
+    //Islands
+    vector<int> parent;       //union-find over slots
+    vector<float> islandRest; //per island root, shortest rest time of its bodies
+    vector<int> sleepIsland;  //root of the island a sleeping body went to sleep with
+    vector<bool> wakeMark;    //per sleeping island root, to be woken
+
+    //Statistics of the last step
+    int activeNum = 0, sleepingNum = 0, islandNum = 0;
+    int ccdNum = 0, contactNum = 0;
+
+    explicit PhysicsWorld(BodyPool& bodies) : bodies(bodies) {
+        int capacity = bodies.capacity();
+        boundMin.resize(capacity);
+        boundMax.resize(capacity);
+        order.reserve(capacity);
+        inOrder.resize(capacity, false);
+        pairs.reserve(4 * capacity);
+        pairContacts.reserve(4 * capacity);
+        pairStart.resize(capacity + 1);
+        bodyPairs.reserve(8 * capacity);
+        parent.resize(capacity);
+        islandRest.resize(capacity);
+        sleepIsland.resize(capacity, -1);
+        wakeMark.resize(capacity, false);
+        ccd.resize(capacity, false);
+        bodyTime.resize(capacity, 0.f);
+        eventNum.resize(capacity, 0);
+        contacts.reserve(4 * capacity);
+        impacts.reserve(4 * capacity);
+    }
+    PhysicsWorld(const PhysicsWorld&) = delete;
+    PhysicsWorld& operator=(const PhysicsWorld&) = delete;
+
+    void updateBounds(int id, float dt) { //swept over the step, rotation stays inside the sphere
+        RigidBody& body = bodies[id];
+        float radius = body.boundingRadius();
+        Vec3 endPos = body.cmPos + body.cmVel * dt;
+        boundMin[id] = Vec3(min(body.cmPos.x, endPos.x) - radius, min(body.cmPos.y, endPos.y) - radius, min(body.cmPos.z, endPos.z) - radius);
+        boundMax[id] = Vec3(max(body.cmPos.x, endPos.x) + radius, max(body.cmPos.y, endPos.y) + radius, max(body.cmPos.z, endPos.z) + radius);
+    }
+    int find(int id) {
+        while (parent[id] != id) {
+            parent[id] = parent[parent[id]];
+            id = parent[id];
+        }
+        return id;
+    }
+    void unite(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a != b) parent[b] = a;
+    }
+
+    //Waking
+    void markWake(int id) {
+        if (bodies[id].sleeping) wakeMark[sleepIsland[id]] = true;
+    }
+    void wakeMarked() {
+        for (int id = 0; id != bodies.capacity(); id++) {
+            if (bodies.alive[id] and bodies[id].sleeping and wakeMark[sleepIsland[id]]) bodies[id].wake();
+        }
+        for (int id = 0; id != bodies.capacity(); id++) wakeMark[id] = false;
+    }
+    void wake(int id) { //wakes the body and the island it sleeps in
+        markWake(id);
+        wakeMarked();
+    }
+    void applyImpulse(int id, const Vec3& impulse, const Vec3& point) { //point in world CS
+        wake(id);
+        bodies[id].applyImpulse(impulse, point);
+    }
+
+    //Narrow phase
+    static bool laterContact(const Contact& c1, const Contact& c2) {
+        return c1.toi > c2.toi;
+    }
+    void advance(int id, float t) {
+        if (t > bodyTime[id]) {
+            bodies[id].integrator(t - bodyTime[id]);
+            bodyTime[id] = t;
+        }
+    }
+    void findContact(int pair, float t0, float t1) { //queues the first contact of the pair's bodies within [t0, t1]
+        if (pairContacts[pair] == MAX_PAIR_CONTACTS) return;
+        int a = pairs[pair].first, b = pairs[pair].second;
+        Contact contact;
+        bool hit = ccd[a] or ccd[b] ? timeOfImpact(bodies[a], bodyTime[a], bodies[b], bodyTime[b], t0, t1, scratch, contact) :
+            contactTest(bodies[a], bodyTime[a], bodies[b], bodyTime[b], t1, scratch, contact);
+        if (!hit) return;
+        contact.pair = pair;
+        contact.a = a;
+        contact.b = b;
+        contact.eventA = eventNum[a];
+        contact.eventB = eventNum[b];
+        contacts.push_back(contact);
+        push_heap(contacts.begin(), contacts.end(), laterContact);
+    }
+
+    //Broadphase
+    void updateOrder(float dt) {
+        //Keep the previous order, dropping destroyed bodies and appending new ones
+        int kept = 0;
+        for (int i = 0; i != order.size(); i++) {
+            if (bodies.alive[order[i]]) order[kept++] = order[i];
+            else inOrder[order[i]] = false;
+        }
+        order.resize(kept);
+        for (int id = 0; id != bodies.capacity(); id++) {
+            if (!bodies.alive[id] or inOrder[id]) continue;
+            updateBounds(id, bodies[id].sleeping ? 0.f : dt);
+            if (bodies[id].sleeping) sleepIsland[id] = id; //created asleep, an island of its own
+            order.push_back(id);
+            inOrder[id] = true;
+        }
+
+        //Insertion sort, close to linear since bodies move little per step
+        for (int i = 1; i < order.size(); i++) {
+            int id = order[i];
+            int j = i - 1;
+            for (; j >= 0 and boundMin[order[j]].x > boundMin[id].x; j--) order[j + 1] = order[j];
+            order[j + 1] = id;
+        }
+    }
+    bool overlapYZ(int a, int b) const {
+        return boundMin[a].y <= boundMax[b].y and boundMin[b].y <= boundMax[a].y and
+            boundMin[a].z <= boundMax[b].z and boundMin[b].z <= boundMax[a].z;
+    }
+    void findPairs() {
+        pairs.clear();
+        float maxWidth = 0.f;
+        for (int i = 0; i != order.size(); i++) maxWidth = max(maxWidth, boundMax[order[i]].x - boundMin[order[i]].x);
+
+        //Sweeps start from awake bodies only, so resting regions cost nothing beyond the sort.
+        //Partners left of a start no earlier than its min.x minus the widest box
+        for (int i = 0; i != order.size(); i++) {
+            int a = order[i];
+            if (bodies[a].sleeping) continue;
+            for (int j = i - 1; j >= 0 and boundMin[order[j]].x >= boundMin[a].x - maxWidth; j--) {
+                int b = order[j]; //awake left partners already reported this pair from their own sweep
+                if (bodies[b].sleeping and boundMax[b].x >= boundMin[a].x and overlapYZ(a, b)) pairs.push_back(make_pair(b, a));
+            }
+            for (int j = i + 1; j != order.size() and boundMin[order[j]].x <= boundMax[a].x; j++) {
+                int b = order[j];
+                if (overlapYZ(a, b)) pairs.push_back(make_pair(a, b));
+            }
+        }
+    }
+
+    void listBodyPairs() {
+        int capacity = bodies.capacity();
+        pairStart.assign(capacity + 1, 0);
+        for (int i = 0; i != pairs.size(); i++) {
+            pairStart[pairs[i].first + 1]++;
+            pairStart[pairs[i].second + 1]++;
+        }
+        for (int id = 0; id != capacity; id++) pairStart[id + 1] += pairStart[id];
+        bodyPairs.resize(2 * pairs.size());
+        for (int i = 0; i != pairs.size(); i++) { //filled in pair order, so each body's list comes out ascending
+            bodyPairs[pairStart[pairs[i].first]++] = i;
+            bodyPairs[pairStart[pairs[i].second]++] = i;
+        }
+        for (int id = capacity; id != 0; id--) pairStart[id] = pairStart[id - 1];
+        pairStart[0] = 0;
+    }
+    void updateCcd(int id, float dt) {
+        RigidBody& body = bodies[id];
+        body.angVel = body.orientMat * body.invInertiaTensor * body.orientMat.T() * body.angMom;
+        float radius = body.boundingRadius();
+        ccd[id] = ccdEnabled and (mod(body.cmVel) + mod(body.angVel) * radius) * dt > CCD_MOTION_RATIO * radius;
+    }
+
+    void step(float dt) {
+        int capacity = bodies.capacity();
+
+        if (!sleepEnabled) {
+            for (int id = 0; id != capacity; id++) {
+                if (bodies.alive[id] and bodies[id].sleeping) bodies[id].wake();
+            }
+        }
+
+        //Motion of the step and swept bounds, sleeping bodies keep theirs
+        ccdNum = 0;
+        for (int id = 0; id != capacity; id++) {
+            if (!bodies.alive[id] or bodies[id].sleeping) continue;
+            updateCcd(id, dt);
+            ccdNum += ccd[id];
+            if (inOrder[id]) updateBounds(id, dt);
+        }
+        updateOrder(dt);
+        findPairs();
+
+        //Wake on contact: a sleeping body touched by an awake one wakes its island
+        bool anyWake = false;
+        for (int i = 0; i != pairs.size(); i++) {
+            int a = pairs[i].first, b = pairs[i].second;
+            if (bodies[a].sleeping != bodies[b].sleeping) {
+                markWake(bodies[a].sleeping ? a : b);
+                anyWake = true;
+            }
+        }
+        if (anyWake) { //the woken bodies' flags are from the step they fell asleep in
+            wakeMarked();
+            ccdNum = 0;
+            for (int id = 0; id != capacity; id++) {
+                if (!bodies.alive[id] or bodies[id].sleeping) continue;
+                updateCcd(id, dt);
+                ccdNum += ccd[id];
+            }
+        }
+
+        //Narrow phase, all pairs are awake now
+        for (int id = 0; id != capacity; id++) {
+            bodyTime[id] = 0.f;
+            eventNum[id] = 0;
+        }
+        contacts.clear();
+        impacts.clear();
+        pairContacts.assign(pairs.size(), 0);
+        listBodyPairs();
+        for (int i = 0; i != pairs.size(); i++) findContact(i, 0.f, dt);
+
+        //Contacts in time order. An impulse that bends a body's path over the rest of the step by more than the
+        //tolerance makes its queued contacts stale, its pairs are queued again from the new state. Heavy bodies
+        //barely deflected by light ones keep theirs
+        contactNum = 0;
+        while (!contacts.empty()) {
+            pop_heap(contacts.begin(), contacts.end(), laterContact);
+            Contact contact = contacts.back();
+            contacts.pop_back();
+            int a = contact.a, b = contact.b;
+            if (contact.eventA != eventNum[a] or contact.eventB != eventNum[b]) continue;
+
+            advance(a, contact.toi);
+            advance(b, contact.toi);
+            RigidBody& bodyA = bodies[a];
+            RigidBody& bodyB = bodies[b];
+            Vec3 velA = bodyA.cmVel, angVelA = bodyA.angVel, velB = bodyB.cmVel, angVelB = bodyB.angVel;
+            resolveContact(bodyA, bodyB, contact);
+            impacts.push_back(contact);
+            pairContacts[contact.pair]++;
+            contactNum++;
+
+            float rest = dt - contact.toi;
+            bool bentA = (mod(bodyA.cmVel - velA) + mod(bodyA.angVel - angVelA) * bodyA.boundRadius) * rest > 0.5f * CONTACT_TOLERANCE;
+            bool bentB = (mod(bodyB.cmVel - velB) + mod(bodyB.angVel - angVelB) * bodyB.boundRadius) * rest > 0.5f * CONTACT_TOLERANCE;
+            eventNum[a] += bentA;
+            eventNum[b] += bentB;
+            if (!bentA and !bentB) {
+                findContact(contact.pair, contact.toi, dt);
+                continue;
+            }
+            //Pairs of the bent bodies in pair order, the contact's own pair is in both lists
+            int i = pairStart[a], iEnd = bentA ? pairStart[a + 1] : i;
+            int j = pairStart[b], jEnd = bentB ? pairStart[b + 1] : j;
+            while (i != iEnd or j != jEnd) {
+                int pair;
+                if (j == jEnd or (i != iEnd and bodyPairs[i] < bodyPairs[j])) pair = bodyPairs[i++];
+                else if (i == iEnd or bodyPairs[j] < bodyPairs[i]) pair = bodyPairs[j++];
+                else {
+                    pair = bodyPairs[i++];
+                    j++;
+                }
+                findContact(pair, contact.toi, dt);
+            }
+        }
+        for (int id = 0; id != capacity; id++) {
+            if (bodies.alive[id] and !bodies[id].sleeping) advance(id, dt);
+        }
+
+        //Islands of the awake bodies
+        for (int id = 0; id != capacity; id++) {
+            if (!bodies.alive[id] or bodies[id].sleeping) continue;
+            parent[id] = id;
+            islandRest[id] = numeric_limits<float>::max();
+        }
+        for (int i = 0; i != pairs.size(); i++) {
+            if (!bodies[pairs[i].first].sleeping and !bodies[pairs[i].second].sleeping) unite(pairs[i].first, pairs[i].second);
+        }
+
+        //Rest timers, an island can only sleep once all its bodies rested long enough
+        for (int id = 0; id != capacity; id++) {
+            if (!bodies.alive[id] or bodies[id].sleeping) continue;
+            RigidBody& body = bodies[id];
+            float linEnergy = 0.5f * modSqr(body.cmVel);
+            float angEnergy = 0.5f * dotProd(body.angVel, body.angMom) / body.mass;
+            if (linEnergy < SLEEP_LINEAR_ENERGY and angEnergy < SLEEP_ANGULAR_ENERGY) body.sleepTimer += dt;
+            else body.sleepTimer = 0.f;
+
+            int root = find(id);
+            islandRest[root] = min(islandRest[root], body.sleepTimer);
+        }
+
+        activeNum = sleepingNum = islandNum = 0;
+        for (int id = 0; id != capacity; id++) {
+            if (!bodies.alive[id]) continue;
+            RigidBody& body = bodies[id];
+            if (!body.sleeping) {
+                int root = find(id);
+                islandNum += root == id;
+                if (sleepEnabled and islandRest[root] >= SLEEP_TIME) {
+                    body.sleeping = true;
+                    body.cmVel = Vec3();
+                    body.angVel = Vec3();
+                    body.angMom = Vec3();
+                    sleepIsland[id] = root;
+                }
+            }
+            if (body.sleeping) sleepingNum++;
+            else activeNum++;
+        }
+    }
+};
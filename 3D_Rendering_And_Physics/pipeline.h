@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include <SDL.h>
+#include "parameters.h"
+#include "polygon.h"
+#include "rigidbody.h"
+#include "lightsource.h"
+#include "camera.h"
+#include "arena.h"
+#include "worker.h"
+#include "framesink.h"
+#include "particles.h"
+
+//Frame pipeline
+//Double-buffered frame loop. While frame N is lit and presented on the main thread, frame N+1 is
+//rasterized into the other frame buffer on the raster worker, and the buffer freed by frame N is
+//cleared on the clear worker before it is reused. Physics and camera input run between frames,
+//when no worker reads the world.
+struct FramePipeline {
+    Camera& cam;
+    BodyPool& world;
+    const vector<Polygon>& staticPolys;
+    const vector<LightSource>& lights;
+    FrameSink* sink = nullptr; //optional stream output, lit frames are shaded straight into its ring
+    const ParticleSystem* particles = nullptr; //optional, composited after the world
+
+    FrameBuffer* front = &frameBuffers[0]; //rasterized, waiting to be lit and presented
+    FrameBuffer* back = &frameBuffers[1];  //being rasterized
+    bool frontReady = false;
+    chrono::steady_clock::time_point frontStart, backStart, lastPresent;
+
+    Worker rasterWorker, clearWorker;
+
+    //Statistics of the last presented frame
+    double latencyMs = 0; //from the start of its rasterization to present
+    double frameMs = 0;   //present-to-present interval, its inverse is the throughput
+
+    FramePipeline(Camera& cam, BodyPool& world, const vector<Polygon>& staticPolys, const vector<LightSource>& lights) :
+        cam(cam), world(world), staticPolys(staticPolys), lights(lights), lastPresent(chrono::steady_clock::now()) {}
+
+    static void rasterJob(void* arg) {
+        FramePipeline& pipe = *static_cast<FramePipeline*>(arg);
+        frameArena.reset();
+        for (int i = 0; i != pipe.staticPolys.size(); i++) {
+            pipe.cam.renderPolygon(pipe.staticPolys[i], pipe.cam.staticLighting ? pipe.cam.staticLighting->polyMap(i) : nullptr);
+        }
+        pipe.cam.renderWorld(pipe.world);
+        if (pipe.particles) pipe.particles->render(pipe.cam);
+    }
+    static void clearJob(void* arg) {
+        static_cast<FrameBuffer*>(arg)->clear();
+    }
+
+    //Runs one pipeline step: starts rasterizing the current world and presents the previous frame.
+    //texture may be null when running headless
+    void step(SDL_Texture* texture) {
+        clearWorker.wait(); //back buffer is recycled, it must be clean
+        cam.fb = back;
+        cam.beginFrame();
+        backStart = chrono::steady_clock::now();
+        rasterWorker.run(rasterJob, this);
+
+        if (frontReady) {
+            Uint32* slot = sink ? sink->acquire() : nullptr;
+            if (slot) {
+                cam.shadeBuffer(*front, lights, slot, WIDTH);
+                if (texture) SDL_UpdateTexture(texture, NULL, slot, WIDTH * sizeof(Uint32));
+                sink->commit();
+            }
+            else if (texture) cam.applyLight(*front, lights, texture);
+
+            if (texture) {
+                SDL_RenderCopy(cam.rend, texture, NULL, NULL);
+                SDL_RenderPresent(cam.rend);
+            }
+
+            auto now = chrono::steady_clock::now();
+            latencyMs = chrono::duration<double, milli>(now - frontStart).count();
+            frameMs = chrono::duration<double, milli>(now - lastPresent).count();
+            lastPresent = now;
+
+            clearWorker.run(clearJob, front);
+        }
+
+        rasterWorker.wait();
+        swap(front, back);
+        frontStart = backStart;
+        frontReady = true;
+    }
+    //Waits for all workers, the world may be modified freely afterwards. The frame waiting in front is dropped,
+    //so other render modes in between never let step present a stale one
+    void finish() {
+        rasterWorker.wait();
+        clearWorker.wait();
+        if (frontReady) front->clear();
+        frontReady = false;
+    }
+};
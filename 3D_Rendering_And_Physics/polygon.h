@@ -1,11 +1,14 @@
 #pragma once
 
+#include <utility>
 #include "mylinal.h"
 
 //Polygon
 struct Polygon {
     Vec3 r1, r2, r3;
     int r, g, b;
+    float u1 = 0.f, v1 = 0.f, u2 = 0.f, v2 = 0.f, u3 = 0.f, v3 = 0.f; //texture coordinates of r1, r2, r3
+    int texId = -1; //texture modulating r, g, b, -1 for a flat colour
 
     Polygon() : r1(0), r2(0), r3(0), r(255), g(255), b(255) {}
     Polygon(Vec3 r1, Vec3 r2, Vec3 r3, int r = 255, int g = 255, int b = 255) : r1(r1), r2(r2), r3(r3), r(r), g(g), b(b) {}
@@ -44,18 +47,20 @@ inline void makeRightHand(Polygon* poly) {
     Vec3 tmp = poly->r3;
     poly->r3 = poly->r2;
     poly->r2 = tmp;
+    swap(poly->u2, poly->u3);
+    swap(poly->v2, poly->v3);
 }
-inline float findSignedTetraVolume(Polygon& poly) {
+inline float findSignedTetraVolume(const Polygon& poly) {
     return tripleProd(poly.r1, poly.r2, poly.r3) / 6.f;
 }
-inline Vec3 findTetraCM(Polygon& poly) {
+inline Vec3 findTetraCM(const Polygon& poly) {
     return (poly.r1 + poly.r2 + poly.r3) / 4.f;
 }
-Mat3x3 findSignedTetraInertTen(Polygon& poly) {
+Mat3x3 findSignedTetraInertTen(const Polygon& poly) {
     float Ixx, Iyy, Izz, Ixy, Ixz, Iyz;
-    float& x2 = poly.r1.x; float& y2 = poly.r1.y; float& z2 = poly.r1.z;
-    float& x3 = poly.r2.x; float& y3 = poly.r2.y; float& z3 = poly.r2.z;
-    float& x4 = poly.r3.x; float& y4 = poly.r3.y; float& z4 = poly.r3.z;
+    const float& x2 = poly.r1.x; const float& y2 = poly.r1.y; const float& z2 = poly.r1.z;
+    const float& x3 = poly.r2.x; const float& y3 = poly.r2.y; const float& z3 = poly.r2.z;
+    const float& x4 = poly.r3.x; const float& y4 = poly.r3.y; const float& z4 = poly.r3.z;
 
     Ixx = (y2 * y2 + y2 * y3 + y3 * y3 + y2 * y4 + y3 * y4 + y4 * y4 + z2 * z2 + z2 * z3 + z3 * z3 + z2 * z4 + z3 * z4 + z4 * z4) / 60.f;
     Iyy = (x2 * x2 + x2 * x3 + x3 * x3 + x2 * x4 + x3 * x4 + x4 * x4 + z2 * z2 + z2 * z3 + z3 * z3 + z2 * z4 + z3 * z4 + z4 * z4) / 60.f;
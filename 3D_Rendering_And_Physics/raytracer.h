@@ -0,0 +1,472 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <xmmintrin.h>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "rigidbody.h"
+#include "lightsource.h"
+#include "camera.h"
+#include "worker.h"
+
+//Ray tracer
+//Reference renderer: traces the pixel rays of a Camera through a SAH bounding volume hierarchy over all
+//scene triangles and shades hits with the same shadePixel as the rasterizer, so both outputs are comparable.
+//Adds hard shadows and an optional mirror bounce. Only the first RT_MAX_LIGHTS lights are traced and shaded.
+
+struct RTTriangle {
+    Vec3 r1, r2, r3; //world CS
+    int r, g, b;
+    int body, piece, poly;  //source polygon, body -1 for static polygons
+};
+
+struct BVHNode {
+    Vec3 bmin, bmax;
+    int first = 0; //leaf: first index into triIds, inner node: index of the left child (right one follows it)
+    int count = 0; //triangles in a leaf, 0 for inner nodes
+};
+
+inline void growBounds(Vec3& bmin, Vec3& bmax, const Vec3& p) {
+    bmin = Vec3(min(bmin.x, p.x), min(bmin.y, p.y), min(bmin.z, p.z));
+    bmax = Vec3(max(bmax.x, p.x), max(bmax.y, p.y), max(bmax.z, p.z));
+}
+inline float boundsArea(const Vec3& bmin, const Vec3& bmax) {
+    Vec3 e = bmax - bmin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+inline float axisOf(const Vec3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+//Moller-Trumbore, returns the ray parameter of the hit or tMax when there is none
+inline float intersectTriangle(const Vec3& orig, const Vec3& dir, const Vec3& r1, const Vec3& r2, const Vec3& r3, float tMax) {
+    Vec3 e1 = r2 - r1, e2 = r3 - r1;
+    Vec3 p = crossProd(dir, e2);
+    float detVal = dotProd(e1, p);
+    if (fabs(detVal) < 1e-12f) return tMax;
+
+    float invDet = 1.f / detVal;
+    Vec3 s = orig - r1;
+    float u = dotProd(s, p) * invDet;
+    if (u < 0.f or u > 1.f) return tMax;
+    Vec3 q = crossProd(s, e1);
+    float v = dotProd(dir, q) * invDet;
+    if (v < 0.f or u + v > 1.f) return tMax;
+
+    float t = dotProd(e2, q) * invDet;
+    return (t > RT_EPSILON and t < tMax) ? t : tMax;
+}
+inline float intersectTriangle(const Vec3& orig, const Vec3& dir, const RTTriangle& tri, float tMax) {
+    return intersectTriangle(orig, dir, tri.r1, tri.r2, tri.r3, tMax);
+}
+
+struct RayTracer {
+    vector<RTTriangle> tris;
+    vector<int> triIds;
+    vector<BVHNode> nodes;
+    vector<int> bodyIds;       //alive bodies the hierarchy was built for with their shape versions, a change forces a rebuild
+    vector<int> aliveIds;      //the same for this frame, kept so comparing does not allocate
+    float builtRootArea = 0.f; //root surface area right after the last build
+    int depth = 0;             //deepest level of the last build, traversal stacks hold one entry more
+    int rebuildNum = 0, refitNum = 0;
+    bool shadows = true;
+    float reflectivity = RT_REFLECTIVITY; //0 disables the mirror bounce
+    mutable WorkerPool pool;   //tile threads, kept between frames
+
+    //Scene update
+    void gatherTriangles(BodyPool& world, const vector<Polygon>& staticPolys) {
+        tris.clear();
+        for (int i = 0; i != staticPolys.size(); i++) {
+            const Polygon& poly = staticPolys[i];
+            tris.push_back({ poly.r1, poly.r2, poly.r3, poly.r, poly.g, poly.b, -1, 0, i });
+        }
+        for (int id = 0; id != world.capacity(); id++) {
+            if (!world.alive[id]) continue;
+            const RigidBody& body = world[id];
+            for (int k = 0; k != body.pieceNum(); k++) {
+                ShapePiece piece = body.shapePiece(k);
+                const vector<Polygon>& polys = *piece.polys;
+                Mat3x3 orient = body.orientMat * piece.orient;
+                Vec3 pos = body.orientMat * piece.pos + body.cmPos;
+                for (int i = 0; i != polys.size(); i++) {
+                    const Polygon& poly = polys[i];
+                    RTTriangle tri;
+                    tri.r1 = orient * poly.r1 + pos;
+                    tri.r2 = orient * poly.r2 + pos;
+                    tri.r3 = orient * poly.r3 + pos;
+                    tri.r = piece.colorOverride ? piece.r : poly.r;
+                    tri.g = piece.colorOverride ? piece.g : poly.g;
+                    tri.b = piece.colorOverride ? piece.b : poly.b;
+                    tri.body = id;
+                    tri.piece = k;
+                    tri.poly = i;
+                    tris.push_back(tri);
+                }
+            }
+        }
+    }
+    void update(BodyPool& world, const vector<Polygon>& staticPolys) { //refits when only poses changed, rebuilds otherwise
+        aliveIds.clear();
+        for (int id = 0; id != world.capacity(); id++) {
+            if (!world.alive[id]) continue;
+            aliveIds.push_back(id);
+            aliveIds.push_back(world[id].shapeVersion);
+        }
+
+        if (aliveIds != bodyIds or nodes.empty()) {
+            bodyIds.swap(aliveIds);
+            gatherTriangles(world, staticPolys);
+            build();
+            return;
+        }
+
+        for (int i = 0; i != tris.size(); i++) {
+            RTTriangle& tri = tris[i];
+            if (tri.body < 0) continue;
+            const RigidBody& body = world[tri.body];
+            ShapePiece piece = body.shapePiece(tri.piece);
+            const Polygon& poly = (*piece.polys)[tri.poly];
+            Mat3x3 orient = body.orientMat * piece.orient;
+            Vec3 pos = body.orientMat * piece.pos + body.cmPos;
+            tri.r1 = orient * poly.r1 + pos;
+            tri.r2 = orient * poly.r2 + pos;
+            tri.r3 = orient * poly.r3 + pos;
+        }
+        refit();
+
+        //Refitting keeps the topology, so the tree degrades as bodies rotate; rebuild when it got too loose
+        if (boundsArea(nodes[0].bmin, nodes[0].bmax) > RT_REBUILD_AREA_RATIO * builtRootArea) build();
+    }
+
+    //Hierarchy
+    void nodeBounds(BVHNode& node) {
+        node.bmin = Vec3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+        node.bmax = -node.bmin;
+        for (int i = node.first; i != node.first + node.count; i++) {
+            const RTTriangle& tri = tris[triIds[i]];
+            growBounds(node.bmin, node.bmax, tri.r1);
+            growBounds(node.bmin, node.bmax, tri.r2);
+            growBounds(node.bmin, node.bmax, tri.r3);
+        }
+    }
+    void build() {
+        triIds.resize(tris.size());
+        for (int i = 0; i != tris.size(); i++) triIds[i] = i;
+
+        nodes.clear();
+        nodes.reserve(2 * tris.size() + 1);
+        BVHNode root;
+        root.first = 0;
+        root.count = tris.size();
+        nodes.push_back(root);
+        depth = 0;
+        subdivide(0, 0);
+
+        builtRootArea = boundsArea(nodes[0].bmin, nodes[0].bmax);
+        rebuildNum++;
+    }
+    void subdivide(int nodeId, int level) { //nodes at RT_MAX_DEPTH stay leaves, however many triangles they hold
+        nodeBounds(nodes[nodeId]);
+        BVHNode node = nodes[nodeId];
+        depth = max(depth, level);
+        if (node.count <= RT_LEAF_SIZE or level == RT_MAX_DEPTH) return;
+
+        //Binned SAH over triangle centroids
+        Vec3 cmin(node.bmax), cmax(node.bmin);
+        for (int i = node.first; i != node.first + node.count; i++) {
+            const RTTriangle& tri = tris[triIds[i]];
+            growBounds(cmin, cmax, (tri.r1 + tri.r2 + tri.r3) / 3.f);
+        }
+
+        int bestAxis = -1, bestSplit = 0;
+        float bestCost = node.count * boundsArea(node.bmin, node.bmax);
+        for (int axis = 0; axis != 3; axis++) {
+            float lo = axisOf(cmin, axis), hi = axisOf(cmax, axis);
+            if (hi - lo < 1e-6f) continue;
+
+            int binCount[RT_SAH_BINS] = { 0 };
+            Vec3 binMin[RT_SAH_BINS], binMax[RT_SAH_BINS];
+            for (int b = 0; b != RT_SAH_BINS; b++) {
+                binMin[b] = node.bmax;
+                binMax[b] = node.bmin;
+            }
+            float binScale = RT_SAH_BINS / (hi - lo);
+            for (int i = node.first; i != node.first + node.count; i++) {
+                const RTTriangle& tri = tris[triIds[i]];
+                int b = min(RT_SAH_BINS - 1, int((axisOf((tri.r1 + tri.r2 + tri.r3) / 3.f, axis) - lo) * binScale));
+                binCount[b]++;
+                growBounds(binMin[b], binMax[b], tri.r1);
+                growBounds(binMin[b], binMax[b], tri.r2);
+                growBounds(binMin[b], binMax[b], tri.r3);
+            }
+
+            //Sweep from the right to get the cost of every split plane
+            float rightArea[RT_SAH_BINS];
+            int rightCount[RT_SAH_BINS];
+            Vec3 accMin(node.bmax), accMax(node.bmin);
+            int acc = 0;
+            for (int b = RT_SAH_BINS - 1; b > 0; b--) {
+                acc += binCount[b];
+                if (binCount[b]) {
+                    growBounds(accMin, accMax, binMin[b]);
+                    growBounds(accMin, accMax, binMax[b]);
+                }
+                rightCount[b] = acc;
+                rightArea[b] = acc ? boundsArea(accMin, accMax) : 0.f;
+            }
+            accMin = node.bmax;
+            accMax = node.bmin;
+            acc = 0;
+            for (int b = 0; b != RT_SAH_BINS - 1; b++) {
+                acc += binCount[b];
+                if (binCount[b]) {
+                    growBounds(accMin, accMax, binMin[b]);
+                    growBounds(accMin, accMax, binMax[b]);
+                }
+                if (!acc or !rightCount[b + 1]) continue;
+                float cost = acc * boundsArea(accMin, accMax) + rightCount[b + 1] * rightArea[b + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b + 1;
+                }
+            }
+        }
+        if (bestAxis < 0) return; //splitting does not pay off, stay a leaf
+
+        float lo = axisOf(cmin, bestAxis), binScale = RT_SAH_BINS / (axisOf(cmax, bestAxis) - lo);
+        int mid = node.first;
+        for (int i = node.first; i != node.first + node.count; i++) {
+            const RTTriangle& tri = tris[triIds[i]];
+            int b = min(RT_SAH_BINS - 1, int((axisOf((tri.r1 + tri.r2 + tri.r3) / 3.f, bestAxis) - lo) * binScale));
+            if (b < bestSplit) swap(triIds[i], triIds[mid++]);
+        }
+
+        int leftId = nodes.size();
+        BVHNode left, right;
+        left.first = node.first;
+        left.count = mid - node.first;
+        right.first = mid;
+        right.count = node.first + node.count - mid;
+        nodes.push_back(left);
+        nodes.push_back(right);
+        nodes[nodeId].first = leftId;
+        nodes[nodeId].count = 0;
+
+        subdivide(leftId, level + 1);
+        subdivide(leftId + 1, level + 1);
+    }
+    void refit() { //children always come after their parent, so one reverse sweep updates everything
+        for (int i = nodes.size() - 1; i >= 0; i--) {
+            BVHNode& node = nodes[i];
+            if (node.count) {
+                nodeBounds(node);
+                continue;
+            }
+            const BVHNode& left = nodes[node.first];
+            const BVHNode& right = nodes[node.first + 1];
+            node.bmin = left.bmin;
+            node.bmax = left.bmax;
+            growBounds(node.bmin, node.bmax, right.bmin);
+            growBounds(node.bmin, node.bmax, right.bmax);
+        }
+        refitNum++;
+    }
+
+    //Traversal
+    //Depth first with both children pushed, so the stack never holds more than one node per level plus the root's
+    //Packet of 4 rays sharing an origin, slab tests run on all four at once with SSE
+    void tracePacket(const Vec3& orig, const Vec3* dirs, float* tHit, int* triHit) const {
+        __m128 dirX = _mm_set_ps(dirs[3].x, dirs[2].x, dirs[1].x, dirs[0].x);
+        __m128 dirY = _mm_set_ps(dirs[3].y, dirs[2].y, dirs[1].y, dirs[0].y);
+        __m128 dirZ = _mm_set_ps(dirs[3].z, dirs[2].z, dirs[1].z, dirs[0].z);
+        __m128 one = _mm_set1_ps(1.f);
+        __m128 invX = _mm_div_ps(one, dirX), invY = _mm_div_ps(one, dirY), invZ = _mm_div_ps(one, dirZ);
+        __m128 origX = _mm_set1_ps(orig.x), origY = _mm_set1_ps(orig.y), origZ = _mm_set1_ps(orig.z);
+
+        for (int k = 0; k != 4; k++) {
+            tHit[k] = numeric_limits<float>::max();
+            triHit[k] = -1;
+        }
+        if (nodes.empty()) return;
+
+        int stack[RT_MAX_DEPTH + 1], stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize) {
+            const BVHNode& node = nodes[stack[--stackSize]];
+
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin.x), origX), invX);
+            __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax.x), origX), invX);
+            __m128 tNear = _mm_min_ps(t1, t2), tFar = _mm_max_ps(t1, t2);
+            t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin.y), origY), invY);
+            t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax.y), origY), invY);
+            tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+            tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+            t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin.z), origZ), invZ);
+            t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax.z), origZ), invZ);
+            tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+            tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+            tFar = _mm_min_ps(tFar, _mm_loadu_ps(tHit));
+
+            int hitMask = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmpge_ps(tFar, _mm_setzero_ps())));
+            if (!hitMask) continue;
+
+            if (node.count) {
+                for (int i = node.first; i != node.first + node.count; i++) {
+                    const RTTriangle& tri = tris[triIds[i]];
+                    for (int k = 0; k != 4; k++) {
+                        if (!(hitMask & (1 << k))) continue;
+                        float t = intersectTriangle(orig, dirs[k], tri, tHit[k]);
+                        if (t < tHit[k]) {
+                            tHit[k] = t;
+                            triHit[k] = triIds[i];
+                        }
+                    }
+                }
+                continue;
+            }
+            stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+        }
+    }
+    int traceRay(const Vec3& orig, const Vec3& dir, float& tHit, float tMax = numeric_limits<float>::max()) const { //closest hit, -1 when none
+        int triHit = -1;
+        tHit = tMax;
+        if (nodes.empty()) return -1;
+
+        Vec3 invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        int stack[RT_MAX_DEPTH + 1], stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize) {
+            const BVHNode& node = nodes[stack[--stackSize]];
+
+            float tx1 = (node.bmin.x - orig.x) * invDir.x, tx2 = (node.bmax.x - orig.x) * invDir.x;
+            float ty1 = (node.bmin.y - orig.y) * invDir.y, ty2 = (node.bmax.y - orig.y) * invDir.y;
+            float tz1 = (node.bmin.z - orig.z) * invDir.z, tz2 = (node.bmax.z - orig.z) * invDir.z;
+            float tNear = max({ min(tx1, tx2), min(ty1, ty2), min(tz1, tz2) });
+            float tFar = min({ max(tx1, tx2), max(ty1, ty2), max(tz1, tz2), tHit });
+            if (tNear > tFar or tFar < 0.f) continue;
+
+            if (node.count) {
+                for (int i = node.first; i != node.first + node.count; i++) {
+                    float t = intersectTriangle(orig, dir, tris[triIds[i]], tHit);
+                    if (t < tHit) {
+                        tHit = t;
+                        triHit = triIds[i];
+                    }
+                }
+                continue;
+            }
+            stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+        }
+        return triHit;
+    }
+    bool occluded(const Vec3& orig, const Vec3& dir) const { //anything between orig and orig + dir
+        float tHit;
+        return traceRay(orig, dir, tHit, 1.f - RT_EPSILON) >= 0;
+    }
+
+    //Shading
+    //hitWorld and normalWorld are in world CS, the shading itself happens in the camera CS like in applyLight.
+    //Lights past RT_MAX_LIGHTS are ignored, the shadow rays' visibility flags live on the stack
+    Uint32 shadeHit(const Camera& cam, const Mat3x3& toCamMat, const Vec3& hitWorld, const Vec3& viewDirWorld, int triId,
+        const vector<LightSource>& lights, const Vec3* lightPos, int depth) const {
+        const RTTriangle& tri = tris[triId];
+        Vec3 normalWorld = crossProd(tri.r2 - tri.r1, tri.r3 - tri.r1);
+        if (dotProd(normalWorld, viewDirWorld) > 0) normalWorld = -1.f * normalWorld;
+
+        bool lightVisible[RT_MAX_LIGHTS];
+        int lightNum = min(int(lights.size()), RT_MAX_LIGHTS);
+        Vec3 offsetOrig = hitWorld + normalize(normalWorld) * RT_OFFSET;
+        for (int i = 0; i != lightNum; i++) {
+            lightVisible[i] = !shadows or !occluded(offsetOrig, lights[i].r - offsetOrig);
+        }
+
+        Uint32 color = shadePixel(toCamMat * (hitWorld - cam.eye), toCamMat * viewDirWorld, toCamMat * normalWorld,
+            tri.r, tri.g, tri.b, lightPos, lights.data(), lightNum, lightVisible);
+        if (depth == 0 or reflectivity <= 0.f) return color;
+
+        //One mirror bounce blended in
+        Vec3 reflDir = viewDirWorld - 2.f * viewDirWorld.projOn(normalWorld);
+        float tRefl;
+        int reflTri = traceRay(offsetOrig, reflDir, tRefl);
+        if (reflTri < 0) return color;
+        Uint32 reflColor = shadeHit(cam, toCamMat, offsetOrig + reflDir * tRefl, reflDir, reflTri, lights, lightPos, depth - 1);
+
+        float k = reflectivity;
+        return rgbToHex(int((1.f - k) * hexToRed(color) + k * hexToRed(reflColor)),
+            int((1.f - k) * hexToGreen(color) + k * hexToGreen(reflColor)),
+            int((1.f - k) * hexToBlue(color) + k * hexToBlue(reflColor)));
+    }
+
+    //Rendering
+    //Pixel rays match the rasterizer: pixel (x, y) looks through (px, py, planeDist) in camera CS
+    void renderTile(const Camera& cam, const vector<LightSource>& lights, const Vec3* lightPos, int tileX, int tileY, Uint32* pixelArr, int rowLen) const {
+        Mat3x3 toCamMat = cam.orientMat.T();
+        int x0 = tileX * RT_TILE_SIZE, y0 = tileY * RT_TILE_SIZE;
+        int x1 = min(WIDTH, x0 + RT_TILE_SIZE), y1 = min(HEIGHT, y0 + RT_TILE_SIZE);
+
+        for (int y = y0; y < y1; y += 2) {
+            for (int x = x0; x < x1; x += 2) {
+                Vec3 dirs[4];
+                for (int k = 0; k != 4; k++) {
+                    float px = (min(x + (k & 1), WIDTH - 1) - 0.5f * WIDTH) * cam.pixelSize;
+                    float py = (min(y + (k >> 1), HEIGHT - 1) - 0.5f * HEIGHT) * cam.pixelSize;
+                    dirs[k] = cam.orientMat * Vec3(px, py, cam.planeDist);
+                }
+                float tHit[4];
+                int triHit[4];
+                tracePacket(cam.eye, dirs, tHit, triHit);
+
+                for (int k = 0; k != 4; k++) {
+                    int px = x + (k & 1), py = y + (k >> 1);
+                    if (px >= x1 or py >= y1) continue;
+                    pixelArr[py * rowLen + px] = triHit[k] < 0 ? 0x0 :
+                        shadeHit(cam, toCamMat, cam.eye + dirs[k] * tHit[k], dirs[k], triHit[k], lights, lightPos, 1);
+                }
+            }
+        }
+    }
+    struct RenderJob {
+        const RayTracer* tracer;
+        const Camera* cam;
+        const vector<LightSource>* lights;
+        const Vec3* lightPos;
+        Uint32* pixelArr;
+        int rowLen, tilesX, tilesY;
+        atomic<int> nextTile{ 0 };
+    };
+    static void renderJob(void* arg) {
+        RenderJob& job = *static_cast<RenderJob*>(arg);
+        for (int tile = job.nextTile++; tile < job.tilesX * job.tilesY; tile = job.nextTile++) {
+            job.tracer->renderTile(*job.cam, *job.lights, job.lightPos, tile % job.tilesX, tile / job.tilesX, job.pixelArr, job.rowLen);
+        }
+    }
+    void render(const Camera& cam, const vector<LightSource>& lights, Uint32* pixelArr, int rowLen, int threadNum = 0) const {
+        Vec3 lightPos[RT_MAX_LIGHTS]; //only these are traced
+        Mat3x3 toCamMat = cam.orientMat.T();
+        for (int i = 0; i != min(int(lights.size()), RT_MAX_LIGHTS); i++) lightPos[i] = toCamMat * (lights[i].r - cam.eye);
+
+        RenderJob job;
+        job.tracer = this;
+        job.cam = &cam;
+        job.lights = &lights;
+        job.lightPos = lightPos;
+        job.pixelArr = pixelArr;
+        job.rowLen = rowLen;
+        job.tilesX = (WIDTH + RT_TILE_SIZE - 1) / RT_TILE_SIZE;
+        job.tilesY = (HEIGHT + RT_TILE_SIZE - 1) / RT_TILE_SIZE;
+        if (threadNum <= 0) threadNum = max(1u, thread::hardware_concurrency());
+        pool.run(renderJob, &job, threadNum);
+    }
+    void render(const Camera& cam, const vector<LightSource>& lights, SDL_Texture* texture) const {
+        void* pixelsPtr; int byteRowLen;
+        SDL_LockTexture(texture, NULL, &pixelsPtr, &byteRowLen);
+        render(cam, lights, static_cast<Uint32*>(pixelsPtr), byteRowLen / sizeof(Uint32));
+        SDL_UnlockTexture(texture);
+    }
+};
@@ -2,12 +2,43 @@
 
 #include <vector>
 #include "polygon.h"
+#include "mesh.h"
+
+//Child shape
+//A shared mesh placed in a compound body: mesh space to body space is orient, then pos
+struct ChildShape {
+    int meshId = -1;
+    float density = 0.f;
+    Vec3 pos = Vec3();      //centre of mass of the mesh in body space
+    Mat3x3 orient = IdMat;
+    bool colorOverride = false;
+    int r = 255, g = 255, b = 255;
+};
+
+//Shape piece
+//Polygons of a body sharing one transform to body space, iterated by reference
+struct ShapePiece {
+    const vector<Polygon>* polys;
+    Mat3x3 orient;
+    Vec3 pos;
+    bool colorOverride;
+    int r, g, b;
+};
+
+struct RigidBody;
+RigidBody createInstance(int meshId, float density);
 
 //Rigid body
 struct RigidBody {
-    int polyNum = 0;
+    int polyNum = 0;  //over all pieces
     vector<Polygon> polys;
 
+    int meshId = -1;             //handle into meshRegistry; when set the body is an instance and polys stays empty
+    vector<ChildShape> children; //when not empty the body is a compound of these, polys stays empty and meshId -1
+    int shapeVersion = 0;        //bumped whenever the geometry changes, so caches built from it know to rebuild
+    bool colorOverride = false;  //instance colour replacing the mesh's polygon colours
+    int r = 255, g = 255, b = 255;
+
     float volume = 0.f;
     float mass = 0.f;
 
@@ -19,24 +50,172 @@ struct RigidBody {
     Mat3x3 invInertiaTensor = Mat3x3();
     Mat3x3 orientMat = IdMat;
 
+    bool isStatic = false;    //immobile geometry, lit by baked static lights
+    bool sleeping = false;    //at rest, skipped by PhysicsWorld until woken
+    float sleepTimer = 0.f;   //time spent below the sleep energy thresholds
+    float boundRadius = -1.f; //bounding sphere about cmPos, computed on first use by boundingRadius()
 
     RigidBody() {}
 
+    //A body owning its polygons or an instance is one piece in body space, a compound has a piece per child
+    int pieceNum() const {
+        return children.empty() ? 1 : children.size();
+    }
+    ShapePiece shapePiece(int k) const {
+        if (children.empty()) return { meshId < 0 ? &polys : &meshRegistry[meshId].polys, IdMat, Vec3(), colorOverride, r, g, b };
+        const ChildShape& child = children[k];
+        return { &meshRegistry[child.meshId].polys, child.orient, child.pos, child.colorOverride, child.r, child.g, child.b };
+    }
+    void setColor(int red, int green, int blue) {
+        colorOverride = true;
+        r = red;
+        g = green;
+        b = blue;
+    }
+
     void addPoly(Vec3 r1, Vec3 r2, Vec3 r3, int r = 255, int g = 255, int b = 255) {
         polys.push_back(Polygon(r1, r2, r3, r, g, b));
         polyNum++;
+        shapeVersion++;
     }
-    void colorPoly(int id, int r, int g, int b) {
+    void colorPoly(int id, int r, int g, int b) { //bodies owning their polygons only, see setColor for instances
         polys[id].r = r;
         polys[id].g = g;
         polys[id].b = b;
     }
-    void scale(float k) {
+    void scale(float k) { //bodies owning their polygons only
         for (int i = 0; i != polyNum; i++) {
             polys[i].r1 *= k;
             polys[i].r2 *= k;
             polys[i].r3 *= k;
         }
+        boundRadius = -1.f;
+        shapeVersion++;
+    }
+    float boundingRadius() { //rotation keeps distances to cmPos, so the body-space maximum holds in any orientation
+        if (boundRadius < 0.f) {
+            boundRadius = 0.f;
+            for (int k = 0; k != pieceNum(); k++) {
+                ShapePiece piece = shapePiece(k);
+                const vector<Polygon>& shape = *piece.polys;
+                for (int i = 0; i != shape.size(); i++) {
+                    boundRadius = max(boundRadius, max(mod(piece.orient * shape[i].r1 + piece.pos),
+                        max(mod(piece.orient * shape[i].r2 + piece.pos), mod(piece.orient * shape[i].r3 + piece.pos))));
+                }
+            }
+        }
+        return boundRadius;
+    }
+
+    Vec3 angularVelocity() const { //from angMom; the angVel member is only refreshed by the integrator
+        return orientMat * invInertiaTensor * orientMat.T() * angMom;
+    }
+
+    //Compound bodies
+    //Attaching adds the momentum the child has moving with the body's velocity field, so the body keeps its angular
+    //velocity; detaching splits momentum between the two. Mass properties come from the meshes' cached unit-density values, so both are O(children) with
+    //no polygon work and no copies of the meshes. A body with a shape of its own keeps it as its first child.
+    //Returns false, leaving the body unchanged, if childMesh is not a mesh handle or the body's own polygons enclose no volume
+    bool attachChild(int childMesh, float density, const Vec3& worldPos, const Mat3x3& worldOrient = IdMat) { //worldPos of the mesh's centre of mass
+        if (childMesh < 0 or childMesh >= meshRegistry.size()) return false;
+        if (children.empty() and (meshId >= 0 or !polys.empty())) {
+            ChildShape own;
+            own.meshId = meshId >= 0 ? meshId : meshRegistry.add(polys);
+            if (own.meshId < 0) return false;
+            own.density = mass / volume;
+            own.pos = meshId >= 0 ? Vec3() : meshRegistry[own.meshId].cm; //owned polygons are recentred by the registry
+            own.colorOverride = colorOverride;
+            own.r = r;
+            own.g = g;
+            own.b = b;
+            children.push_back(own);
+        }
+        ChildShape child;
+        child.meshId = childMesh;
+        child.density = density;
+        child.pos = orientMat.T() * (worldPos - cmPos);
+        child.orient = orientMat.T() * worldOrient;
+        children.push_back(child);
+
+        const Mesh& mesh = meshRegistry[childMesh];
+        Vec3 omega = angularVelocity();
+        Vec3 partVel = cmVel + crossProd(omega, worldPos - cmPos);
+        Vec3 partMom = density * mesh.volume * partVel;
+        Vec3 partAngMom = worldOrient * (density * mesh.unitInertiaTensor) * worldOrient.T() * omega + crossProd(worldPos - cmPos, partMom);
+        Vec3 mom = mass * cmVel + partMom;
+        Vec3 oldCm = cmPos;
+        combineChildren();
+        cmVel = mom / mass;
+        angMom = angMom + partAngMom - crossProd(cmPos - oldCm, mom); //about the new centre of mass
+        angVel = angularVelocity();
+        return true;
+    }
+    RigidBody detachChild(int k) { //returns the child as an instance body moving as it did in the compound
+        const ChildShape child = children[k];
+        children.erase(children.begin() + k);
+        Vec3 omega = angularVelocity();
+
+        RigidBody part = createInstance(child.meshId, child.density);
+        part.cmPos = orientMat * child.pos + cmPos;
+        part.orientMat = orientMat * child.orient;
+        part.cmVel = cmVel + crossProd(omega, part.cmPos - cmPos);
+        part.angMom = (part.orientMat * part.invInertiaTensor * part.orientMat.T()).inv() * omega;
+        part.angVel = omega;
+        if (child.colorOverride) part.setColor(child.r, child.g, child.b);
+
+        Vec3 partMom = part.mass * part.cmVel;
+        Vec3 partAngMom = part.angMom + crossProd(part.cmPos - cmPos, partMom);
+        if (children.empty()) {
+            int version = shapeVersion;
+            *this = RigidBody();
+            shapeVersion = version + 1;
+        }
+        else {
+            Vec3 mom = mass * cmVel - partMom;
+            Vec3 oldCm = cmPos;
+            combineChildren();
+            cmVel = mom / mass;
+            angMom = angMom - partAngMom - crossProd(cmPos - oldCm, mom); //about the new centre of mass
+            angVel = angularVelocity();
+        }
+        return part;
+    }
+    void colorChild(int k, int red, int green, int blue) {
+        children[k].colorOverride = true;
+        children[k].r = red;
+        children[k].g = green;
+        children[k].b = blue;
+    }
+    void combineChildren() { //mass properties from the children, recentring them on the combined centre of mass
+        float newMass = 0.f;
+        Vec3 cm = Vec3();
+        volume = 0.f;
+        polyNum = 0;
+        for (int k = 0; k != children.size(); k++) {
+            const Mesh& mesh = meshRegistry[children[k].meshId];
+            float childMass = children[k].density * mesh.volume;
+            newMass += childMass;
+            volume += mesh.volume;
+            cm += childMass * children[k].pos;
+            polyNum += mesh.polys.size();
+        }
+        cm = cm / newMass;
+
+        Mat3x3 inertiaTensor = Mat3x3();
+        for (int k = 0; k != children.size(); k++) {
+            ChildShape& child = children[k];
+            const Mesh& mesh = meshRegistry[child.meshId];
+            child.pos -= cm;
+            inertiaTensor += TensorFromCMToAny(child.orient * (child.density * mesh.unitInertiaTensor) * child.orient.T(), child.pos, child.density * mesh.volume);
+        }
+        cmPos += orientMat * cm;
+        mass = newMass;
+        invInertiaTensor = inertiaTensor.inv();
+        angVel = angularVelocity();
+        meshId = -1;
+        polys.clear();
+        boundRadius = -1.f;
+        shapeVersion++;
     }
 
     void bodyMove(const Vec3& displVec) {
@@ -46,11 +225,22 @@ struct RigidBody {
         orientMat = rotMat * orientMat;
     }
 
+    void wake() {
+        sleeping = false;
+        sleepTimer = 0.f;
+    }
+    void applyImpulse(const Vec3& impulse, const Vec3& point) { //point in world CS, wakes the body
+        cmVel += impulse / mass;
+        angMom += crossProd(point - cmPos, impulse);
+        wake();
+    }
+
     void integrator(float dt) {
-        angVel = orientMat * invInertiaTensor * orientMat.T() * angMom;
+        angVel = angularVelocity();
 
         bodyMove(cmVel * dt);
-        bodyRotAround(createRotMat(angVel, mod(angVel) * dt), cmPos);
+        float angSpeed = mod(angVel);
+        if (angSpeed > 0.f) bodyRotAround(createRotMat(angVel, angSpeed * dt), cmPos); //no axis to normalize when not spinning
     }
 };
 RigidBody glueTogether(const RigidBody& b1, const RigidBody& b2) {
@@ -65,13 +255,21 @@ RigidBody glueTogether(const RigidBody& b1, const RigidBody& b2) {
     newBody.angMom = Vec3();
 
     newBody.polyNum = b1.polyNum + b2.polyNum;
-    Vec3 displVec1 = b1.cmPos - newBody.cmPos;
-    for (int i = 0; i != b1.polyNum; i++) {
-        newBody.polys.push_back(b1.orientMat * b1.polys[i] + displVec1);
-    }
-    Vec3 displVec2 = b2.cmPos - newBody.cmPos;
-    for (int i = 0; i != b2.polyNum; i++) {
-        newBody.polys.push_back(b2.orientMat * b2.polys[i] + displVec2);
+    newBody.polys.reserve(newBody.polyNum);
+    const RigidBody* parts[2] = { &b1, &b2 };
+    for (int p = 0; p != 2; p++) {
+        const RigidBody& part = *parts[p];
+        Vec3 displVec = part.cmPos - newBody.cmPos;
+        for (int k = 0; k != part.pieceNum(); k++) {
+            ShapePiece piece = part.shapePiece(k);
+            const vector<Polygon>& partPolys = *piece.polys;
+            Mat3x3 pieceOrient = part.orientMat * piece.orient;
+            Vec3 pieceDispl = part.orientMat * piece.pos + displVec;
+            for (int i = 0; i != partPolys.size(); i++) {
+                newBody.polys.push_back(pieceOrient * partPolys[i] + pieceDispl);
+                if (piece.colorOverride) newBody.colorPoly(newBody.polys.size() - 1, piece.r, piece.g, piece.b);
+            }
+        }
     }
 
     Mat3x3 newInertiaTensor = TensorFromCMToAny(b1.orientMat * b1.invInertiaTensor.inv() * b1.orientMat.T(), newBody.cmPos - b1.cmPos, b1.mass) +
@@ -81,7 +279,7 @@ RigidBody glueTogether(const RigidBody& b1, const RigidBody& b2) {
 
     return newBody;
 }
-RigidBody createBodyFromMesh(float density, vector<Polygon> polys) {
+RigidBody createBodyFromMesh(float density, const vector<Polygon>& polys) {
     RigidBody body;
 
     body.polyNum = polys.size();
@@ -90,7 +288,7 @@ RigidBody createBodyFromMesh(float density, vector<Polygon> polys) {
     Mat3x3 bodyInertTen = Mat3x3();
 
     for (int i = 0; i != body.polyNum; i++) {
-        Polygon poly = polys[i];
+        const Polygon& poly = polys[i];
         float vol = findSignedTetraVolume(poly);
 
         body.volume += vol;
@@ -108,6 +306,7 @@ RigidBody createBodyFromMesh(float density, vector<Polygon> polys) {
 
 RigidBody createCuboid(float dens, float x, float y, float z) {
     RigidBody cuboid;
+    cuboid.polys.reserve(12);
 
     Vec3 v1(x / 2, y / 2, z / 2);
     Vec3 v2(x / 2, y / 2, -z / 2);
@@ -153,8 +352,9 @@ RigidBody createCuboid(float dens, float x, float y, float z) {
 
     return cuboid;
 }
-RigidBody createIcosahedron(float dens, float icosR) {
+vector<Polygon> icosahedronPolys(float icosR) {
     vector<Polygon> polygons;
+    polygons.reserve(20);
     float phi = 0.5f * (1 + sqrt(5));
 
     Vec3 v1(phi * icosR, icosR, 0);
@@ -195,8 +395,62 @@ RigidBody createIcosahedron(float dens, float icosR) {
         makeRightHand(&polygons[i]);
     }
 
-    RigidBody icosahedron = createBodyFromMesh(dens, polygons);
+    return polygons;
+}
+RigidBody createIcosahedron(float dens, float icosR) {
+    RigidBody icosahedron = createBodyFromMesh(dens, icosahedronPolys(icosR));
 
     return icosahedron;
 }
+RigidBody createInstance(int meshId, float density) { //body referencing a shared mesh, placed where the source polygons were
+    const Mesh& mesh = meshRegistry[meshId];
+    RigidBody body;
+
+    body.meshId = meshId;
+    body.polyNum = mesh.polys.size();
+    body.volume = mesh.volume;
+    body.mass = density * mesh.volume;
+    body.cmPos = mesh.cm;
+    body.invInertiaTensor = (density * mesh.unitInertiaTensor).inv();
+
+    return body;
+}
+
+//Body pool
+//Fixed-capacity storage for bodies, so adding and removing bodies while the world runs reuses slots
+//instead of reallocating the body array (which would also invalidate pointers into it).
+struct BodyPool {
+    vector<RigidBody> bodies;
+    vector<bool> alive;
+    vector<int> freeIds;
+
+    explicit BodyPool(int capacity) {
+        bodies.resize(capacity);
+        alive.resize(capacity, false);
+        freeIds.reserve(capacity);
+        for (int i = capacity - 1; i >= 0; i--) freeIds.push_back(i);
+    }
+
+    int create(const RigidBody& body) { //returns -1 when the pool is full
+        if (freeIds.empty()) return -1;
+        int id = freeIds.back();
+        freeIds.pop_back();
+        int version = bodies[id].shapeVersion;
+        bodies[id] = body;
+        bodies[id].shapeVersion = version + 1; //a new shape for whatever cached the slot's previous one
+        alive[id] = true;
+        return id;
+    }
+    void destroy(int id) {
+        if (!alive[id]) return;
+        alive[id] = false;
+        freeIds.push_back(id);
+    }
+    RigidBody& operator[](int id) {
+        return bodies[id];
+    }
+    int capacity() const {
+        return bodies.size();
+    }
+};
 //RigidBody createHammer(float dens, )
\ No newline at end of file
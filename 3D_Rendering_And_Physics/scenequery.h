@@ -0,0 +1,658 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "mesh.h"
+#include "rigidbody.h"
+#include "collision.h"
+#include "raytracer.h"
+
+//Scene queries
+//Ray casts, sphere overlaps and closest points against the bodies of a pool. A dynamic AABB tree over the bodies
+//finds candidates, then each candidate is tested through a triangle hierarchy of its shape built in body space, so
+//moving bodies only ever move their leaf in the tree and never rebuild a triangle hierarchy. Meshes share one
+//hierarchy between all their instances and compound children.
+
+struct RayQuery {
+    Vec3 orig, dir; //dir need not be unit length, hits are reported in units of it
+    float tMax = numeric_limits<float>::max();
+};
+struct RayHit {
+    float t = numeric_limits<float>::max();
+    int body = -1, piece = -1, poly = -1; //poly indexes the piece's polygons, body -1 when nothing was hit
+    Vec3 point, normal;                   //world CS, normal unit length and facing the ray
+};
+struct SphereQuery {
+    Vec3 centre;
+    float radius;
+};
+struct SphereOverlap {
+    int count = 0;                   //bodies touching or containing the sphere
+    int bodies[SCENE_MAX_OVERLAPS];  //the first SCENE_MAX_OVERLAPS of them
+};
+struct PointQuery {
+    Vec3 point;
+    float maxDist = numeric_limits<float>::max();
+};
+struct PointHit {
+    float dist = numeric_limits<float>::max();
+    int body = -1, piece = -1, poly = -1; //body -1 when no surface is within maxDist
+    Vec3 point;                           //closest surface point, world CS
+};
+
+inline float boxDistSqr(const Vec3& p, const Vec3& bmin, const Vec3& bmax) {
+    float dx = max(0.f, max(bmin.x - p.x, p.x - bmax.x));
+    float dy = max(0.f, max(bmin.y - p.y, p.y - bmax.y));
+    float dz = max(0.f, max(bmin.z - p.z, p.z - bmax.z));
+    return dx * dx + dy * dy + dz * dz;
+}
+inline float rayEntersBox(const Vec3& orig, const Vec3& invDir, const Vec3& bmin, const Vec3& bmax, float tMax) { //entry parameter, tMax if missed
+    float tx1 = (bmin.x - orig.x) * invDir.x, tx2 = (bmax.x - orig.x) * invDir.x;
+    float ty1 = (bmin.y - orig.y) * invDir.y, ty2 = (bmax.y - orig.y) * invDir.y;
+    float tz1 = (bmin.z - orig.z) * invDir.z, tz2 = (bmax.z - orig.z) * invDir.z;
+    float tNear = max({ min(tx1, tx2), min(ty1, ty2), min(tz1, tz2) });
+    float tFar = min({ max(tx1, tx2), max(ty1, ty2), max(tz1, tz2), tMax });
+    return tNear <= tFar and tFar >= 0.f ? max(0.f, tNear) : tMax;
+}
+inline bool rayHitsBox(const Vec3& orig, const Vec3& invDir, const Vec3& bmin, const Vec3& bmax, float tMax) {
+    return rayEntersBox(orig, invDir, bmin, bmax, tMax) < tMax;
+}
+//Depth-first walks pushing both children hold at most height + 1 nodes. Up to SCENE_STACK_SIZE they live in the
+//caller's array, a taller tree gets them from spill
+template <typename T>
+inline T* walkStack(T* local, vector<T>& spill, int height) {
+    if (height < SCENE_STACK_SIZE) return local;
+    spill.resize(height + 1);
+    return spill.data();
+}
+
+//Shape hierarchy
+//Triangles of one shape in its own space, split at the centroid median of the longest axis. Vertices are copied in
+//leaf order so a leaf's triangles are contiguous
+struct ShapeBVH {
+    vector<BVHNode> nodes;
+    vector<Vec3> verts;   //3 per triangle
+    vector<int> polyIds;  //source polygon of each triangle
+    int version = -1;     //shapeVersion it was built from, for bodies owning their polygons
+    int depth = 0;        //deepest level, sizes the walks' stacks
+
+    void build(const vector<Polygon>& polys) {
+        int n = polys.size();
+        vector<int> ids(n);
+        vector<Vec3> centres(n);
+        for (int i = 0; i != n; i++) {
+            ids[i] = i;
+            centres[i] = (polys[i].r1 + polys[i].r2 + polys[i].r3) / 3.f;
+        }
+        nodes.clear();
+        nodes.reserve(2 * n + 1);
+        BVHNode root;
+        root.first = 0;
+        root.count = n;
+        nodes.push_back(root);
+        depth = 0;
+        if (n) subdivide(0, 0, polys, ids, centres);
+
+        verts.resize(3 * n);
+        polyIds = ids;
+        for (int i = 0; i != n; i++) {
+            verts[3 * i] = polys[ids[i]].r1;
+            verts[3 * i + 1] = polys[ids[i]].r2;
+            verts[3 * i + 2] = polys[ids[i]].r3;
+        }
+    }
+    void subdivide(int nodeId, int level, const vector<Polygon>& polys, vector<int>& ids, const vector<Vec3>& centres) {
+        depth = max(depth, level);
+        BVHNode& node = nodes[nodeId];
+        node.bmin = Vec3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+        node.bmax = -node.bmin;
+        Vec3 cmin(node.bmin), cmax(node.bmax);
+        for (int i = node.first; i != node.first + node.count; i++) {
+            const Polygon& poly = polys[ids[i]];
+            growBounds(node.bmin, node.bmax, poly.r1);
+            growBounds(node.bmin, node.bmax, poly.r2);
+            growBounds(node.bmin, node.bmax, poly.r3);
+            growBounds(cmin, cmax, centres[ids[i]]);
+        }
+        if (node.count <= SCENE_LEAF_SIZE) return;
+
+        Vec3 extent = cmax - cmin;
+        int axis = extent.x >= extent.y and extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        int first = node.first, count = node.count, mid = first + count / 2;
+        nth_element(ids.begin() + first, ids.begin() + mid, ids.begin() + first + count, [&](int a, int b) {
+            return axisOf(centres[a], axis) < axisOf(centres[b], axis);
+        });
+
+        int leftId = nodes.size();
+        BVHNode left, right;
+        left.first = first;
+        left.count = mid - first;
+        right.first = mid;
+        right.count = first + count - mid;
+        nodes.push_back(left);
+        nodes.push_back(right);
+        nodes[nodeId].first = leftId;
+        nodes[nodeId].count = 0;
+
+        subdivide(leftId, level + 1, polys, ids, centres);
+        subdivide(leftId + 1, level + 1, polys, ids, centres);
+    }
+
+    //Queries, all in shape space
+    int raycast(const Vec3& orig, const Vec3& dir, float& tHit) const { //closest triangle hit before tHit, -1 when none
+        int triHit = -1;
+        Vec3 invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        int local[SCENE_STACK_SIZE], stackSize = 0;
+        vector<int> spill;
+        int* stack = walkStack(local, spill, depth);
+        stack[stackSize++] = 0;
+        while (stackSize) {
+            const BVHNode& node = nodes[stack[--stackSize]];
+            if (!rayHitsBox(orig, invDir, node.bmin, node.bmax, tHit)) continue;
+            if (node.count) {
+                for (int i = node.first; i != node.first + node.count; i++) {
+                    float t = intersectTriangle(orig, dir, verts[3 * i], verts[3 * i + 1], verts[3 * i + 2], tHit);
+                    if (t < tHit) {
+                        tHit = t;
+                        triHit = i;
+                    }
+                }
+                continue;
+            }
+            stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+        }
+        return triHit;
+    }
+    int closest(const Vec3& p, float& distSqr, Vec3& point) const { //closest triangle nearer than sqrt(distSqr), -1 when none
+        int triHit = -1;
+        int local[SCENE_STACK_SIZE], stackSize = 0;
+        vector<int> spill;
+        int* stack = walkStack(local, spill, depth);
+        stack[stackSize++] = 0;
+        while (stackSize) {
+            const BVHNode& node = nodes[stack[--stackSize]];
+            if (boxDistSqr(p, node.bmin, node.bmax) >= distSqr) continue;
+            if (node.count) {
+                for (int i = node.first; i != node.first + node.count; i++) {
+                    Vec3 c = closestOnTriangle(p, verts[3 * i], verts[3 * i + 1], verts[3 * i + 2]);
+                    float d = modSqr(c - p);
+                    if (d < distSqr) {
+                        distSqr = d;
+                        point = c;
+                        triHit = i;
+                    }
+                }
+                continue;
+            }
+            //Nearer child on top, so it usually shrinks distSqr before the other one is tested
+            const BVHNode& left = nodes[node.first];
+            const BVHNode& right = nodes[node.first + 1];
+            bool leftNearer = boxDistSqr(p, left.bmin, left.bmax) <= boxDistSqr(p, right.bmin, right.bmax);
+            stack[stackSize++] = leftNearer ? node.first + 1 : node.first;
+            stack[stackSize++] = leftNearer ? node.first : node.first + 1;
+        }
+        return triHit;
+    }
+    bool contains(const Vec3& p) const { //inside the closed surface: odd number of crossings along a fixed skew ray
+        const Vec3 dir(0.5773f, 0.5779f, 0.5769f);
+        Vec3 invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        int crossings = 0;
+        int local[SCENE_STACK_SIZE], stackSize = 0;
+        vector<int> spill;
+        int* stack = walkStack(local, spill, depth);
+        stack[stackSize++] = 0;
+        while (stackSize) {
+            const BVHNode& node = nodes[stack[--stackSize]];
+            if (!rayHitsBox(p, invDir, node.bmin, node.bmax, numeric_limits<float>::max())) continue;
+            if (node.count) {
+                for (int i = node.first; i != node.first + node.count; i++) {
+                    crossings += intersectTriangle(p, dir, verts[3 * i], verts[3 * i + 1], verts[3 * i + 2], numeric_limits<float>::max()) <
+                        numeric_limits<float>::max();
+                }
+                continue;
+            }
+            stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+        }
+        return crossings % 2;
+    }
+};
+
+//Body tree
+//Dynamic AABB tree (as in Box2D) over enlarged body boxes: a body moving inside its enlarged box leaves the tree
+//alone, one leaving it is removed and reinserted where it adds the least surface area, with AVL rotations keeping
+//the tree balanced
+struct TreeNode {
+    Vec3 bmin, bmax;
+    int parent = -1;
+    int child1 = -1, child2 = -1; //child1 -1 for leaves
+    int height = 0;               //0 for leaves
+    int body = -1;
+};
+
+struct BodyTree {
+    vector<TreeNode> nodes;
+    vector<int> freeNodes;
+    int root = -1;
+
+    int allocNode() {
+        if (freeNodes.empty()) {
+            nodes.push_back(TreeNode());
+            return nodes.size() - 1;
+        }
+        int id = freeNodes.back();
+        freeNodes.pop_back();
+        nodes[id] = TreeNode();
+        return id;
+    }
+    void freeNode(int id) {
+        nodes[id].height = -1;
+        freeNodes.push_back(id);
+    }
+    bool isLeaf(int id) const {
+        return nodes[id].child1 < 0;
+    }
+    void fitNode(int id) { //bounds and height from the children
+        TreeNode& node = nodes[id];
+        const TreeNode& c1 = nodes[node.child1];
+        const TreeNode& c2 = nodes[node.child2];
+        node.bmin = c1.bmin;
+        node.bmax = c1.bmax;
+        growBounds(node.bmin, node.bmax, c2.bmin);
+        growBounds(node.bmin, node.bmax, c2.bmax);
+        node.height = 1 + max(c1.height, c2.height);
+    }
+
+    int insert(int body, const Vec3& bmin, const Vec3& bmax) { //returns the leaf
+        int leaf = allocNode();
+        nodes[leaf].bmin = bmin;
+        nodes[leaf].bmax = bmax;
+        nodes[leaf].body = body;
+        insertLeaf(leaf);
+        return leaf;
+    }
+    void remove(int leaf) {
+        removeLeaf(leaf);
+        freeNode(leaf);
+    }
+    void move(int leaf, const Vec3& bmin, const Vec3& bmax) {
+        removeLeaf(leaf);
+        nodes[leaf].bmin = bmin;
+        nodes[leaf].bmax = bmax;
+        insertLeaf(leaf);
+    }
+
+    void insertLeaf(int leaf) {
+        if (root < 0) {
+            root = leaf;
+            nodes[leaf].parent = -1;
+            return;
+        }
+
+        //Descend to the sibling where the leaf costs the least: the new parent's area plus the area added to the
+        //ancestors on the way down
+        Vec3 lmin = nodes[leaf].bmin, lmax = nodes[leaf].bmax;
+        int index = root;
+        while (!isLeaf(index)) {
+            const TreeNode& node = nodes[index];
+            float area = boundsArea(node.bmin, node.bmax);
+            Vec3 cmin = node.bmin, cmax = node.bmax;
+            growBounds(cmin, cmax, lmin);
+            growBounds(cmin, cmax, lmax);
+            float combinedArea = boundsArea(cmin, cmax);
+            float cost = 2.f * combinedArea;
+            float inheritanceCost = 2.f * (combinedArea - area);
+
+            float childCost[2];
+            for (int c = 0; c != 2; c++) {
+                const TreeNode& child = nodes[c ? node.child2 : node.child1];
+                Vec3 umin = child.bmin, umax = child.bmax;
+                growBounds(umin, umax, lmin);
+                growBounds(umin, umax, lmax);
+                childCost[c] = boundsArea(umin, umax) + inheritanceCost;
+                if (child.child1 >= 0) childCost[c] -= boundsArea(child.bmin, child.bmax);
+            }
+            if (cost < childCost[0] and cost < childCost[1]) break;
+            index = childCost[0] < childCost[1] ? node.child1 : node.child2;
+        }
+
+        int sibling = index;
+        int oldParent = nodes[sibling].parent;
+        int newParent = allocNode();
+        nodes[newParent].parent = oldParent;
+        nodes[newParent].child1 = sibling;
+        nodes[newParent].child2 = leaf;
+        nodes[sibling].parent = newParent;
+        nodes[leaf].parent = newParent;
+        fitNode(newParent);
+        if (oldParent < 0) root = newParent;
+        else if (nodes[oldParent].child1 == sibling) nodes[oldParent].child1 = newParent;
+        else nodes[oldParent].child2 = newParent;
+
+        refitUp(nodes[leaf].parent);
+    }
+    void removeLeaf(int leaf) {
+        if (leaf == root) {
+            root = -1;
+            return;
+        }
+        int parent = nodes[leaf].parent;
+        int grandParent = nodes[parent].parent;
+        int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+        freeNode(parent);
+        nodes[sibling].parent = grandParent;
+        if (grandParent < 0) {
+            root = sibling;
+            return;
+        }
+        if (nodes[grandParent].child1 == parent) nodes[grandParent].child1 = sibling;
+        else nodes[grandParent].child2 = sibling;
+        refitUp(grandParent);
+    }
+    void refitUp(int index) {
+        while (index >= 0) {
+            index = balance(index);
+            fitNode(index);
+            index = nodes[index].parent;
+        }
+    }
+
+    //Rotates the taller grandchild up when the children's heights differ by more than one, returns the subtree's new root
+    int balance(int a) {
+        if (isLeaf(a) or nodes[a].height < 2) return a;
+        int b = nodes[a].child1, c = nodes[a].child2;
+        int diff = nodes[c].height - nodes[b].height;
+        if (diff > 1) return rotateUp(a, c, false);
+        if (diff < -1) return rotateUp(a, b, true);
+        return a;
+    }
+    int rotateUp(int a, int up, bool upIsChild1) {
+        int f = nodes[up].child1, g = nodes[up].child2;
+
+        //up takes a's place, a becomes a child of up
+        nodes[up].child1 = a;
+        nodes[up].parent = nodes[a].parent;
+        nodes[a].parent = up;
+        int parent = nodes[up].parent;
+        if (parent < 0) root = up;
+        else if (nodes[parent].child1 == a) nodes[parent].child1 = up;
+        else nodes[parent].child2 = up;
+
+        //The taller grandchild stays with up, the shorter one replaces up under a
+        int keep = nodes[f].height > nodes[g].height ? f : g;
+        int give = keep == f ? g : f;
+        nodes[up].child2 = keep;
+        if (upIsChild1) nodes[a].child1 = give;
+        else nodes[a].child2 = give;
+        nodes[give].parent = a;
+
+        fitNode(a);
+        fitNode(up);
+        return up;
+    }
+    int height() const {
+        return root < 0 ? 0 : nodes[root].height;
+    }
+};
+
+//Scene query
+struct SceneQuery {
+    BodyPool& bodies;
+    vector<ShapeBVH> meshBVHs;  //per meshRegistry entry, built when first used
+    vector<ShapeBVH> ownedBVHs; //per slot, for bodies owning their polygons
+    BodyTree tree;
+    vector<int> leaves;         //per slot, leaf in the tree or -1
+    int movedNum = 0;           //bodies reinserted into the tree by the last update
+
+    explicit SceneQuery(BodyPool& bodies) : bodies(bodies) {
+        ownedBVHs.resize(bodies.capacity());
+        leaves.resize(bodies.capacity(), -1);
+    }
+
+    const ShapeBVH& pieceBVH(int id, int k) const {
+        const RigidBody& body = bodies[id];
+        if (!body.children.empty()) return meshBVHs[body.children[k].meshId];
+        return body.meshId < 0 ? ownedBVHs[id] : meshBVHs[body.meshId];
+    }
+    void piecePose(const RigidBody& body, int k, Mat3x3& orient, Vec3& pos) const { //piece space to world CS
+        ShapePiece piece = body.shapePiece(k);
+        orient = body.orientMat * piece.orient;
+        pos = body.orientMat * piece.pos + body.cmPos;
+    }
+
+    //Brings the tree and the shape hierarchies up to date with the pool, call whenever bodies moved or changed
+    //before querying. Queries themselves only read, so batches run in parallel
+    void update() {
+        if (meshBVHs.size() < meshRegistry.size()) meshBVHs.resize(meshRegistry.size());
+        movedNum = 0;
+        for (int id = 0; id != bodies.capacity(); id++) {
+            if (!bodies.alive[id]) {
+                if (leaves[id] >= 0) tree.remove(leaves[id]);
+                leaves[id] = -1;
+                continue;
+            }
+            RigidBody& body = bodies[id];
+            if (body.children.empty() and body.meshId < 0 and ownedBVHs[id].version != body.shapeVersion) {
+                ownedBVHs[id].build(body.polys);
+                ownedBVHs[id].version = body.shapeVersion;
+            }
+
+            //Tight world box from the pieces' hierarchy roots
+            Vec3 bmin(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max()), bmax(-bmin);
+            for (int k = 0; k != body.pieceNum(); k++) {
+                int meshId = body.children.empty() ? body.meshId : body.children[k].meshId;
+                if (meshId >= 0 and meshBVHs[meshId].version < 0) {
+                    meshBVHs[meshId].build(meshRegistry[meshId].polys);
+                    meshBVHs[meshId].version = 0;
+                }
+                const ShapeBVH& bvh = pieceBVH(id, k);
+                if (bvh.polyIds.empty()) continue;
+                Mat3x3 orient;
+                Vec3 pos;
+                piecePose(body, k, orient, pos);
+                Vec3 centre = orient * ((bvh.nodes[0].bmin + bvh.nodes[0].bmax) / 2.f) + pos;
+                Vec3 half = (bvh.nodes[0].bmax - bvh.nodes[0].bmin) / 2.f;
+                Vec3 extent(fabs(orient.a1) * half.x + fabs(orient.a2) * half.y + fabs(orient.a3) * half.z,
+                    fabs(orient.b1) * half.x + fabs(orient.b2) * half.y + fabs(orient.b3) * half.z,
+                    fabs(orient.c1) * half.x + fabs(orient.c2) * half.y + fabs(orient.c3) * half.z);
+                growBounds(bmin, bmax, centre - extent);
+                growBounds(bmin, bmax, centre + extent);
+            }
+            if (bmin.x > bmax.x) bmin = bmax = body.cmPos; //no triangles, keep a point so the slot stays tracked
+
+            int leaf = leaves[id];
+            if (leaf >= 0) {
+                const TreeNode& node = tree.nodes[leaf];
+                if (node.bmin.x <= bmin.x and node.bmin.y <= bmin.y and node.bmin.z <= bmin.z and
+                    node.bmax.x >= bmax.x and node.bmax.y >= bmax.y and node.bmax.z >= bmax.z) continue;
+            }
+
+            //Enlarged by a margin and by the motion expected before the next few updates
+            Vec3 margin(SCENE_TREE_MARGIN, SCENE_TREE_MARGIN, SCENE_TREE_MARGIN);
+            Vec3 motion = body.cmVel * SCENE_TREE_PREDICT;
+            bmin -= margin;
+            bmax += margin;
+            bmin = Vec3(bmin.x + min(0.f, motion.x), bmin.y + min(0.f, motion.y), bmin.z + min(0.f, motion.z));
+            bmax = Vec3(bmax.x + max(0.f, motion.x), bmax.y + max(0.f, motion.y), bmax.z + max(0.f, motion.z));
+            if (leaf >= 0) tree.move(leaf, bmin, bmax);
+            else leaves[id] = tree.insert(id, bmin, bmax);
+            movedNum++;
+        }
+    }
+
+    //Single queries
+    RayHit raycast(const RayQuery& query) const {
+        RayHit hit;
+        hit.t = query.tMax;
+        if (tree.root < 0) return hit;
+        Vec3 invDir(1.f / query.dir.x, 1.f / query.dir.y, 1.f / query.dir.z);
+        if (!rayHitsBox(query.orig, invDir, tree.nodes[tree.root].bmin, tree.nodes[tree.root].bmax, hit.t)) return hit;
+        int local[SCENE_STACK_SIZE], stackSize = 0;
+        float localT[SCENE_STACK_SIZE];
+        vector<int> spill;
+        vector<float> spillT;
+        int* stack = walkStack(local, spill, tree.height());
+        float* stackT = walkStack(localT, spillT, tree.height());
+        stack[stackSize] = tree.root;
+        stackT[stackSize++] = 0.f;
+        while (stackSize) {
+            stackSize--;
+            if (stackT[stackSize] >= hit.t) continue; //entered beyond the closest hit found since it was pushed
+            const TreeNode& node = tree.nodes[stack[stackSize]];
+            if (node.child1 >= 0) {
+                //Children the ray enters, nearer one on top
+                const TreeNode& c1 = tree.nodes[node.child1];
+                const TreeNode& c2 = tree.nodes[node.child2];
+                float t1 = rayEntersBox(query.orig, invDir, c1.bmin, c1.bmax, hit.t);
+                float t2 = rayEntersBox(query.orig, invDir, c2.bmin, c2.bmax, hit.t);
+                int near = node.child1, far = node.child2;
+                if (t2 < t1) {
+                    swap(t1, t2);
+                    swap(near, far);
+                }
+                if (t2 < hit.t) {
+                    stack[stackSize] = far;
+                    stackT[stackSize++] = t2;
+                }
+                if (t1 < hit.t) {
+                    stack[stackSize] = near;
+                    stackT[stackSize++] = t1;
+                }
+                continue;
+            }
+            const RigidBody& body = bodies[node.body];
+            for (int k = 0; k != body.pieceNum(); k++) {
+                const ShapeBVH& bvh = pieceBVH(node.body, k);
+                if (bvh.polyIds.empty()) continue;
+                Mat3x3 orient;
+                Vec3 pos;
+                piecePose(body, k, orient, pos);
+                Mat3x3 toLocal = orient.T();
+                int tri = bvh.raycast(toLocal * (query.orig - pos), toLocal * query.dir, hit.t); //rotation keeps ray parameters
+                if (tri < 0) continue;
+                hit.body = node.body;
+                hit.piece = k;
+                hit.poly = bvh.polyIds[tri];
+                hit.normal = orient * crossProd(bvh.verts[3 * tri + 1] - bvh.verts[3 * tri], bvh.verts[3 * tri + 2] - bvh.verts[3 * tri]);
+            }
+        }
+        if (hit.body >= 0) {
+            hit.point = query.orig + query.dir * hit.t;
+            hit.normal = normalize(hit.normal);
+            if (dotProd(hit.normal, query.dir) > 0.f) hit.normal = -1.f * hit.normal;
+        }
+        return hit;
+    }
+    SphereOverlap sphereOverlap(const SphereQuery& query) const {
+        SphereOverlap overlap;
+        if (tree.root < 0) return overlap;
+        Vec3 r(query.radius, query.radius, query.radius);
+        Vec3 qmin = query.centre - r, qmax = query.centre + r;
+        float radiusSqr = query.radius * query.radius;
+        int local[SCENE_STACK_SIZE], stackSize = 0;
+        vector<int> spill;
+        int* stack = walkStack(local, spill, tree.height());
+        stack[stackSize++] = tree.root;
+        while (stackSize) {
+            const TreeNode& node = tree.nodes[stack[--stackSize]];
+            if (node.bmin.x > qmax.x or node.bmax.x < qmin.x or node.bmin.y > qmax.y or node.bmax.y < qmin.y or
+                node.bmin.z > qmax.z or node.bmax.z < qmin.z) continue;
+            if (node.child1 >= 0) {
+                stack[stackSize++] = node.child2;
+                stack[stackSize++] = node.child1;
+                continue;
+            }
+            const RigidBody& body = bodies[node.body];
+            for (int k = 0; k != body.pieceNum(); k++) {
+                const ShapeBVH& bvh = pieceBVH(node.body, k);
+                if (bvh.polyIds.empty()) continue;
+                Mat3x3 orient;
+                Vec3 pos;
+                piecePose(body, k, orient, pos);
+                Vec3 local = orient.T() * (query.centre - pos);
+                float distSqr = radiusSqr;
+                Vec3 point;
+                if (bvh.closest(local, distSqr, point) >= 0 or bvh.contains(local)) {
+                    if (overlap.count < SCENE_MAX_OVERLAPS) overlap.bodies[overlap.count] = node.body;
+                    overlap.count++;
+                    break;
+                }
+            }
+        }
+        return overlap;
+    }
+    PointHit closestPoint(const PointQuery& query) const {
+        PointHit hit;
+        if (tree.root < 0) return hit;
+        float distSqr = query.maxDist < sqrtf(numeric_limits<float>::max()) ? query.maxDist * query.maxDist : numeric_limits<float>::max();
+        int local[SCENE_STACK_SIZE], stackSize = 0;
+        vector<int> spill;
+        int* stack = walkStack(local, spill, tree.height());
+        stack[stackSize++] = tree.root;
+        while (stackSize) {
+            const TreeNode& node = tree.nodes[stack[--stackSize]];
+            if (boxDistSqr(query.point, node.bmin, node.bmax) >= distSqr) continue;
+            if (node.child1 >= 0) {
+                const TreeNode& c1 = tree.nodes[node.child1];
+                const TreeNode& c2 = tree.nodes[node.child2];
+                bool firstNearer = boxDistSqr(query.point, c1.bmin, c1.bmax) <= boxDistSqr(query.point, c2.bmin, c2.bmax);
+                stack[stackSize++] = firstNearer ? node.child2 : node.child1;
+                stack[stackSize++] = firstNearer ? node.child1 : node.child2;
+                continue;
+            }
+            const RigidBody& body = bodies[node.body];
+            for (int k = 0; k != body.pieceNum(); k++) {
+                const ShapeBVH& bvh = pieceBVH(node.body, k);
+                if (bvh.polyIds.empty()) continue;
+                Mat3x3 orient;
+                Vec3 pos;
+                piecePose(body, k, orient, pos);
+                Vec3 point;
+                int tri = bvh.closest(orient.T() * (query.point - pos), distSqr, point);
+                if (tri < 0) continue;
+                hit.body = node.body;
+                hit.piece = k;
+                hit.poly = bvh.polyIds[tri];
+                hit.point = orient * point + pos;
+            }
+        }
+        if (hit.body >= 0) hit.dist = sqrtf(distSqr);
+        return hit;
+    }
+
+    //Batches, split in chunks of SCENE_QUERY_CHUNK over threadNum threads (all hardware threads by default)
+    template <class Query, class Result, class Run>
+    void runBatch(const Query* queries, Result* results, int n, int threadNum, const Run& run) const {
+        int chunkNum = (n + SCENE_QUERY_CHUNK - 1) / SCENE_QUERY_CHUNK;
+        atomic<int> nextChunk(0);
+        auto worker = [&]() {
+            for (int chunk = nextChunk++; chunk < chunkNum; chunk = nextChunk++) {
+                int last = min(n, (chunk + 1) * SCENE_QUERY_CHUNK);
+                for (int i = chunk * SCENE_QUERY_CHUNK; i != last; i++) results[i] = run(queries[i]);
+            }
+        };
+
+        if (threadNum <= 0) threadNum = max(1u, thread::hardware_concurrency());
+        threadNum = min(threadNum, chunkNum);
+        vector<thread> threads;
+        for (int i = 1; i < threadNum; i++) threads.push_back(thread(worker));
+        worker();
+        for (int i = 0; i != threads.size(); i++) threads[i].join();
+    }
+    void raycast(const RayQuery* queries, RayHit* hits, int n, int threadNum = 0) const {
+        runBatch(queries, hits, n, threadNum, [this](const RayQuery& query) { return raycast(query); });
+    }
+    void sphereOverlap(const SphereQuery* queries, SphereOverlap* overlaps, int n, int threadNum = 0) const {
+        runBatch(queries, overlaps, n, threadNum, [this](const SphereQuery& query) { return sphereOverlap(query); });
+    }
+    void closestPoint(const PointQuery* queries, PointHit* hits, int n, int threadNum = 0) const {
+        runBatch(queries, hits, n, threadNum, [this](const PointQuery& query) { return closestPoint(query); });
+    }
+};
@@ -0,0 +1,534 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "mesh.h"
+#include "rigidbody.h"
+#include "texture.h"
+#include "lightsource.h"
+#include "camera.h"
+#include "physics.h"
+
+//Mapped file
+//A whole file mapped into memory, either an existing one read-only or a new one of a given size for writing
+struct MappedFile {
+    char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        close();
+    }
+
+#ifdef _WIN32
+    bool openRead(const string& path) {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize;
+        if (file == INVALID_HANDLE_VALUE or !GetFileSizeEx(file, &fileSize) or fileSize.QuadPart == 0) return close();
+        size = size_t(fileSize.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return close();
+        data = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        return data ? true : close();
+    }
+    bool create(const string& path, size_t bytes) {
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return close();
+        size = bytes;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(uint64_t(bytes) >> 32), DWORD(bytes), nullptr);
+        if (!mapping) return close();
+        data = (char*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+        return data ? true : close();
+    }
+    bool close() { //always returns false, so failing opens can return close()
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        data = nullptr;
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+        return false;
+    }
+#else
+    bool openRead(const string& path) {
+        fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 or fstat(fd, &st) != 0 or st.st_size == 0) return close();
+        size = size_t(st.st_size);
+        void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED) return close();
+        data = (char*)view;
+        return true;
+    }
+    bool create(const string& path, size_t bytes) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 or ftruncate(fd, off_t(bytes)) != 0) return close();
+        size = bytes;
+        void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (view == MAP_FAILED) return close();
+        data = (char*)view;
+        return true;
+    }
+    bool close() { //always returns false, so failing opens can return close()
+        if (data) munmap(data, size);
+        if (fd >= 0) ::close(fd);
+        data = nullptr;
+        fd = -1;
+        return false;
+    }
+#endif
+};
+
+//Snapshot format
+//Header followed by sections of fixed-layout records, each starting on a SNAPSHOT_ALIGN boundary so a mapped file
+//can be read in place. Polygons and texels are stored exactly as the registries and bodies hold them, so restoring
+//is copying with no per-polygon work. Files are only read back by a build with the same version, byte order and
+//record layout
+enum SnapshotSection {
+    SEC_MESHES,    //MeshRecord
+    SEC_TEXTURES,  //TextureRecord
+    SEC_BODIES,    //BodyRecord per pool slot
+    SEC_SLOTS,     //SlotRecord per pool slot
+    SEC_CHILDREN,  //ChildRecord, of compound bodies
+    SEC_POLYS,     //Polygon, of meshes and of bodies owning theirs
+    SEC_TEXELS,    //Uint32, all mip levels of every texture
+    SEC_FREE_IDS,  //int32_t, BodyPool::freeIds
+    SEC_ORDER,     //int32_t, PhysicsWorld::order
+    SEC_LIGHTS,    //LightSource
+    SEC_VIEW,      //one ViewRecord
+    SEC_NUM
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder; //0x01020304 as written
+    uint32_t layout;    //record sizes, see snapshotLayout
+    uint32_t pad = 0;
+    uint64_t offset[SEC_NUM];
+    uint64_t count[SEC_NUM];
+};
+
+struct MeshRecord {
+    uint64_t polyStart; //in SEC_POLYS
+    int32_t polyNum;
+    float volume;
+    Vec3 cm;
+    Mat3x3 unitInertiaTensor;
+};
+struct TextureRecord {
+    uint64_t texelStart; //in SEC_TEXELS
+    int32_t size, levelNum;
+    int32_t levelOffset[16]; //sizes are at most 2^15, so 16 levels
+};
+struct BodyRecord {
+    uint64_t polyStart;  //in SEC_POLYS, for bodies owning their polygons
+    uint64_t childStart; //in SEC_CHILDREN, for compound bodies
+    int32_t childNum, shapeVersion;
+    int32_t polyNum, meshId;
+    int32_t colorOverride, r, g, b;
+    float volume, mass;
+    Vec3 cmPos, cmVel, angVel, angMom;
+    Mat3x3 invInertiaTensor, orientMat;
+    int32_t isStatic, sleeping;
+    float sleepTimer, boundRadius;
+};
+struct ChildRecord {
+    int32_t meshId;
+    float density;
+    Vec3 pos;
+    Mat3x3 orient;
+    int32_t colorOverride, r, g, b;
+};
+struct SlotRecord { //pool and broadphase state of a slot
+    Vec3 boundMin, boundMax;
+    int32_t sleepIsland;
+    uint8_t alive, inOrder;
+};
+struct ViewRecord { //camera and world settings
+    Vec3 eye;
+    Mat3x3 orientMat;
+    float scale, pixelSize, width, height;
+    int32_t euclideanDepth, gloss;
+    int32_t sleepEnabled, ccdEnabled;
+};
+
+inline uint32_t snapshotLayout() {
+    return uint32_t(sizeof(Polygon) ^ sizeof(MeshRecord) << 5 ^ sizeof(TextureRecord) << 10 ^ sizeof(BodyRecord) << 15 ^
+        sizeof(SlotRecord) << 20 ^ sizeof(LightSource) << 24 ^ sizeof(ViewRecord) << 27 ^ sizeof(ChildRecord) << 3);
+}
+
+//Everything of a body but its polygons, to and from records. rec.childStart must be set, the children go there
+void writeBodyRecord(const RigidBody& body, BodyRecord& rec, ChildRecord* childRecs) {
+    rec.childNum = body.children.size();
+    rec.shapeVersion = body.shapeVersion;
+    rec.polyNum = body.polyNum;
+    rec.meshId = body.meshId;
+    rec.colorOverride = body.colorOverride;
+    rec.r = body.r;
+    rec.g = body.g;
+    rec.b = body.b;
+    rec.volume = body.volume;
+    rec.mass = body.mass;
+    rec.cmPos = body.cmPos;
+    rec.cmVel = body.cmVel;
+    rec.angVel = body.angVel;
+    rec.angMom = body.angMom;
+    rec.invInertiaTensor = body.invInertiaTensor;
+    rec.orientMat = body.orientMat;
+    rec.isStatic = body.isStatic;
+    rec.sleeping = body.sleeping;
+    rec.sleepTimer = body.sleepTimer;
+    rec.boundRadius = body.boundRadius;
+    for (int k = 0; k != rec.childNum; k++) {
+        const ChildShape& child = body.children[k];
+        ChildRecord& childRec = childRecs[rec.childStart + k];
+        childRec.meshId = child.meshId;
+        childRec.density = child.density;
+        childRec.pos = child.pos;
+        childRec.orient = child.orient;
+        childRec.colorOverride = child.colorOverride;
+        childRec.r = child.r;
+        childRec.g = child.g;
+        childRec.b = child.b;
+    }
+}
+void readBodyRecord(const BodyRecord& rec, const ChildRecord* childRecs, RigidBody& body) {
+    body.polyNum = rec.polyNum;
+    body.meshId = rec.meshId;
+    body.children.resize(rec.childNum);
+    for (int k = 0; k != rec.childNum; k++) {
+        const ChildRecord& childRec = childRecs[rec.childStart + k];
+        ChildShape& child = body.children[k];
+        child.meshId = childRec.meshId;
+        child.density = childRec.density;
+        child.pos = childRec.pos;
+        child.orient = childRec.orient;
+        child.colorOverride = childRec.colorOverride;
+        child.r = childRec.r;
+        child.g = childRec.g;
+        child.b = childRec.b;
+    }
+    body.shapeVersion = rec.shapeVersion;
+    body.colorOverride = rec.colorOverride;
+    body.r = rec.r;
+    body.g = rec.g;
+    body.b = rec.b;
+    body.volume = rec.volume;
+    body.mass = rec.mass;
+    body.cmPos = rec.cmPos;
+    body.cmVel = rec.cmVel;
+    body.angVel = rec.angVel;
+    body.angMom = rec.angMom;
+    body.invInertiaTensor = rec.invInertiaTensor;
+    body.orientMat = rec.orientMat;
+    body.isStatic = rec.isStatic;
+    body.sleeping = rec.sleeping;
+    body.sleepTimer = rec.sleepTimer;
+    body.boundRadius = rec.boundRadius;
+}
+
+//Runs job(0) ... job(jobNum - 1) on all hardware threads
+template <class Job>
+void snapshotJobs(int jobNum, const Job& job) {
+    atomic<int> next(0);
+    auto worker = [&]() {
+        for (int j = next++; j < jobNum; j = next++) job(j);
+    };
+    int threadNum = min(jobNum, int(max(1u, thread::hardware_concurrency())));
+    vector<thread> threads;
+    for (int i = 1; i < threadNum; i++) threads.push_back(thread(worker));
+    worker();
+    for (int i = 0; i != threads.size(); i++) threads[i].join();
+}
+
+//Save
+//Writes meshes, textures, the body pool with the physics world's persistent state, lights and camera.
+//Returns false if the file cannot be written
+bool saveSnapshot(const string& path, PhysicsWorld& physics, const vector<LightSource>& lights, const Camera& cam) {
+    BodyPool& pool = physics.bodies;
+    int meshNum = meshRegistry.size(), texNum = textureRegistry.size(), capacity = pool.capacity();
+
+    //Layout, polygons and texels of each owner placed back to back
+    SnapshotHeader header;
+    memcpy(header.magic, "3DRPSNAP", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = 0x01020304;
+    header.layout = snapshotLayout();
+    vector<uint64_t> meshPolyStart(meshNum), bodyPolyStart(capacity), bodyChildStart(capacity), texelStart(texNum);
+    uint64_t polyNum = 0, texelNum = 0, childNum = 0;
+    for (int i = 0; i != meshNum; i++) {
+        meshPolyStart[i] = polyNum;
+        polyNum += meshRegistry[i].polys.size();
+    }
+    for (int id = 0; id != capacity; id++) {
+        bodyPolyStart[id] = polyNum;
+        polyNum += pool[id].polys.size();
+        bodyChildStart[id] = childNum;
+        childNum += pool[id].children.size();
+    }
+    for (int i = 0; i != texNum; i++) {
+        texelStart[i] = texelNum;
+        texelNum += textureRegistry[i].texels.size();
+    }
+    uint64_t counts[SEC_NUM] = { uint64_t(meshNum), uint64_t(texNum), uint64_t(capacity), uint64_t(capacity), childNum, polyNum, texelNum,
+        pool.freeIds.size(), physics.order.size(), lights.size(), 1 };
+    size_t recordSizes[SEC_NUM] = { sizeof(MeshRecord), sizeof(TextureRecord), sizeof(BodyRecord), sizeof(SlotRecord), sizeof(ChildRecord),
+        sizeof(Polygon), sizeof(Uint32), sizeof(int32_t), sizeof(int32_t), sizeof(LightSource), sizeof(ViewRecord) };
+    uint64_t end = sizeof(SnapshotHeader);
+    for (int s = 0; s != SEC_NUM; s++) {
+        end = (end + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+        header.offset[s] = end;
+        header.count[s] = counts[s];
+        end += counts[s] * recordSizes[s];
+    }
+
+    //A new file reads as zeros, so record padding is written as zeros without clearing it
+    MappedFile file;
+    if (!file.create(path, size_t(end))) return false;
+    memcpy(file.data, &header, sizeof(header));
+    MeshRecord* meshRecs = (MeshRecord*)(file.data + header.offset[SEC_MESHES]);
+    TextureRecord* texRecs = (TextureRecord*)(file.data + header.offset[SEC_TEXTURES]);
+    BodyRecord* bodyRecs = (BodyRecord*)(file.data + header.offset[SEC_BODIES]);
+    SlotRecord* slotRecs = (SlotRecord*)(file.data + header.offset[SEC_SLOTS]);
+    ChildRecord* childRecs = (ChildRecord*)(file.data + header.offset[SEC_CHILDREN]);
+    Polygon* polys = (Polygon*)(file.data + header.offset[SEC_POLYS]);
+    Uint32* texels = (Uint32*)(file.data + header.offset[SEC_TEXELS]);
+
+    //Jobs: one per mesh and texture, one per block of bodies, and the small sections
+    int bodyBlocks = (capacity + SNAPSHOT_BODY_BLOCK - 1) / SNAPSHOT_BODY_BLOCK;
+    snapshotJobs(meshNum + texNum + bodyBlocks + 1, [&](int job) {
+        if (job < meshNum) {
+            const Mesh& mesh = meshRegistry[job];
+            MeshRecord& rec = meshRecs[job];
+            rec.polyStart = meshPolyStart[job];
+            rec.polyNum = mesh.polys.size();
+            rec.volume = mesh.volume;
+            rec.cm = mesh.cm;
+            rec.unitInertiaTensor = mesh.unitInertiaTensor;
+            copy(mesh.polys.begin(), mesh.polys.end(), polys + rec.polyStart);
+            return;
+        }
+        job -= meshNum;
+        if (job < texNum) {
+            const Texture& tex = textureRegistry[job];
+            TextureRecord& rec = texRecs[job];
+            memset(&rec, 0, sizeof(rec));
+            rec.texelStart = texelStart[job];
+            rec.size = tex.size;
+            rec.levelNum = tex.levelNum;
+            for (int l = 0; l != tex.levelNum; l++) rec.levelOffset[l] = tex.levelOffset[l];
+            if (!tex.texels.empty()) memcpy(texels + rec.texelStart, tex.texels.data(), tex.texels.size() * sizeof(Uint32));
+            return;
+        }
+        job -= texNum;
+        if (job < bodyBlocks) {
+            int last = min(capacity, (job + 1) * SNAPSHOT_BODY_BLOCK);
+            for (int id = job * SNAPSHOT_BODY_BLOCK; id != last; id++) {
+                const RigidBody& body = pool[id];
+                BodyRecord& rec = bodyRecs[id];
+                rec.polyStart = bodyPolyStart[id];
+                rec.childStart = bodyChildStart[id];
+                writeBodyRecord(body, rec, childRecs);
+                copy(body.polys.begin(), body.polys.end(), polys + rec.polyStart);
+
+                SlotRecord& slot = slotRecs[id];
+                slot.boundMin = physics.boundMin[id];
+                slot.boundMax = physics.boundMax[id];
+                slot.sleepIsland = physics.sleepIsland[id];
+                slot.alive = pool.alive[id];
+                slot.inOrder = physics.inOrder[id];
+            }
+            return;
+        }
+        int32_t* freeIds = (int32_t*)(file.data + header.offset[SEC_FREE_IDS]);
+        for (int i = 0; i != pool.freeIds.size(); i++) freeIds[i] = pool.freeIds[i];
+        int32_t* order = (int32_t*)(file.data + header.offset[SEC_ORDER]);
+        for (int i = 0; i != physics.order.size(); i++) order[i] = physics.order[i];
+        if (!lights.empty()) memcpy(file.data + header.offset[SEC_LIGHTS], lights.data(), lights.size() * sizeof(LightSource));
+
+        ViewRecord& view = *(ViewRecord*)(file.data + header.offset[SEC_VIEW]);
+        view.eye = cam.eye;
+        view.orientMat = cam.orientMat;
+        view.scale = cam.scale;
+        view.pixelSize = cam.pixelSize;
+        view.width = cam.width;
+        view.height = cam.height;
+        view.euclideanDepth = cam.euclideanDepth;
+        view.gloss = cam.gloss;
+        view.sleepEnabled = physics.sleepEnabled;
+        view.ccdEnabled = physics.ccdEnabled;
+    });
+    return true;
+}
+
+//Restore
+//Replaces the mesh and texture registries, the pool's bodies, the physics world's persistent state, lights and camera.
+//The pool must have the capacity it was saved with. Returns false, leaving everything untouched, if the file is
+//missing, from another version or build, truncated or inconsistent
+bool loadSnapshot(const string& path, PhysicsWorld& physics, vector<LightSource>& lights, Camera& cam) {
+    MappedFile file;
+    if (!file.openRead(path) or file.size < sizeof(SnapshotHeader)) return false;
+    SnapshotHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, "3DRPSNAP", 8) != 0 or header.version != SNAPSHOT_VERSION or header.byteOrder != 0x01020304 or
+        header.layout != snapshotLayout()) return false;
+
+    size_t recordSizes[SEC_NUM] = { sizeof(MeshRecord), sizeof(TextureRecord), sizeof(BodyRecord), sizeof(SlotRecord), sizeof(ChildRecord),
+        sizeof(Polygon), sizeof(Uint32), sizeof(int32_t), sizeof(int32_t), sizeof(LightSource), sizeof(ViewRecord) };
+    for (int s = 0; s != SEC_NUM; s++) {
+        if (header.offset[s] % SNAPSHOT_ALIGN or header.offset[s] > file.size or
+            header.count[s] > (file.size - header.offset[s]) / recordSizes[s]) return false;
+    }
+    BodyPool& pool = physics.bodies;
+    int meshNum = header.count[SEC_MESHES], texNum = header.count[SEC_TEXTURES], capacity = pool.capacity();
+    if (header.count[SEC_BODIES] != capacity or header.count[SEC_SLOTS] != capacity or header.count[SEC_VIEW] != 1 or
+        header.count[SEC_FREE_IDS] > capacity or header.count[SEC_ORDER] > capacity) return false;
+
+    const MeshRecord* meshRecs = (const MeshRecord*)(file.data + header.offset[SEC_MESHES]);
+    const TextureRecord* texRecs = (const TextureRecord*)(file.data + header.offset[SEC_TEXTURES]);
+    const BodyRecord* bodyRecs = (const BodyRecord*)(file.data + header.offset[SEC_BODIES]);
+    const SlotRecord* slotRecs = (const SlotRecord*)(file.data + header.offset[SEC_SLOTS]);
+    const ChildRecord* childRecs = (const ChildRecord*)(file.data + header.offset[SEC_CHILDREN]);
+    const Polygon* polys = (const Polygon*)(file.data + header.offset[SEC_POLYS]);
+    const Uint32* texels = (const Uint32*)(file.data + header.offset[SEC_TEXELS]);
+    const int32_t* freeIds = (const int32_t*)(file.data + header.offset[SEC_FREE_IDS]);
+    const int32_t* order = (const int32_t*)(file.data + header.offset[SEC_ORDER]);
+
+    //Every range read must lie inside its section before anything is replaced
+    uint64_t polyNum = header.count[SEC_POLYS], texelNum = header.count[SEC_TEXELS], childNum = header.count[SEC_CHILDREN];
+    for (int i = 0; i != meshNum; i++) {
+        if (meshRecs[i].polyNum < 0 or meshRecs[i].polyStart + meshRecs[i].polyNum > polyNum) return false;
+    }
+    for (int i = 0; i != texNum; i++) {
+        const TextureRecord& rec = texRecs[i];
+        if (rec.size <= 0 or rec.size > (1 << 15) or (rec.size & (rec.size - 1))) return false;
+        uint64_t levelTexels = 0;
+        int levelNum = 0;
+        for (int s = rec.size; s >= 1; s >>= 1) {
+            if (levelNum == 16 or rec.levelOffset[levelNum] != levelTexels) return false; //levels back to back as TextureRegistry::add lays them out
+            levelTexels += uint64_t(s) * s;
+            levelNum++;
+        }
+        if (rec.levelNum != levelNum or rec.texelStart + levelTexels > texelNum) return false;
+    }
+    for (int i = 0; i != childNum; i++) {
+        if (childRecs[i].meshId < 0 or childRecs[i].meshId >= meshNum) return false;
+    }
+    for (int id = 0; id != capacity; id++) {
+        const BodyRecord& rec = bodyRecs[id];
+        if (rec.polyNum < 0 or rec.meshId >= meshNum or rec.childNum < 0 or rec.childStart + rec.childNum > childNum) return false;
+        if (rec.meshId < 0 and rec.childNum == 0) {
+            if (rec.polyStart + rec.polyNum > polyNum) return false;
+            continue;
+        }
+        //Live instances and compounds draw their meshes' polygons, so polyNum must count exactly those. Dead slots
+        //may still name meshes that were emptied since
+        if (!slotRecs[id].alive) continue;
+        uint64_t meshPolys = rec.meshId >= 0 ? meshRecs[rec.meshId].polyNum : 0;
+        for (int k = 0; k != rec.childNum; k++) meshPolys += meshRecs[childRecs[rec.childStart + k].meshId].polyNum;
+        if (meshPolys != uint64_t(rec.polyNum)) return false;
+    }
+    for (uint64_t i = 0; i != polyNum; i++) {
+        if (polys[i].texId < -1 or polys[i].texId >= texNum) return false;
+    }
+    for (int i = 0; i != header.count[SEC_FREE_IDS]; i++) {
+        if (freeIds[i] < 0 or freeIds[i] >= capacity) return false;
+    }
+    for (int i = 0; i != header.count[SEC_ORDER]; i++) {
+        if (order[i] < 0 or order[i] >= capacity) return false;
+    }
+
+    meshRegistry.meshes.resize(meshNum);
+    textureRegistry.textures.resize(texNum);
+    int bodyBlocks = (capacity + SNAPSHOT_BODY_BLOCK - 1) / SNAPSHOT_BODY_BLOCK;
+    snapshotJobs(meshNum + texNum + bodyBlocks + 1, [&](int job) {
+        if (job < meshNum) {
+            const MeshRecord& rec = meshRecs[job];
+            Mesh& mesh = meshRegistry.meshes[job];
+            mesh.polys.assign(polys + rec.polyStart, polys + rec.polyStart + rec.polyNum);
+            mesh.volume = rec.volume;
+            mesh.cm = rec.cm;
+            mesh.unitInertiaTensor = rec.unitInertiaTensor;
+            return;
+        }
+        job -= meshNum;
+        if (job < texNum) {
+            const TextureRecord& rec = texRecs[job];
+            Texture& tex = textureRegistry.textures[job];
+            int levelTexels = 0;
+            for (int s = rec.size; s >= 1; s >>= 1) levelTexels += s * s;
+            tex.size = rec.size;
+            tex.levelNum = rec.levelNum;
+            tex.texels.assign(texels + rec.texelStart, texels + rec.texelStart + levelTexels);
+            tex.levelOffset.assign(rec.levelOffset, rec.levelOffset + rec.levelNum);
+            return;
+        }
+        job -= texNum;
+        if (job < bodyBlocks) {
+            int last = min(capacity, (job + 1) * SNAPSHOT_BODY_BLOCK);
+            for (int id = job * SNAPSHOT_BODY_BLOCK; id != last; id++) {
+                const BodyRecord& rec = bodyRecs[id];
+                RigidBody& body = pool[id];
+                if (rec.meshId < 0 and rec.childNum == 0) body.polys.assign(polys + rec.polyStart, polys + rec.polyStart + rec.polyNum);
+                else body.polys.clear();
+                readBodyRecord(rec, childRecs, body);
+
+                const SlotRecord& slot = slotRecs[id];
+                physics.boundMin[id] = slot.boundMin;
+                physics.boundMax[id] = slot.boundMax;
+                physics.sleepIsland[id] = slot.sleepIsland;
+            }
+            return;
+        }
+    });
+
+    //Bit-packed flags and the small sections
+    for (int id = 0; id != capacity; id++) {
+        pool.alive[id] = slotRecs[id].alive;
+        physics.inOrder[id] = slotRecs[id].inOrder;
+    }
+    pool.freeIds.assign(freeIds, freeIds + header.count[SEC_FREE_IDS]);
+    physics.order.assign(order, order + header.count[SEC_ORDER]);
+    const LightSource* lightRecs = (const LightSource*)(file.data + header.offset[SEC_LIGHTS]);
+    lights.assign(lightRecs, lightRecs + header.count[SEC_LIGHTS]);
+
+    const ViewRecord& view = *(const ViewRecord*)(file.data + header.offset[SEC_VIEW]);
+    cam.eye = view.eye;
+    cam.orientMat = view.orientMat;
+    cam.scale = view.scale;
+    cam.pixelSize = view.pixelSize;
+    cam.width = view.width;
+    cam.height = view.height;
+    cam.euclideanDepth = view.euclideanDepth;
+    cam.gloss = view.gloss;
+    physics.sleepEnabled = view.sleepEnabled;
+    physics.ccdEnabled = view.ccdEnabled;
+    return true;
+}
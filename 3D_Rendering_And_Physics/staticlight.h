@@ -0,0 +1,137 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "rigidbody.h"
+#include "lightsource.h"
+
+//Static lighting
+//Diffuse light of static lights on static geometry (the renderer's static polygons and bodies flagged isStatic) does
+//not change from frame to frame, so it is baked once into a light map per polygon: a grid of BAKE_MAP_SIZE x
+//BAKE_MAP_SIZE samples over the polygon's plane, indexed by the weights a, b of r2 and r3, for each of the two
+//sides. The rasterizer interpolates the map into the frame buffer and the lighting pass adds only the dynamic
+//lights' diffuse and the gloss of all lights. A map is baked again only when its polygon or body moved or changed
+//shape, or when the static lights changed.
+
+inline float sampleLightMap(const float* map, float a, float b) { //one side's grid, bilinear
+    float fa = min(max(a, 0.f), 1.f) * (BAKE_MAP_SIZE - 1), fb = min(max(b, 0.f), 1.f) * (BAKE_MAP_SIZE - 1);
+    int ia = min(int(fa), BAKE_MAP_SIZE - 2), ib = min(int(fb), BAKE_MAP_SIZE - 2);
+    float wa = fa - ia, wb = fb - ib;
+    const float* row = map + ib * BAKE_MAP_SIZE + ia;
+    return (row[0] * (1.f - wa) + row[1] * wa) * (1.f - wb) + (row[BAKE_MAP_SIZE] * (1.f - wa) + row[BAKE_MAP_SIZE + 1] * wa) * wb;
+}
+//Same diffuse term as shadeFacingPixel, unclamped, side 0 lit along crossProd(r2 - r1, r3 - r1) and side 1 against it
+void bakeLightMap(float* map, const Vec3& r1, const Vec3& r2, const Vec3& r3, const vector<LightSource>& lights) {
+    Vec3 normalVec = crossProd(r2 - r1, r3 - r1);
+    for (int side = 0; side != 2; side++) {
+        Vec3 sideNormal = side ? -1.f * normalVec : normalVec;
+        for (int j = 0; j != BAKE_MAP_SIZE; j++) {
+            for (int i = 0; i != BAKE_MAP_SIZE; i++) {
+                Vec3 pointVec = r1 + (r2 - r1) * (float(i) / (BAKE_MAP_SIZE - 1)) + (r3 - r1) * (float(j) / (BAKE_MAP_SIZE - 1));
+                float illumSum = 0;
+                for (int l = 0; l != lights.size(); l++) {
+                    Vec3 incidentVec = lights[l].r - pointVec;
+                    illumSum += 0.5f * (normDotProd(sideNormal, incidentVec) + 1.f) * lights[l].rad / modSqr(incidentVec);
+                }
+                map[(side * BAKE_MAP_SIZE + j) * BAKE_MAP_SIZE + i] = illumSum;
+            }
+        }
+    }
+}
+
+struct StaticLighting {
+    struct BakedBody { //what a body's maps were baked for
+        bool valid = false;
+        int shapeVersion = 0;
+        Vec3 cmPos;
+        Mat3x3 orientMat;
+    };
+
+    vector<LightSource> staticLights; //the static lights everything was baked with
+    vector<LightSource> scratchLights;
+    vector<Polygon> polysSeen;        //static polygons as baked
+    vector<float> polyMaps;           //BAKE_MAP_FLOATS per static polygon
+    vector<BakedBody> bodiesSeen;     //per slot
+    vector<vector<float>> bodyMaps;   //per slot, BAKE_MAP_FLOATS per polygon over all pieces
+
+    int version = 0; //bumped by every update that baked anything, for caches of rasterized frames
+
+    //Statistics of the last update
+    int polysBaked = 0;
+
+    //Bakes whatever is out of date, nothing when the static scene is unchanged. Call between frames
+    void update(BodyPool& world, const vector<Polygon>& staticPolys, const vector<LightSource>& lights) {
+        polysBaked = 0;
+        scratchLights.clear();
+        for (int l = 0; l != lights.size(); l++) {
+            if (lights[l].isStatic) scratchLights.push_back(lights[l]);
+        }
+        bool lightsChanged = scratchLights.size() != staticLights.size();
+        for (int l = 0; !lightsChanged and l != scratchLights.size(); l++) {
+            lightsChanged = memcmp(&scratchLights[l].r, &staticLights[l].r, sizeof(Vec3)) != 0 or scratchLights[l].rad != staticLights[l].rad;
+        }
+        if (lightsChanged) staticLights = scratchLights;
+
+        //Static polygons, already in world CS
+        bool rebakePolys = lightsChanged;
+        if (polysSeen.size() != staticPolys.size()) {
+            polysSeen.resize(staticPolys.size());
+            polyMaps.resize(staticPolys.size() * BAKE_MAP_FLOATS);
+            rebakePolys = true;
+        }
+        for (int i = 0; i != staticPolys.size(); i++) {
+            const Polygon& poly = staticPolys[i];
+            if (!rebakePolys and memcmp(&poly.r1, &polysSeen[i].r1, sizeof(Vec3)) == 0 and memcmp(&poly.r2, &polysSeen[i].r2, sizeof(Vec3)) == 0 and
+                memcmp(&poly.r3, &polysSeen[i].r3, sizeof(Vec3)) == 0) continue;
+            polysSeen[i] = poly;
+            bakeLightMap(polyMaps.data() + i * BAKE_MAP_FLOATS, poly.r1, poly.r2, poly.r3, staticLights);
+            polysBaked++;
+        }
+
+        //Static bodies, baked in world CS at their current pose
+        bodiesSeen.resize(world.capacity());
+        bodyMaps.resize(world.capacity());
+        for (int id = 0; id != world.capacity(); id++) {
+            BakedBody& seen = bodiesSeen[id];
+            if (!world.alive[id] or !world[id].isStatic) {
+                seen.valid = false;
+                continue;
+            }
+            RigidBody& body = world[id];
+            if (seen.valid and !lightsChanged and seen.shapeVersion == body.shapeVersion and memcmp(&seen.cmPos, &body.cmPos, sizeof(Vec3)) == 0 and
+                memcmp(&seen.orientMat, &body.orientMat, sizeof(Mat3x3)) == 0) continue;
+            seen.valid = true;
+            seen.shapeVersion = body.shapeVersion;
+            seen.cmPos = body.cmPos;
+            seen.orientMat = body.orientMat;
+
+            vector<float>& maps = bodyMaps[id];
+            maps.clear();
+            for (int k = 0; k != body.pieceNum(); k++) {
+                ShapePiece piece = body.shapePiece(k);
+                const vector<Polygon>& shape = *piece.polys;
+                Mat3x3 toWorldMat = body.orientMat * piece.orient;
+                Vec3 displVec = body.orientMat * piece.pos + body.cmPos;
+                for (int i = 0; i != shape.size(); i++) {
+                    maps.resize(maps.size() + BAKE_MAP_FLOATS);
+                    bakeLightMap(maps.data() + maps.size() - BAKE_MAP_FLOATS, toWorldMat * shape[i].r1 + displVec,
+                        toWorldMat * shape[i].r2 + displVec, toWorldMat * shape[i].r3 + displVec, staticLights);
+                    polysBaked++;
+                }
+            }
+        }
+        if (polysBaked) version++;
+    }
+
+    //Maps for the rasterizer, null where nothing is baked
+    const float* polyMap(int i) const {
+        return i < polysSeen.size() ? polyMaps.data() + i * BAKE_MAP_FLOATS : nullptr;
+    }
+    const float* bodyMap(int id) const { //the body's polygons in piece order
+        return id < bodiesSeen.size() and bodiesSeen[id].valid ? bodyMaps[id].data() : nullptr;
+    }
+};
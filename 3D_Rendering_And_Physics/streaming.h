@@ -0,0 +1,556 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+#include "mesh.h"
+#include "rigidbody.h"
+#include "snapshot.h"
+
+//World streaming
+//A world too large to keep in memory is cut into cubic chunks by the bodies' centres of mass. Each chunk is a file
+//holding its bodies and the meshes they use in the snapshot's records, and a manifest lists the chunks with the
+//memory each takes once loaded. A background thread reads and decodes the chunks near the eye, nearest first; the
+//main thread adds finished ones to the mesh registry and the body pool between frames without waiting for the
+//thread, and evicts far chunks to stay under a memory budget. Chunks are immutable: evicted bodies are dropped,
+//not written back, and come back as they were saved. A body whose shape changed since it was loaded is no longer
+//the saved one; it stays in the pool and the chunk comes back without it
+
+enum ChunkSection {
+    CHUNK_MESHES,    //MeshRecord
+    CHUNK_BODIES,    //BodyRecord, meshIds index the chunk's meshes
+    CHUNK_CHILDREN,  //ChildRecord
+    CHUNK_POLYS,     //Polygon, of meshes and of bodies owning theirs
+    CHUNK_SEC_NUM
+};
+
+struct ChunkHeader {
+    char magic[8];
+    uint32_t version;   //SNAPSHOT_VERSION, the records are the snapshot's
+    uint32_t byteOrder;
+    uint32_t layout;
+    uint32_t pad = 0;
+    uint64_t offset[CHUNK_SEC_NUM];
+    uint64_t count[CHUNK_SEC_NUM];
+};
+struct WorldHeader { //the manifest, followed by a ChunkRecord per chunk
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t layout;
+    float chunkSize;
+    uint64_t chunkNum;
+};
+struct ChunkRecord {
+    int32_t ix, iy, iz;  //the chunk spans [ix, ix + 1) * chunkSize and so on
+    int32_t bodyNum;
+    uint64_t bytes;      //heap its meshes and bodies take once loaded
+};
+
+inline string worldManifestPath(const string& prefix) {
+    return prefix + ".world";
+}
+inline string worldChunkPath(const string& prefix, int ix, int iy, int iz) {
+    return prefix + "." + to_string(ix) + "." + to_string(iy) + "." + to_string(iz) + ".chunk";
+}
+
+//Save
+//Writes one chunk of the given bodies and the meshes they instance, returns false if the file cannot be written
+bool saveChunk(const string& path, BodyPool& pool, const vector<int>& ids, uint64_t& bytes) {
+    //Local mesh ids in order of first use
+    vector<int> meshes, localId(meshRegistry.size(), -1);
+    auto useMesh = [&](int meshId) {
+        if (meshId >= 0 and localId[meshId] < 0) {
+            localId[meshId] = meshes.size();
+            meshes.push_back(meshId);
+        }
+    };
+    for (size_t i = 0; i != ids.size(); i++) {
+        const RigidBody& body = pool[ids[i]];
+        useMesh(body.meshId);
+        for (size_t k = 0; k != body.children.size(); k++) useMesh(body.children[k].meshId);
+    }
+
+    //Layout, as in saveSnapshot
+    ChunkHeader header;
+    memcpy(header.magic, "3DRPCHNK", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = 0x01020304;
+    header.layout = snapshotLayout();
+    uint64_t polyNum = 0, childNum = 0;
+    bytes = 0;
+    for (size_t m = 0; m != meshes.size(); m++) {
+        polyNum += meshRegistry[meshes[m]].polys.size();
+        bytes += sizeof(Mesh) + meshRegistry[meshes[m]].polys.size() * sizeof(Polygon);
+    }
+    for (size_t i = 0; i != ids.size(); i++) {
+        const RigidBody& body = pool[ids[i]];
+        polyNum += body.polys.size();
+        childNum += body.children.size();
+        bytes += sizeof(RigidBody) + body.polys.size() * sizeof(Polygon) + body.children.size() * sizeof(ChildShape);
+    }
+    uint64_t counts[CHUNK_SEC_NUM] = { meshes.size(), ids.size(), childNum, polyNum };
+    size_t recordSizes[CHUNK_SEC_NUM] = { sizeof(MeshRecord), sizeof(BodyRecord), sizeof(ChildRecord), sizeof(Polygon) };
+    uint64_t end = sizeof(ChunkHeader);
+    for (int s = 0; s != CHUNK_SEC_NUM; s++) {
+        end = (end + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+        header.offset[s] = end;
+        header.count[s] = counts[s];
+        end += counts[s] * recordSizes[s];
+    }
+
+    MappedFile file;
+    if (!file.create(path, size_t(end))) return false;
+    memcpy(file.data, &header, sizeof(header));
+    MeshRecord* meshRecs = (MeshRecord*)(file.data + header.offset[CHUNK_MESHES]);
+    BodyRecord* bodyRecs = (BodyRecord*)(file.data + header.offset[CHUNK_BODIES]);
+    ChildRecord* childRecs = (ChildRecord*)(file.data + header.offset[CHUNK_CHILDREN]);
+    Polygon* polys = (Polygon*)(file.data + header.offset[CHUNK_POLYS]);
+    uint64_t polyStart = 0, childStart = 0;
+    for (size_t m = 0; m != meshes.size(); m++) {
+        const Mesh& mesh = meshRegistry[meshes[m]];
+        MeshRecord& rec = meshRecs[m];
+        rec.polyStart = polyStart;
+        rec.polyNum = mesh.polys.size();
+        rec.volume = mesh.volume;
+        rec.cm = mesh.cm;
+        rec.unitInertiaTensor = mesh.unitInertiaTensor;
+        copy(mesh.polys.begin(), mesh.polys.end(), polys + rec.polyStart);
+        polyStart += rec.polyNum;
+    }
+    for (size_t i = 0; i != ids.size(); i++) {
+        const RigidBody& body = pool[ids[i]];
+        BodyRecord& rec = bodyRecs[i];
+        rec.polyStart = polyStart;
+        rec.childStart = childStart;
+        writeBodyRecord(body, rec, childRecs);
+        if (body.meshId >= 0) rec.meshId = localId[body.meshId];
+        for (int k = 0; k != rec.childNum; k++) childRecs[childStart + k].meshId = localId[body.children[k].meshId];
+        copy(body.polys.begin(), body.polys.end(), polys + rec.polyStart);
+        polyStart += body.polys.size();
+        childStart += rec.childNum;
+    }
+    return true;
+}
+
+//Cuts the pool's alive bodies into chunks of chunkSize and writes them with their manifest under prefix.
+//Returns false if a file cannot be written
+bool saveWorldChunks(const string& prefix, BodyPool& pool, float chunkSize) {
+    struct BodyCell {
+        int ix, iy, iz, id;
+    };
+    vector<BodyCell> cells;
+    for (int id = 0; id != pool.capacity(); id++) {
+        if (!pool.alive[id]) continue;
+        Vec3 pos = pool[id].cmPos / chunkSize;
+        cells.push_back({ int(floorf(pos.x)), int(floorf(pos.y)), int(floorf(pos.z)), id });
+    }
+    sort(cells.begin(), cells.end(), [](const BodyCell& a, const BodyCell& b) {
+        return a.ix != b.ix ? a.ix < b.ix : a.iy != b.iy ? a.iy < b.iy : a.iz != b.iz ? a.iz < b.iz : a.id < b.id;
+    });
+
+    vector<ChunkRecord> records;
+    vector<int> ids;
+    for (size_t first = 0, last = 0; first != cells.size(); first = last) {
+        const BodyCell& cell = cells[first];
+        ids.clear();
+        for (last = first; last != cells.size() and cells[last].ix == cell.ix and cells[last].iy == cell.iy and cells[last].iz == cell.iz; last++) {
+            ids.push_back(cells[last].id);
+        }
+        ChunkRecord rec;
+        rec.ix = cell.ix;
+        rec.iy = cell.iy;
+        rec.iz = cell.iz;
+        rec.bodyNum = ids.size();
+        if (!saveChunk(worldChunkPath(prefix, cell.ix, cell.iy, cell.iz), pool, ids, rec.bytes)) return false;
+        records.push_back(rec);
+    }
+
+    WorldHeader header;
+    memcpy(header.magic, "3DRPWRLD", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = 0x01020304;
+    header.layout = snapshotLayout();
+    header.chunkSize = chunkSize;
+    header.chunkNum = records.size();
+    MappedFile file;
+    if (!file.create(worldManifestPath(prefix), sizeof(header) + records.size() * sizeof(ChunkRecord))) return false;
+    memcpy(file.data, &header, sizeof(header));
+    if (!records.empty()) memcpy(file.data + sizeof(header), records.data(), records.size() * sizeof(ChunkRecord));
+    return true;
+}
+
+//Load
+//A chunk decoded off the main thread, its bodies' meshIds still indexing its own meshes
+struct LoadedChunk {
+    int chunk = -1;
+    bool ok = false;
+    vector<Mesh> meshes;
+    vector<RigidBody> bodies;
+    double ioMs = 0; //reading and decoding
+};
+
+//Returns false if the file is missing, from another version or build, or truncated
+bool readChunk(const string& path, LoadedChunk& out) {
+    MappedFile file;
+    if (!file.openRead(path) or file.size < sizeof(ChunkHeader)) return false;
+    ChunkHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, "3DRPCHNK", 8) != 0 or header.version != SNAPSHOT_VERSION or header.byteOrder != 0x01020304 or
+        header.layout != snapshotLayout()) return false;
+    size_t recordSizes[CHUNK_SEC_NUM] = { sizeof(MeshRecord), sizeof(BodyRecord), sizeof(ChildRecord), sizeof(Polygon) };
+    for (int s = 0; s != CHUNK_SEC_NUM; s++) {
+        if (header.offset[s] % SNAPSHOT_ALIGN or header.offset[s] > file.size or
+            header.count[s] > (file.size - header.offset[s]) / recordSizes[s]) return false;
+    }
+
+    const MeshRecord* meshRecs = (const MeshRecord*)(file.data + header.offset[CHUNK_MESHES]);
+    const BodyRecord* bodyRecs = (const BodyRecord*)(file.data + header.offset[CHUNK_BODIES]);
+    const ChildRecord* childRecs = (const ChildRecord*)(file.data + header.offset[CHUNK_CHILDREN]);
+    const Polygon* polys = (const Polygon*)(file.data + header.offset[CHUNK_POLYS]);
+    int meshNum = header.count[CHUNK_MESHES], bodyNum = header.count[CHUNK_BODIES];
+    uint64_t polyNum = header.count[CHUNK_POLYS], childNum = header.count[CHUNK_CHILDREN];
+    for (int i = 0; i != meshNum; i++) {
+        if (meshRecs[i].polyNum < 0 or meshRecs[i].polyStart + meshRecs[i].polyNum > polyNum) return false;
+    }
+    for (int i = 0; i != bodyNum; i++) {
+        const BodyRecord& rec = bodyRecs[i];
+        if (rec.polyNum < 0 or rec.meshId >= meshNum or rec.childNum < 0 or rec.childStart + rec.childNum > childNum or
+            (rec.meshId < 0 and rec.childNum == 0 and rec.polyStart + rec.polyNum > polyNum)) return false;
+    }
+    for (uint64_t i = 0; i != childNum; i++) {
+        if (childRecs[i].meshId < 0 or childRecs[i].meshId >= meshNum) return false;
+    }
+
+    out.meshes.resize(meshNum);
+    for (int i = 0; i != meshNum; i++) {
+        const MeshRecord& rec = meshRecs[i];
+        Mesh& mesh = out.meshes[i];
+        mesh.polys.assign(polys + rec.polyStart, polys + rec.polyStart + rec.polyNum);
+        mesh.volume = rec.volume;
+        mesh.cm = rec.cm;
+        mesh.unitInertiaTensor = rec.unitInertiaTensor;
+    }
+    out.bodies.resize(bodyNum);
+    for (int i = 0; i != bodyNum; i++) {
+        const BodyRecord& rec = bodyRecs[i];
+        RigidBody& body = out.bodies[i];
+        if (rec.meshId < 0 and rec.childNum == 0) body.polys.assign(polys + rec.polyStart, polys + rec.polyStart + rec.polyNum);
+        readBodyRecord(rec, childRecs, body);
+    }
+    return true;
+}
+
+//Streamer
+struct StreamStats {
+    double stallMs = 0, maxStallMs = 0;     //main thread time spent in the last update, and the worst so far
+    double latencyMs = 0, maxLatencyMs = 0; //request to integration of the last chunk loaded, and the worst so far
+    double latencySumMs = 0;
+    double ioMs = 0, ioSumMs = 0;           //reading and decoding of the last chunk loaded, on the I/O thread
+    long long residentBytes = 0, peakBytes = 0;
+    int residentChunks = 0, pendingChunks = 0;
+    long long loads = 0, evictions = 0, failures = 0;
+};
+
+struct ChunkStreamer {
+    enum ChunkState {
+        CHUNK_UNLOADED,
+        CHUNK_PENDING,  //requested, being read or waiting to be integrated
+        CHUNK_RESIDENT
+    };
+    struct Chunk {
+        Vec3 boxMin, boxMax;
+        uint64_t bytes = 0;
+        int bodyNum = 0;
+        ChunkState state = CHUNK_UNLOADED;
+        bool failed = false; //unreadable, not requested again
+        chrono::steady_clock::time_point requested;
+        vector<int> meshIds;                 //registry entries of the chunk's meshes, kept empty while evicted and refilled on reload
+        vector<char> meshKept;               //used by a survivor, so never emptied again
+        vector<int> bodyIds, bodyVersions;   //pool slots and their shape versions while resident, -1 for survivors
+        vector<char> survived;               //per saved body, outlived an eviction by changing shape and is not loaded again
+    };
+
+    BodyPool& pool;
+    long long budget;      //bytes resident and pending chunks may take
+    float loadRadius;      //chunks closer to the eye than this are loaded
+    float evictRadius;     //and farther than this evicted, whatever the budget
+    vector<Chunk> chunks;
+    vector<string> paths;  //never changed once opened, so the I/O thread reads them freely
+    StreamStats stats;
+
+    //Main thread only
+    vector<float> dist;
+    vector<int> nearby, outbox;
+    vector<unique_ptr<LoadedChunk>> arrived;
+    long long pendingBytes = 0;
+
+    //Shared with the I/O thread, under m
+    mutex m;
+    condition_variable cv;
+    vector<int> requests;
+    vector<unique_ptr<LoadedChunk>> ready;
+    Vec3 requestEye;
+    bool quit = false;
+    thread io; //started by open once the members above exist
+
+    ChunkStreamer(BodyPool& bodyPool, long long memoryBudget = STREAM_MEMORY_BUDGET, float load = STREAM_LOAD_RADIUS, float evict = STREAM_EVICT_RADIUS) :
+        pool(bodyPool), budget(memoryBudget), loadRadius(load), evictRadius(evict) {}
+    ChunkStreamer(const ChunkStreamer&) = delete;
+    ChunkStreamer& operator=(const ChunkStreamer&) = delete;
+    ~ChunkStreamer() {
+        if (!io.joinable()) return;
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+        }
+        cv.notify_all();
+        io.join();
+    }
+
+    //Reads the manifest written by saveWorldChunks and starts the I/O thread. Nothing is loaded before the first
+    //update. Returns false if the manifest is missing, from another version or build, or truncated
+    bool open(const string& prefix) {
+        if (io.joinable()) return false;
+        MappedFile file;
+        if (!file.openRead(worldManifestPath(prefix)) or file.size < sizeof(WorldHeader)) return false;
+        WorldHeader header;
+        memcpy(&header, file.data, sizeof(header));
+        if (memcmp(header.magic, "3DRPWRLD", 8) != 0 or header.version != SNAPSHOT_VERSION or header.byteOrder != 0x01020304 or
+            header.layout != snapshotLayout() or !(header.chunkSize > 0) or header.chunkNum > (file.size - sizeof(header)) / sizeof(ChunkRecord)) return false;
+
+        const ChunkRecord* records = (const ChunkRecord*)(file.data + sizeof(header));
+        chunks.resize(header.chunkNum);
+        paths.resize(header.chunkNum);
+        dist.resize(header.chunkNum);
+        for (size_t c = 0; c != chunks.size(); c++) {
+            const ChunkRecord& rec = records[c];
+            chunks[c].boxMin = Vec3(float(rec.ix), float(rec.iy), float(rec.iz)) * header.chunkSize;
+            chunks[c].boxMax = chunks[c].boxMin + Vec3(header.chunkSize, header.chunkSize, header.chunkSize);
+            chunks[c].bytes = rec.bytes;
+            chunks[c].bodyNum = rec.bodyNum;
+            paths[c] = worldChunkPath(prefix, rec.ix, rec.iy, rec.iz);
+        }
+        io = thread(&ChunkStreamer::ioLoop, this);
+        return true;
+    }
+
+    float boxDistance(int c, const Vec3& eye) const {
+        const Chunk& chunk = chunks[c];
+        Vec3 d(max(max(chunk.boxMin.x - eye.x, eye.x - chunk.boxMax.x), 0.f), max(max(chunk.boxMin.y - eye.y, eye.y - chunk.boxMax.y), 0.f),
+            max(max(chunk.boxMin.z - eye.z, eye.z - chunk.boxMax.z), 0.f));
+        return sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+    }
+
+    //I/O thread: the pending request nearest to the latest eye first
+    void ioLoop() {
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [this] { return quit or !requests.empty(); });
+            if (quit) return;
+            size_t best = 0;
+            for (size_t i = 1; i != requests.size(); i++) {
+                if (boxDistance(requests[i], requestEye) < boxDistance(requests[best], requestEye)) best = i;
+            }
+            unique_ptr<LoadedChunk> loaded(new LoadedChunk());
+            loaded->chunk = requests[best];
+            requests.erase(requests.begin() + best);
+            lock.unlock();
+
+            auto t1 = chrono::steady_clock::now();
+            loaded->ok = readChunk(paths[loaded->chunk], *loaded);
+            loaded->ioMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+
+            lock.lock();
+            ready.push_back(move(loaded));
+        }
+    }
+
+    //Main thread, between frames: integrates up to STREAM_INTEGRATE_PER_FRAME finished chunks, evicts far ones and
+    //requests near ones. Never waits for the I/O thread; if it holds the lock, the exchange is left for the next call
+    void update(const Vec3& eye) {
+        auto t1 = chrono::steady_clock::now();
+        for (size_t c = 0; c != chunks.size(); c++) dist[c] = boxDistance(c, eye);
+
+        //Whatever left the evict radius goes, resident or not yet sent
+        for (size_t c = 0; c != chunks.size(); c++) {
+            if (chunks[c].state == CHUNK_RESIDENT and dist[c] > evictRadius) evict(c);
+        }
+        for (size_t i = 0; i != outbox.size(); i++) {
+            if (dist[outbox[i]] > evictRadius) {
+                cancel(outbox[i]);
+                outbox.erase(outbox.begin() + i--);
+            }
+        }
+
+        //Requests, nearest first, evicting resident chunks farther than the requested one while over the budget
+        nearby.clear();
+        for (size_t c = 0; c != chunks.size(); c++) {
+            if (chunks[c].state == CHUNK_UNLOADED and !chunks[c].failed and dist[c] <= loadRadius) nearby.push_back(c);
+        }
+        sort(nearby.begin(), nearby.end(), [this](int a, int b) { return dist[a] < dist[b]; });
+        for (size_t i = 0; i != nearby.size(); i++) {
+            Chunk& chunk = chunks[nearby[i]];
+            while (stats.residentBytes + pendingBytes + (long long)chunk.bytes > budget and evictFarthest(dist[nearby[i]]));
+            if (stats.residentBytes + pendingBytes + (long long)chunk.bytes > budget) break;
+            chunk.state = CHUNK_PENDING;
+            chunk.requested = chrono::steady_clock::now();
+            pendingBytes += chunk.bytes;
+            outbox.push_back(nearby[i]);
+        }
+
+        //Exchange with the I/O thread
+        {
+            unique_lock<mutex> lock(m, try_to_lock);
+            if (lock.owns_lock()) {
+                for (size_t i = 0; i != ready.size(); i++) arrived.push_back(move(ready[i]));
+                ready.clear();
+                for (size_t i = 0; i != requests.size(); i++) {
+                    if (dist[requests[i]] > evictRadius) {
+                        cancel(requests[i]);
+                        requests.erase(requests.begin() + i--);
+                    }
+                }
+                requests.insert(requests.end(), outbox.begin(), outbox.end());
+                requestEye = eye;
+                if (!outbox.empty()) cv.notify_one();
+                outbox.clear();
+            }
+        }
+
+        //Integration, oldest first. A chunk that has gone out of range meanwhile is dropped, one the pool has no
+        //room for waits until eviction made some
+        int integrated = 0;
+        while (!arrived.empty() and integrated != STREAM_INTEGRATE_PER_FRAME) {
+            LoadedChunk& loaded = *arrived.front();
+            Chunk& chunk = chunks[loaded.chunk];
+            if (!loaded.ok or dist[loaded.chunk] > evictRadius) {
+                if (!loaded.ok) {
+                    chunk.failed = true;
+                    stats.failures++;
+                }
+                cancel(loaded.chunk);
+            }
+            else {
+                while (pool.freeIds.size() < loaded.bodies.size() and evictFarthest(dist[loaded.chunk]));
+                if (pool.freeIds.size() < loaded.bodies.size()) break;
+                integrate(loaded);
+                integrated++;
+            }
+            arrived.erase(arrived.begin());
+        }
+
+        stats.residentChunks = stats.pendingChunks = 0;
+        for (size_t c = 0; c != chunks.size(); c++) {
+            stats.residentChunks += chunks[c].state == CHUNK_RESIDENT;
+            stats.pendingChunks += chunks[c].state == CHUNK_PENDING;
+        }
+        stats.stallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count();
+        stats.maxStallMs = max(stats.maxStallMs, stats.stallMs);
+    }
+
+    //Meshes are moved into their registry entries and bodies' polygons into the pool's slots, nothing is copied
+    //per polygon on the main thread
+    void integrate(LoadedChunk& loaded) {
+        Chunk& chunk = chunks[loaded.chunk];
+        if (chunk.meshIds.size() != loaded.meshes.size()) { //first load, later loads refill the same entries
+            chunk.meshIds.resize(loaded.meshes.size());
+            chunk.meshKept.assign(loaded.meshes.size(), 0);
+            chunk.survived.assign(loaded.bodies.size(), 0);
+            for (size_t m = 0; m != loaded.meshes.size(); m++) {
+                chunk.meshIds[m] = meshRegistry.size();
+                meshRegistry.meshes.push_back(Mesh());
+            }
+        }
+        for (size_t m = 0; m != loaded.meshes.size(); m++) {
+            if (!chunk.meshKept[m]) meshRegistry.meshes[chunk.meshIds[m]] = move(loaded.meshes[m]);
+        }
+
+        vector<Polygon> polys;
+        for (size_t b = 0; b != loaded.bodies.size(); b++) {
+            RigidBody& body = loaded.bodies[b];
+            if (chunk.survived[b]) {
+                chunk.bodyIds.push_back(-1);
+                chunk.bodyVersions.push_back(0);
+                continue;
+            }
+            if (body.meshId >= 0) body.meshId = chunk.meshIds[body.meshId];
+            for (size_t k = 0; k != body.children.size(); k++) body.children[k].meshId = chunk.meshIds[body.children[k].meshId];
+            polys.swap(body.polys);
+            int id = pool.create(body);
+            pool[id].polys.swap(polys);
+            chunk.bodyIds.push_back(id);
+            chunk.bodyVersions.push_back(pool[id].shapeVersion);
+        }
+
+        chunk.state = CHUNK_RESIDENT;
+        pendingBytes -= chunk.bytes;
+        stats.residentBytes += chunk.bytes;
+        stats.peakBytes = max(stats.peakBytes, stats.residentBytes);
+        stats.latencyMs = chrono::duration<double, milli>(chrono::steady_clock::now() - chunk.requested).count();
+        stats.maxLatencyMs = max(stats.maxLatencyMs, stats.latencyMs);
+        stats.latencySumMs += stats.latencyMs;
+        stats.ioMs = loaded.ioMs;
+        stats.ioSumMs += loaded.ioMs;
+        stats.loads++;
+    }
+
+    //Bodies still holding the shape they were created with are destroyed, their slots' polygons freed. Bodies whose
+    //shape changed survive: they are skipped when the chunk is loaded again, and the meshes they use stay resident
+    void evict(int c) {
+        Chunk& chunk = chunks[c];
+        for (size_t i = 0; i != chunk.bodyIds.size(); i++) {
+            int id = chunk.bodyIds[i];
+            if (id < 0 or !pool.alive[id]) continue;
+            if (pool[id].shapeVersion != chunk.bodyVersions[i]) {
+                chunk.survived[i] = 1;
+                keepMeshes(chunk, pool[id]);
+                continue;
+            }
+            pool.destroy(id);
+            vector<Polygon>().swap(pool[id].polys);
+            vector<ChildShape>().swap(pool[id].children);
+        }
+        for (size_t m = 0; m != chunk.meshIds.size(); m++) {
+            if (!chunk.meshKept[m]) vector<Polygon>().swap(meshRegistry.meshes[chunk.meshIds[m]].polys);
+        }
+        chunk.bodyIds.clear();
+        chunk.bodyVersions.clear();
+        chunk.state = CHUNK_UNLOADED;
+        stats.residentBytes -= chunk.bytes;
+        stats.evictions++;
+    }
+    void keepMeshes(Chunk& chunk, const RigidBody& body) {
+        auto keep = [&](int meshId) {
+            for (size_t m = 0; m != chunk.meshIds.size(); m++) {
+                if (chunk.meshIds[m] == meshId) chunk.meshKept[m] = 1;
+            }
+        };
+        keep(body.meshId);
+        for (size_t k = 0; k != body.children.size(); k++) keep(body.children[k].meshId);
+    }
+    bool evictFarthest(float beyond) { //returns false if no resident chunk is farther than beyond
+        int farthest = -1;
+        for (size_t c = 0; c != chunks.size(); c++) {
+            if (chunks[c].state == CHUNK_RESIDENT and dist[c] > beyond and (farthest < 0 or dist[c] > dist[farthest])) farthest = c;
+        }
+        if (farthest < 0) return false;
+        evict(farthest);
+        return true;
+    }
+    void cancel(int c) { //a pending chunk back to unloaded
+        chunks[c].state = CHUNK_UNLOADED;
+        pendingBytes -= chunks[c].bytes;
+    }
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cmath>
+#include <SDL.h>
+#include "parameters.h"
+#include "mylinal.h"
+#include "polygon.h"
+
+//Morton order
+//Interleaving the bits of x and y keeps texels that are close in 2D close in memory: a 4x4 block of
+//texels is one 64 byte cache line whichever direction a rotated surface walks the texture in
+inline unsigned spreadBits(unsigned v) { //...dcba -> ...0d0c0b0a, for v < 2^16
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+inline unsigned mortonIndex(unsigned x, unsigned y) {
+    return spreadBits(x) | spreadBits(y) << 1;
+}
+
+atomic<long long> texelsFetched(0); //running total of texel reads, see also allocCount
+
+//Per-pixel texture coordinates written by the rasterizer and resolved in the lighting pass
+struct TexSample {
+    float u, v;
+    short texId; //-1 for untextured pixels
+    short level; //mip level picked from the pixel's footprint
+};
+
+//Texture
+//Square power of two texture with its whole mip chain, every level stored in Morton order.
+//Coordinates wrap, so UVs outside [0, 1) repeat the texture
+struct Texture {
+    int size = 0; //of level 0
+    int levelNum = 0;
+    vector<Uint32> texels; //0x00RRGGBB, all levels back to back
+    vector<int> levelOffset;
+
+    inline Uint32 texel(int level, int x, int y) const {
+        unsigned mask = (size >> level) - 1;
+        return texels[levelOffset[level] + mortonIndex(x & mask, y & mask)];
+    }
+
+    //Mip level for a pixel covering footprintSqr squared texels of level 0
+    inline int levelFor(float footprintSqr) const {
+        if (!(footprintSqr > 1.f)) return 0; //also catches NaN
+        return min(levelNum - 1, ilogb(footprintSqr) / 2); //floor(log2(sqrt(footprintSqr)))
+    }
+
+    //Bilinear sample of one level, u and v in texture units (1 is the whole texture)
+    Uint32 sample(float u, float v, int level) const {
+        int levelSize = size >> level;
+        unsigned mask = levelSize - 1;
+        const Uint32* base = &texels[levelOffset[level]];
+
+        float fx = u * levelSize - 0.5f, fy = v * levelSize - 0.5f;
+        int x = int(fx), y = int(fy);
+        x -= fx < x; //floor for negative coordinates
+        y -= fy < y;
+        int wx = int((fx - x) * 256.f), wy = int((fy - y) * 256.f);
+
+        //The Morton index is the x and y bit spreads or-ed together, so each is computed once for both neighbours
+        unsigned mx0 = spreadBits(x & mask), mx1 = spreadBits((x + 1) & mask);
+        unsigned my0 = spreadBits(y & mask) << 1, my1 = spreadBits((y + 1) & mask) << 1;
+        Uint32 t00 = base[mx0 | my0], t10 = base[mx1 | my0], t01 = base[mx0 | my1], t11 = base[mx1 | my1];
+
+        Uint32 result = 0;
+        for (int shift = 0; shift != 24; shift += 8) {
+            int top = (t00 >> shift & 0xff) * (256 - wx) + (t10 >> shift & 0xff) * wx;
+            int bottom = (t01 >> shift & 0xff) * (256 - wx) + (t11 >> shift & 0xff) * wx;
+            result |= Uint32((top * (256 - wy) + bottom * wy) >> 16) << shift;
+        }
+        return result;
+    }
+};
+
+//Texture registry
+struct TextureRegistry {
+    vector<Texture> textures;
+
+    //pixels is size x size 0x00RRGGBB in rows, size must be a power of two.
+    //Builds the mip chain (2x2 box filter per level) and returns the handle, -1 if the input is not usable
+    int add(int size, const vector<Uint32>& pixels) {
+        if (size <= 0 or size > (1 << 15) or (size & (size - 1)) or pixels.size() != size_t(size) * size) return -1;
+
+        Texture tex;
+        tex.size = size;
+        vector<Uint32> level(pixels), next;
+        for (int s = size; s >= 1; s >>= 1) {
+            tex.levelOffset.push_back(tex.texels.size());
+            tex.texels.resize(tex.texels.size() + s * s);
+            Uint32* dst = &tex.texels[tex.levelOffset.back()];
+            for (int y = 0; y != s; y++) {
+                for (int x = 0; x != s; x++) dst[mortonIndex(x, y)] = level[y * s + x];
+            }
+            if (s == 1) break;
+
+            int half = s / 2;
+            next.assign(half * half, 0);
+            for (int y = 0; y != half; y++) {
+                for (int x = 0; x != half; x++) {
+                    Uint32 quad[4] = { level[2 * y * s + 2 * x], level[2 * y * s + 2 * x + 1], level[(2 * y + 1) * s + 2 * x], level[(2 * y + 1) * s + 2 * x + 1] };
+                    Uint32 avg = 0;
+                    for (int shift = 0; shift != 24; shift += 8) {
+                        Uint32 sum = 2;
+                        for (int k = 0; k != 4; k++) sum += quad[k] >> shift & 0xff;
+                        avg |= (sum / 4) << shift;
+                    }
+                    next[y * half + x] = avg;
+                }
+            }
+            level.swap(next);
+        }
+        tex.levelNum = tex.levelOffset.size();
+
+        textures.push_back(tex);
+        return textures.size() - 1;
+    }
+    const Texture& operator[](int id) const {
+        return textures[id];
+    }
+    int size() const {
+        return textures.size();
+    }
+};
+TextureRegistry textureRegistry;
+
+//Procedural textures
+vector<Uint32> checkerPixels(int size, int cells, Uint32 color1, Uint32 color2) {
+    vector<Uint32> pixels(size * size);
+    int cellSize = max(1, size / cells);
+    for (int y = 0; y != size; y++) {
+        for (int x = 0; x != size; x++) pixels[y * size + x] = (x / cellSize + y / cellSize) % 2 ? color2 : color1;
+    }
+    return pixels;
+}
+
+//Box mapping: every polygon is projected along the axis its normal is closest to,
+//one texture repeat per tileSize units
+void boxMapUVs(vector<Polygon>& polys, float tileSize, int texId) {
+    for (int i = 0; i != polys.size(); i++) {
+        Polygon& poly = polys[i];
+        Vec3 normalVec = crossProd(poly.r2 - poly.r1, poly.r3 - poly.r1);
+        float ax = fabsf(normalVec.x), ay = fabsf(normalVec.y), az = fabsf(normalVec.z);
+        const Vec3* verts[3] = { &poly.r1, &poly.r2, &poly.r3 };
+        float* uvs[3][2] = { { &poly.u1, &poly.v1 }, { &poly.u2, &poly.v2 }, { &poly.u3, &poly.v3 } };
+        for (int k = 0; k != 3; k++) {
+            const Vec3& r = *verts[k];
+            if (ax >= ay and ax >= az) { *uvs[k][0] = r.y / tileSize; *uvs[k][1] = r.z / tileSize; }
+            else if (ay >= az) { *uvs[k][0] = r.x / tileSize; *uvs[k][1] = r.z / tileSize; }
+            else { *uvs[k][0] = r.x / tileSize; *uvs[k][1] = r.y / tileSize; }
+        }
+        poly.texId = texId;
+    }
+}
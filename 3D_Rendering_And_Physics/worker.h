@@ -0,0 +1,81 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+//Worker
+//Persistent thread running one job at a time. Jobs are a plain function pointer and argument
+//so handing one over never allocates.
+struct Worker {
+    mutex m;
+    condition_variable cv;
+    void (*job)(void*) = nullptr;
+    void* arg = nullptr;
+    bool busy = false;
+    bool quit = false;
+    thread th; //declared last so the members above exist before the thread starts
+
+    Worker() {
+        th = thread(&Worker::loop, this);
+    }
+    Worker(const Worker&) = delete;
+    Worker& operator=(const Worker&) = delete;
+    ~Worker() {
+        wait();
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+        }
+        cv.notify_all();
+        th.join();
+    }
+
+    void run(void (*fn)(void*), void* fnArg) {
+        wait();
+        {
+            lock_guard<mutex> lock(m);
+            job = fn;
+            arg = fnArg;
+            busy = true;
+        }
+        cv.notify_all();
+    }
+    void wait() {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] { return !busy; });
+    }
+    void loop() {
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [this] { return busy or quit; });
+            if (!busy) return;
+
+            lock.unlock();
+            job(arg);
+            lock.lock();
+
+            busy = false;
+            cv.notify_all();
+        }
+    }
+};
+
+//Worker pool
+//Workers for data-parallel jobs, kept between calls. run() hands the job to threadNum - 1 workers, runs it on
+//the calling thread too and returns when every copy is done; the job splits the work itself. Workers are only
+//created when a call asks for more than before.
+struct WorkerPool {
+    vector<unique_ptr<Worker>> workers;
+
+    void run(void (*fn)(void*), void* fnArg, int threadNum) {
+        while (int(workers.size()) < threadNum - 1) workers.emplace_back(new Worker());
+        for (int i = 0; i < threadNum - 1; i++) workers[i]->run(fn, fnArg);
+        fn(fnArg);
+        for (int i = 0; i < threadNum - 1; i++) workers[i]->wait();
+    }
+};